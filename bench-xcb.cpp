@@ -0,0 +1,195 @@
+/*
+    Microbenchmark of libxcb-randr's split engine, see bench.h. Measures
+    buildFakeResources() and makeReturnValue() for a screen whose outputs
+    all match the configuration, building each layout from scratch.
+*/
+
+#include "libxcb-randr.cpp"
+#include "bench.h"
+
+namespace
+{
+
+xcb_randr_get_screen_resources_reply_t* bench_resources;
+size_t bench_resources_size;
+int bench_sequence;
+
+// Any non-null pointer does, the synthetic server below never looks at it
+xcb_connection_t* const bench_connection=reinterpret_cast<xcb_connection_t*>(&bench_resources);
+
+constexpr uint32_t bench_output(int i) { return 0x40 + i; }
+constexpr uint32_t bench_crtc(int i) { return 0x400 + i; }
+constexpr uint32_t bench_mode(int i) { return 0x800 + i; }
+constexpr xcb_atom_t bench_edid_atom=77;
+
+/*
+    The synthetic X server behind the _xcb_randr_* pointers. Cookies carry
+    the XID asked for. The core functions libxcb-randr.cpp calls directly are
+    replaced for the whole program.
+*/
+template<typename Reply>
+Reply* bench_reply(size_t extra)
+{
+    const auto reply=static_cast<Reply*>(calloc(1, sizeof(Reply)+extra));
+    reply->response_type=XCB_RANDR_NOTIFY;
+    reply->sequence=++bench_sequence;
+    reply->length=(extra+3)/4;
+    return reply;
+}
+
+xcb_randr_get_output_info_cookie_t bench_get_output_info(xcb_connection_t*, xcb_randr_output_t output, xcb_timestamp_t)
+{
+    return {output};
+}
+
+xcb_randr_get_output_info_reply_t* bench_get_output_info_reply(xcb_connection_t*, xcb_randr_get_output_info_cookie_t cookie, xcb_generic_error_t**)
+{
+    const int i=cookie.sequence-bench_output(0);
+    char name[16];
+    const int name_len=snprintf(name, sizeof name, "OUT-%d", i);
+    const auto reply=bench_reply<xcb_randr_get_output_info_reply_t>(2*4+name_len);
+    reply->crtc=bench_crtc(i);
+    reply->mm_width=1600;
+    reply->mm_height=900;
+    reply->connection=XCB_RANDR_CONNECTION_CONNECTED;
+    reply->num_crtcs=1;
+    reply->num_modes=1;
+    reply->num_preferred=1;
+    reply->name_len=name_len;
+    const auto ids=reinterpret_cast<uint32_t*>(reply+1);
+    ids[0]=bench_crtc(i);
+    ids[1]=bench_mode(i);
+    memcpy(ids+2, name, name_len);
+    return reply;
+}
+
+xcb_randr_get_crtc_info_cookie_t bench_get_crtc_info(xcb_connection_t*, xcb_randr_crtc_t crtc, xcb_timestamp_t)
+{
+    return {crtc};
+}
+
+xcb_randr_get_crtc_info_reply_t* bench_get_crtc_info_reply(xcb_connection_t*, xcb_randr_get_crtc_info_cookie_t cookie, xcb_generic_error_t**)
+{
+    const int i=cookie.sequence-bench_crtc(0);
+    const auto reply=bench_reply<xcb_randr_get_crtc_info_reply_t>(2*4);
+    reply->x=i*BENCH_WIDTH;
+    reply->width=BENCH_WIDTH;
+    reply->height=BENCH_HEIGHT;
+    reply->mode=bench_mode(i);
+    reply->rotation=reply->rotations=XCB_RANDR_ROTATION_ROTATE_0;
+    reply->num_outputs=reply->num_possible_outputs=1;
+    const auto ids=reinterpret_cast<uint32_t*>(reply+1);
+    ids[0]=ids[1]=bench_output(i);
+    return reply;
+}
+
+xcb_randr_get_output_property_cookie_t bench_get_output_property(xcb_connection_t*, xcb_randr_output_t output, xcb_atom_t, xcb_atom_t,
+                                                                 uint32_t, uint32_t, uint8_t, uint8_t)
+{
+    return {output};
+}
+
+xcb_randr_get_output_property_reply_t* bench_get_output_property_reply(xcb_connection_t*, xcb_randr_get_output_property_cookie_t cookie,
+                                                                       xcb_generic_error_t**)
+{
+    const auto reply=bench_reply<xcb_randr_get_output_property_reply_t>(128);
+    reply->format=8;
+    reply->type=XCB_ATOM_INTEGER;
+    reply->num_items=128;
+    bench_edid(cookie.sequence-bench_output(0), reinterpret_cast<unsigned char*>(reply+1));
+    return reply;
+}
+
+}
+
+extern "C"
+{
+const xcb_setup_t* xcb_get_setup(xcb_connection_t*)
+{
+    static xcb_setup_t setup;
+    setup.resource_id_mask=0x001FFFFF;
+    return &setup;
+}
+
+xcb_intern_atom_cookie_t xcb_intern_atom(xcb_connection_t*, uint8_t, uint16_t name_len, const char* name)
+{
+    return {name_len==4 && memcmp(name, "EDID", 4)==0 ? bench_edid_atom : XCB_ATOM_NONE};
+}
+
+xcb_intern_atom_reply_t* xcb_intern_atom_reply(xcb_connection_t*, xcb_intern_atom_cookie_t cookie, xcb_generic_error_t**)
+{
+    const auto reply=bench_reply<xcb_intern_atom_reply_t>(0);
+    reply->atom=cookie.sequence;
+    return reply;
+}
+
+void xcb_discard_reply(xcb_connection_t*, unsigned int)
+{
+}
+
+// No socket, so nothing is shared with other processes
+int xcb_get_file_descriptor(xcb_connection_t*)
+{
+    return -1;
+}
+}
+
+static void bench_setup(const struct BenchCase* bench)
+{
+    _xcb_randr_get_output_info_pointer=bench_get_output_info;
+    _xcb_randr_get_output_info_reply_pointer=bench_get_output_info_reply;
+    _xcb_randr_get_crtc_info_pointer=bench_get_crtc_info;
+    _xcb_randr_get_crtc_info_reply_pointer=bench_get_crtc_info_reply;
+    _xcb_randr_get_output_property_pointer=bench_get_output_property;
+    _xcb_randr_get_output_property_reply_pointer=bench_get_output_property_reply;
+
+    const char mode_name[]="7680x4320";
+    const int n=bench->outputs;
+    const size_t names_len=n*(sizeof mode_name-1);
+    bench_resources_size=sizeof(xcb_randr_get_screen_resources_reply_t)+n*(2*4+sizeof(xcb_randr_mode_info_t))+names_len;
+    bench_resources=bench_reply<xcb_randr_get_screen_resources_reply_t>(bench_resources_size-sizeof(xcb_randr_get_screen_resources_reply_t));
+    bench_resources->num_crtcs=bench_resources->num_outputs=bench_resources->num_modes=n;
+    bench_resources->names_len=names_len;
+    const auto crtcs=reinterpret_cast<uint32_t*>(bench_resources+1);
+    const auto outputs=crtcs+n;
+    const auto modes=reinterpret_cast<xcb_randr_mode_info_t*>(outputs+n);
+    auto names=reinterpret_cast<char*>(modes+n);
+    for(int i=0; i<n; ++i)
+    {
+        crtcs[i]=bench_crtc(i);
+        outputs[i]=bench_output(i);
+        modes[i].id=bench_mode(i);
+        modes[i].width=BENCH_WIDTH;
+        modes[i].height=BENCH_HEIGHT;
+        modes[i].name_len=sizeof mode_name-1;
+        memcpy(names, mode_name, sizeof mode_name-1);
+        names+=sizeof mode_name-1;
+    }
+}
+
+static void bench_op(void)
+{
+    // A new timestamp for every round, as after a hotplug. The layout takes ownership of its reply.
+    ++bench_resources->timestamp;
+    ++bench_resources->config_timestamp;
+    const auto res=static_cast<xcb_randr_get_screen_resources_reply_t*>(malloc(bench_resources_size));
+    memcpy(res, bench_resources, bench_resources_size);
+    const auto layout=buildFakeResources(bench_connection, res, false, nullptr, XCB_NONE);
+    if(!layout)
+    {
+        free(res);
+        return;
+    }
+    free(layout->makeReturnValue(res->sequence));
+    release(layout);
+}
+
+static void bench_teardown(void)
+{
+    free(bench_resources);
+}
+
+int main()
+{
+    return bench_main("libxcb-randr");
+}
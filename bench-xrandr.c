@@ -0,0 +1,123 @@
+/*
+	Microbenchmark of libXrandr's split engine, see bench.h. Measures
+	augment_resources() and XRRFreeScreenResources() for a screen whose
+	outputs all match the configuration.
+*/
+
+#include "libXrandr.c"
+#include <X11/Xatom.h>
+#include "bench.h"
+
+static struct _XDisplay bench_display;
+static XRRScreenResources *bench_resources;
+
+#define BENCH_OUTPUT(i) (0x40 + (i))
+#define BENCH_CRTC(i)   (0x400 + (i))
+#define BENCH_MODE(i)   (0x800 + (i))
+
+/*
+	The synthetic X server behind the _XRR* pointers. XInternAtom() is
+	replaced for the whole program, since libXrandr.c calls it directly.
+*/
+Atom XInternAtom(Display *dpy, _Xconst char *name, Bool only_if_exists) {
+	return strcmp(name, "EDID") == 0 ? 77 : None;
+}
+
+static XRROutputInfo *bench_get_output_info(Display *dpy, XRRScreenResources *resources, RROutput output) {
+	unsigned int i = output - BENCH_OUTPUT(0);
+	XRROutputInfo *info = Xcalloc(1, sizeof(XRROutputInfo) + sizeof(RRCrtc) + sizeof(RRMode) + 16);
+	info->crtc = BENCH_CRTC(i);
+	info->ncrtc = 1;
+	info->crtcs = (RRCrtc *)(info + 1);
+	info->crtcs[0] = info->crtc;
+	info->nmode = 1;
+	info->npreferred = 1;
+	info->modes = (RRMode *)(info->crtcs + 1);
+	info->modes[0] = BENCH_MODE(i);
+	info->name = (char *)(info->modes + 1);
+	info->nameLen = snprintf(info->name, 16, "OUT-%u", i);
+	info->mm_width = 1600;
+	info->mm_height = 900;
+	info->connection = RR_Connected;
+	return info;
+}
+
+static XRRCrtcInfo *bench_get_crtc_info(Display *dpy, XRRScreenResources *resources, RRCrtc crtc) {
+	unsigned int i = crtc - BENCH_CRTC(0);
+	XRRCrtcInfo *info = Xcalloc(1, sizeof(XRRCrtcInfo) + sizeof(RROutput));
+	info->x = i * BENCH_WIDTH;
+	info->width = BENCH_WIDTH;
+	info->height = BENCH_HEIGHT;
+	info->mode = BENCH_MODE(i);
+	info->rotation = info->rotations = RR_Rotate_0;
+	info->noutput = info->npossible = 1;
+	info->outputs = info->possible = (RROutput *)(info + 1);
+	info->outputs[0] = BENCH_OUTPUT(i);
+	return info;
+}
+
+static int bench_get_output_property(Display *dpy, RROutput output, Atom property, long offset, long length, Bool _delete,
+		Bool pending, Atom req_type, Atom *actual_type, int *actual_format, unsigned long *nitems, unsigned long *bytes_after,
+		unsigned char **prop) {
+	*prop = Xmalloc(128);
+	bench_edid(output - BENCH_OUTPUT(0), *prop);
+	*actual_type = XA_INTEGER;
+	*actual_format = 8;
+	*nitems = 128;
+	*bytes_after = 0;
+	return Success;
+}
+
+// Without the extension there is no per-display state, so nothing is cached between rounds
+static Bool bench_query_extension(Display *dpy, int *event_base, int *error_base) {
+	return False;
+}
+
+// The resources are reused, augment_resources() only hands them back
+static void bench_free_screen_resources(XRRScreenResources *resources) {
+}
+
+static void bench_setup(const struct BenchCase *bench) {
+	bench_display.resource_mask = 0x001FFFFF;
+	bench_display.display_name = BENCH_DISPLAY;
+	// No socket, so nothing is shared with other processes
+	bench_display.fd = -1;
+	_XRRGetOutputInfo_pointer = bench_get_output_info;
+	_XRRGetCrtcInfo_pointer = bench_get_crtc_info;
+	_XRRGetOutputProperty_pointer = bench_get_output_property;
+	_XRRFreeScreenResources_pointer = bench_free_screen_resources;
+	_XRRQueryExtension_pointer = bench_query_extension;
+
+	// Laid out like libXrandr does, which fake_resources() relies on
+	int i;
+	bench_resources = Xcalloc(1, sizeof(XRRScreenResources) + bench->outputs * (sizeof(RRCrtc) + sizeof(RROutput) + sizeof(XRRModeInfo)));
+	bench_resources->ncrtc = bench_resources->noutput = bench_resources->nmode = bench->outputs;
+	bench_resources->crtcs = (RRCrtc *)(bench_resources + 1);
+	bench_resources->outputs = (RROutput *)(bench_resources->crtcs + bench->outputs);
+	bench_resources->modes = (XRRModeInfo *)(bench_resources->outputs + bench->outputs);
+	for(i=0; i<bench->outputs; i++) {
+		bench_resources->crtcs[i] = BENCH_CRTC(i);
+		bench_resources->outputs[i] = BENCH_OUTPUT(i);
+		bench_resources->modes[i].id = BENCH_MODE(i);
+		bench_resources->modes[i].width = BENCH_WIDTH;
+		bench_resources->modes[i].height = BENCH_HEIGHT;
+		bench_resources->modes[i].name = "7680x4320";
+		bench_resources->modes[i].nameLength = strlen(bench_resources->modes[i].name);
+	}
+}
+
+static void bench_op(void) {
+	// A new timestamp for every round, as after a hotplug
+	bench_resources->timestamp++;
+	bench_resources->configTimestamp++;
+	XRRScreenResources *resources = augment_resources(&bench_display, None, bench_resources);
+	XRRFreeScreenResources(resources);
+}
+
+static void bench_teardown(void) {
+	Xfree(bench_resources);
+}
+
+int main() {
+	return bench_main("libXrandr");
+}
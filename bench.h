@@ -0,0 +1,240 @@
+/*
+	FakeXRandR microbenchmarks
+
+	Shared by bench-xrandr.c and bench-xcb.cpp, which include the library
+	sources and replace the pointers to the real library functions with a
+	synthetic X server. Each case writes a configuration with one record per
+	output, preceded by records for other monitors, and then measures
+	resolving the screen resources against it, i.e. what a program pays after
+	each hotplug. The cases sweep one parameter at a time:
+
+	 · outputs: outputs of the screen, all of them split
+	 · splits:  monitors each output is split into
+	 · records: records in the configuration, the matching ones last
+	 · depth:   depth of the split tree, from balanced to a chain
+
+	Allocations are counted by replacing malloc() and friends, so they
+	include the replies of the synthetic server, as the real libraries would
+	allocate them, too. Run with `make bench`.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct BenchCase {
+	const char *sweep;
+	int outputs;
+	int splits;
+	int records;
+	int depth; /* 0 for a balanced tree */
+};
+
+static const struct BenchCase bench_cases[] = {
+	{ "base",    4,    4,    16,  0 },
+	{ "outputs", 1,    4,    16,  0 },
+	{ "outputs", 16,   4,    16,  0 },
+	{ "outputs", 128,  4,    128, 0 },
+	{ "splits",  4,    1,    16,  0 },
+	{ "splits",  4,    16,   16,  0 },
+	{ "splits",  4,    256,  16,  0 },
+	{ "splits",  4,    1024, 16,  0 },
+	{ "records", 4,    4,    4,   0 },
+	{ "records", 4,    4,    100, 0 },
+	{ "records", 4,    4,    1000, 0 },
+	{ "records", 4,    4,    10000, 0 },
+	{ "depth",   4,    64,   16,  6 },
+	{ "depth",   4,    64,   16,  16 },
+	{ "depth",   4,    64,   16,  63 },
+};
+
+/* Every output has a CRTC of this size, large enough for 1024 splits */
+#define BENCH_WIDTH  7680
+#define BENCH_HEIGHT 4320
+
+#define BENCH_DISPLAY ":bench"
+#define BENCH_MIN_NS  200000000ull
+
+static void bench_setup(const struct BenchCase *bench);
+static void bench_op(void);
+static void bench_teardown(void);
+
+/*
+	Allocation counting
+*/
+#ifdef __cplusplus
+#define BENCH_NOTHROW noexcept
+extern "C" {
+#else
+#define BENCH_NOTHROW
+#endif
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static int bench_counting;
+static unsigned long bench_allocs;
+
+void *malloc(size_t size) BENCH_NOTHROW {
+	bench_allocs += bench_counting;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) BENCH_NOTHROW {
+	bench_allocs += bench_counting;
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) BENCH_NOTHROW {
+	bench_allocs += bench_counting;
+	return __libc_realloc(ptr, size);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+/*
+	The synthetic monitors. Output i has the EDID bench_edid(i), and records
+	for other monitors use EDIDs beyond those of the outputs.
+*/
+static void bench_edid(unsigned int index, unsigned char *edid) {
+	int i;
+	static const unsigned char header[8] = { 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00 };
+	memcpy(edid, header, sizeof(header));
+	for(i=8; i<128; i++) {
+		edid[i] = i < 12 ? (index >> (8 * (i - 8))) & 0xff : i;
+	}
+}
+
+static int bench_log2(int n) {
+	int depth = 0;
+	while((1 << depth) < n) {
+		depth++;
+	}
+	return depth;
+}
+
+/*
+	A split tree with the given number of leaves and depth, in the format of
+	the configuration file. Beyond the depth a balanced tree needs, the first
+	leaf is cut off the rest, down to a chain. Cuts go across the longer side.
+*/
+static char *bench_tree(char *p, int leaves, int depth, unsigned int width, unsigned int height) {
+	if(leaves == 1) {
+		*p++ = 'N';
+		return p;
+	}
+	int first = depth > bench_log2(leaves) ? 1 : (leaves + 1) / 2;
+	int vertical = width >= height;
+	unsigned int size = vertical ? width : height;
+	unsigned int pos = size * first / leaves;
+	*p++ = vertical ? 'V' : 'H';
+	memcpy(p, &pos, 4);
+	p += 4;
+	p = bench_tree(p, first, depth - 1, vertical ? pos : width, vertical ? height : pos);
+	return bench_tree(p, leaves - first, depth - 1, vertical ? width - pos : width, vertical ? height : height - pos);
+}
+
+static char *bench_record(char *p, unsigned int index, const struct BenchCase *bench) {
+	char *start = p;
+	p += 4;
+	memset(p, 0, 128 + 768);
+	snprintf(p, 128, "bench-%u", index);
+	unsigned char edid[128];
+	bench_edid(index, edid);
+	int i;
+	for(i=0; i<128; i++) {
+		sprintf(p + 128 + 2 * i, "%02x", edid[i]);
+	}
+	p += 128 + 768;
+	unsigned int geometry[3] = { BENCH_WIDTH, BENCH_HEIGHT, (unsigned int)bench->splits };
+	memcpy(p, geometry, sizeof(geometry));
+	p += sizeof(geometry);
+	p = bench_tree(p, bench->splits, bench->depth ? bench->depth : bench_log2(bench->splits), BENCH_WIDTH, BENCH_HEIGHT);
+	unsigned int size = p - start - 4;
+	memcpy(start, &size, 4);
+	return p;
+}
+
+// Writes the configuration to $XDG_CONFIG_HOME, replacing it by rename() as the management script does
+static int bench_write_config(const struct BenchCase *bench) {
+	const char *dir = getenv("XDG_CONFIG_HOME");
+	char path[512], temporary[512];
+	snprintf(path, sizeof(path), "%s/fakexrandr.bin", dir);
+	snprintf(temporary, sizeof(temporary), "%s/fakexrandr.bin.new", dir);
+
+	int records = bench->records > bench->outputs ? bench->records : bench->outputs;
+	size_t record_size = 4 + 128 + 768 + 12 + 6 * bench->splits;
+	char *config = (char *)malloc(records * record_size);
+	char *p = config;
+	int i;
+	for(i=0; i<records; i++) {
+		p = bench_record(p, i < records - bench->outputs ? bench->outputs + i : i - (records - bench->outputs), bench);
+	}
+
+	FILE *file = fopen(temporary, "wb");
+	int failed = !file || fwrite(config, 1, p - config, file) != (size_t)(p - config);
+	if(file) {
+		failed |= fclose(file) != 0;
+	}
+	free(config);
+	return failed || rename(temporary, path);
+}
+
+static unsigned long long bench_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static int bench_main(const char *library) {
+	char dir[] = "/tmp/fakexrandr-bench-XXXXXX";
+	if(!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	setenv("XDG_CONFIG_HOME", dir, 1);
+	// No snapshots or leases from other processes
+	unsetenv("XDG_RUNTIME_DIR");
+	setenv("DISPLAY", BENCH_DISPLAY, 1);
+
+	printf("%-12s %-8s %7s %6s %7s %5s %12s %10s\n", library, "sweep", "outputs", "splits", "records", "depth", "ns/op", "allocs/op");
+	size_t i;
+	int failed = 0;
+	for(i=0; i<sizeof(bench_cases) / sizeof(bench_cases[0]); i++) {
+		const struct BenchCase *bench = &bench_cases[i];
+		if(bench_write_config(bench)) {
+			perror("fakexrandr.bin");
+			failed = 1;
+			break;
+		}
+		bench_setup(bench);
+		bench_op();
+
+		unsigned long long start = bench_now(), elapsed;
+		unsigned long ops = 0;
+		bench_allocs = 0;
+		bench_counting = 1;
+		do {
+			bench_op();
+			ops++;
+			elapsed = bench_now() - start;
+		} while(elapsed < BENCH_MIN_NS);
+		bench_counting = 0;
+		bench_teardown();
+
+		printf("%-12s %-8s %7d %6d %7d %5d %12llu %10.1f\n", "", bench->sweep, bench->outputs, bench->splits,
+			bench->records > bench->outputs ? bench->records : bench->outputs,
+			bench->depth ? bench->depth : bench_log2(bench->splits), elapsed / ops, (double)bench_allocs / ops);
+	}
+
+	char path[512];
+	snprintf(path, sizeof(path), "%s/fakexrandr.bin", dir);
+	unlink(path);
+	rmdir(dir);
+	return failed;
+}
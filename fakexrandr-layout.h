@@ -0,0 +1,50 @@
+/*
+	Public layout API of fakexrandr, for window managers, panels and the like
+
+	Both fake libraries export
+	  int fakexrandr_get_layout(Display *dpy, struct FakexrandrMonitor **monitors, int *count);
+	  unsigned int fakexrandr_layout_generation(Display *dpy);
+	resp. fakexrandr_xcb_get_layout() and fakexrandr_xcb_layout_generation()
+	taking an xcb_connection_t *. Look them up with dlsym(), so that programs
+	keep working with the real libraries; the prototypes below are for
+	declaring the function pointers.
+
+	fakexrandr_get_layout() returns 0 and the split monitors in one block
+	of memory, names included, to be released with free(). The generation
+	changes whenever the layout does, so it can be polled cheaply. Neither
+	talks to the X server unless RandR reported a change since the last call.
+*/
+#ifndef FAKEXRANDR_LAYOUT_H
+#define FAKEXRANDR_LAYOUT_H
+
+#include <stdint.h>
+
+struct FakexrandrMonitor {
+	const char *name;
+	uint32_t output;
+	uint32_t parent;
+	int16_t x;
+	int16_t y;
+	uint16_t width;
+	uint16_t height;
+	uint32_t mm_width;
+	uint32_t mm_height;
+};
+
+struct _XDisplay;
+struct xcb_connection_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int fakexrandr_get_layout(struct _XDisplay *dpy, struct FakexrandrMonitor **monitors, int *count);
+unsigned int fakexrandr_layout_generation(struct _XDisplay *dpy);
+int fakexrandr_xcb_get_layout(struct xcb_connection_t *c, struct FakexrandrMonitor **monitors, int *count);
+unsigned int fakexrandr_xcb_layout_generation(struct xcb_connection_t *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
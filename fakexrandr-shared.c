@@ -0,0 +1,721 @@
+/*
+	State the fake libraries share within a process, see fakexrandr-shared.h,
+	and the code each of them links privately, see fakexrandr.h
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include "fakexrandr.h"
+
+/*
+	The management script uses this symbol to identify the fake libXrandr version
+*/
+int _is_fake_xrandr = 1;
+
+static struct {
+	char lock;
+	uint32_t count;
+	struct XidTableEntry *pages[XID_TABLE_PAGES];
+	uint32_t *slots; /* Open addressing over (parent, index), holding slot + 1 */
+	uint32_t slots_size;
+} xid_table;
+
+static uint32_t xid_table_hash(uint32_t parent, uint32_t index) {
+	return (parent * 2654435761u) ^ (index * 40503u);
+}
+
+static int xid_table_grow() {
+	const uint32_t size = xid_table.slots_size ? 2 * xid_table.slots_size : 1024;
+	uint32_t *slots = (uint32_t *)calloc(size, sizeof(uint32_t));
+	if(!slots) {
+		return 0;
+	}
+	uint32_t i;
+	for(i = 0; i < xid_table.count; i++) {
+		const struct XidTableEntry *entry = &xid_table.pages[i / XID_TABLE_PAGE_SIZE][i % XID_TABLE_PAGE_SIZE];
+		uint32_t h = xid_table_hash(entry->parent, entry->index) & (size - 1);
+		while(slots[h]) {
+			h = (h + 1) & (size - 1);
+		}
+		slots[h] = i + 1;
+	}
+	free(xid_table.slots);
+	xid_table.slots = slots;
+	xid_table.slots_size = size;
+	return 1;
+}
+
+// Call with the lock held
+static uint32_t xid_table_add(uint32_t parent, uint32_t index) {
+	uint32_t h = 0;
+	if(xid_table.slots_size) {
+		h = xid_table_hash(parent, index) & (xid_table.slots_size - 1);
+		for(; xid_table.slots[h]; h = (h + 1) & (xid_table.slots_size - 1)) {
+			const uint32_t i = xid_table.slots[h] - 1;
+			const struct XidTableEntry *entry = &xid_table.pages[i / XID_TABLE_PAGE_SIZE][i % XID_TABLE_PAGE_SIZE];
+			if(entry->parent == parent && entry->index == index) {
+				return i;
+			}
+		}
+	}
+	if(xid_table.count == XID_TABLE_PAGES * XID_TABLE_PAGE_SIZE) {
+		return UINT32_MAX;
+	}
+	if(2 * (xid_table.count + 1) > xid_table.slots_size) {
+		if(!xid_table_grow()) {
+			return UINT32_MAX;
+		}
+		h = xid_table_hash(parent, index) & (xid_table.slots_size - 1);
+		while(xid_table.slots[h]) {
+			h = (h + 1) & (xid_table.slots_size - 1);
+		}
+	}
+	struct XidTableEntry *page = xid_table.pages[xid_table.count / XID_TABLE_PAGE_SIZE];
+	if(!page) {
+		page = (struct XidTableEntry *)malloc(XID_TABLE_PAGE_SIZE * sizeof(struct XidTableEntry));
+		if(!page) {
+			return UINT32_MAX;
+		}
+	}
+	const uint32_t slot = xid_table.count++;
+	page[slot % XID_TABLE_PAGE_SIZE].parent = parent;
+	page[slot % XID_TABLE_PAGE_SIZE].index = index;
+	// Readers look up entries without the lock
+	__atomic_store_n(&xid_table.pages[slot / XID_TABLE_PAGE_SIZE], page, __ATOMIC_RELEASE);
+	xid_table.slots[h] = slot + 1;
+	return slot;
+}
+
+uint32_t fakexrandr_xid_table_slot(uint32_t parent, uint32_t index) {
+	while(__atomic_test_and_set(&xid_table.lock, __ATOMIC_ACQUIRE)) {
+		sched_yield();
+	}
+	const uint32_t slot = xid_table_add(parent, index);
+	__atomic_clear(&xid_table.lock, __ATOMIC_RELEASE);
+	return slot;
+}
+
+const struct XidTableEntry *fakexrandr_xid_table_entry(uint32_t slot) {
+	if(slot >= XID_TABLE_PAGES * XID_TABLE_PAGE_SIZE) {
+		return NULL;
+	}
+	const struct XidTableEntry *page = __atomic_load_n(&xid_table.pages[slot / XID_TABLE_PAGE_SIZE], __ATOMIC_ACQUIRE);
+	return page ? &page[slot % XID_TABLE_PAGE_SIZE] : NULL;
+}
+
+
+static struct {
+	char lock;
+	char display[256];
+	void *data;
+	size_t size;
+} shared_snapshot;
+
+static void shared_snapshot_lock() {
+	while(__atomic_test_and_set(&shared_snapshot.lock, __ATOMIC_ACQUIRE)) {
+		sched_yield();
+	}
+}
+
+static void shared_snapshot_unlock() {
+	__atomic_clear(&shared_snapshot.lock, __ATOMIC_RELEASE);
+}
+
+void fakexrandr_share_snapshot(const char *display, const void *snapshot, size_t size) {
+	void *data = malloc(size);
+	if(strlen(display) >= sizeof(shared_snapshot.display) || !data) {
+		free(data);
+		return;
+	}
+	memcpy(data, snapshot, size);
+
+	shared_snapshot_lock();
+	void *old = shared_snapshot.data;
+	strcpy(shared_snapshot.display, display);
+	shared_snapshot.data = data;
+	shared_snapshot.size = size;
+	shared_snapshot_unlock();
+	free(old);
+}
+
+void *fakexrandr_copy_snapshot(const char *display, size_t *size) {
+	void *copy = NULL;
+	shared_snapshot_lock();
+	if(shared_snapshot.data && strcmp(shared_snapshot.display, display) == 0) {
+		copy = mmap(NULL, shared_snapshot.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(copy == MAP_FAILED) {
+			copy = NULL;
+		}
+		else {
+			memcpy(copy, shared_snapshot.data, shared_snapshot.size);
+			*size = shared_snapshot.size;
+		}
+	}
+	shared_snapshot_unlock();
+	return copy;
+}
+
+/*
+	Loading the real libraries
+*/
+void *real_library_symbol(void **library, const char *path, const char *name) {
+	void *handle = __atomic_load_n(library, __ATOMIC_ACQUIRE);
+	if(!handle) {
+		// dlopen() counts references, so threads racing here do no harm
+		handle = dlopen(path, RTLD_LAZY | RTLD_LOCAL);
+		if(!handle) {
+			return NULL;
+		}
+		__atomic_store_n(library, handle, __ATOMIC_RELEASE);
+	}
+	return dlsym(handle, name);
+}
+
+/*
+	Configuration
+*/
+char *config_file;
+static int config_file_fd;
+size_t config_file_size;
+unsigned int config_generation;
+struct stat config_file_stat;
+static int config_file_seen;
+
+static void close_configuration() {
+	munmap(config_file, config_file_size);
+	close(config_file_fd);
+	config_file = NULL;
+	config_file_size = 0;
+}
+
+static int config_file_changed(struct stat *new_stat) {
+	return new_stat->st_dev != config_file_stat.st_dev || new_stat->st_ino != config_file_stat.st_ino ||
+		new_stat->st_size != config_file_stat.st_size ||
+		new_stat->st_mtim.tv_sec != config_file_stat.st_mtim.tv_sec || new_stat->st_mtim.tv_nsec != config_file_stat.st_mtim.tv_nsec;
+}
+
+int get_config_dir(char *config_dir, size_t size) {
+	char *xdg_config_home = getenv("XDG_CONFIG_HOME");
+	if(xdg_config_home) {
+		return snprintf(config_dir, size, "%s", xdg_config_home) >= (int)size;
+	}
+	char *home_dir = getenv("HOME");
+	if(!home_dir) {
+		return 1;
+	}
+	return snprintf(config_dir, size, "%s/.config", home_dir) >= (int)size;
+}
+
+int open_configuration(void) {
+	// Load the configuration from ${XDG_CONFIG_HOME:-$HOME/.config}/fakexrandr.bin
+	char config_dir[512];
+	if(get_config_dir(config_dir, sizeof(config_dir))) {
+		return 1;
+	}
+
+	char config_file_path[512];
+	if(snprintf(config_file_path, 512, "%s/fakexrandr.bin", config_dir) >= 512) {
+		return 1;
+	}
+
+	struct stat config_stat;
+	if(stat(config_file_path, &config_stat) || access(config_file_path, R_OK)) {
+		if(config_file_seen) {
+			if(config_file) {
+				close_configuration();
+			}
+			config_file_seen = 0;
+			config_generation++;
+		}
+		return 1;
+	}
+	if(config_file_seen && !config_file_changed(&config_stat)) {
+		return config_file ? 0 : 1;
+	}
+	if(config_file) {
+		close_configuration();
+	}
+	config_file_seen = 1;
+	config_file_stat = config_stat;
+	config_generation++;
+
+	config_file_fd = open(config_file_path, O_RDONLY);
+	if(config_file_fd < 0) {
+		perror("fakexrandr/open()");
+		return 1;
+	}
+	fstat(config_file_fd, &config_stat);
+	config_file_size = config_stat.st_size;
+	if(config_file_size==0) {
+		close(config_file_fd);
+		return 1;
+	}
+	config_file = (char*)mmap(NULL, config_file_size, PROT_READ, MAP_SHARED, config_file_fd, 0);
+	if(config_file == MAP_FAILED) {
+		perror("fakexrandr/mmap()");
+		config_file = NULL;
+		close(config_file_fd);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+	Layout published by fakexrandrd
+*/
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// The display name without the screen number, with '/' replaced, as it appears in file names
+static int display_file_name(char *name, size_t size, const char *display) {
+	if(!display || !*display) {
+		return 1;
+	}
+	const char *colon = strrchr(display, ':');
+	const char *dot = colon ? strchr(colon, '.') : NULL;
+	size_t i, length = dot ? (size_t)(dot - display) : strlen(display);
+	if(length >= size) {
+		return 1;
+	}
+	for(i=0; i<length; i++) {
+		name[i] = display[i] == '/' ? '_' : display[i];
+	}
+	name[length] = 0;
+	return 0;
+}
+
+int connection_display_name(int fd, char *name, size_t size) {
+	struct sockaddr_storage address;
+	socklen_t length = sizeof(address);
+	memset(&address, 0, sizeof(address));
+	if(fd < 0 || getpeername(fd, (struct sockaddr *)&address, &length)) {
+		return 1;
+	}
+
+	char host[INET6_ADDRSTRLEN];
+	if(address.ss_family == AF_UNIX) {
+		// Abstract sockets have the same name after a zero byte
+		const struct sockaddr_un *unix_address = (const struct sockaddr_un *)&address;
+		const char *path = unix_address->sun_path[0] ? unix_address->sun_path : unix_address->sun_path + 1;
+		const char *base = strrchr(path, '/');
+		base = base ? base + 1 : path;
+		if(base[0] != 'X' || !base[1] || strspn(base + 1, "0123456789") != strlen(base + 1)) {
+			return 1;
+		}
+		return snprintf(name, size, ":%s", base + 1) >= (int)size;
+	}
+	if(address.ss_family == AF_INET) {
+		const struct sockaddr_in *inet_address = (const struct sockaddr_in *)&address;
+		return !inet_ntop(AF_INET, &inet_address->sin_addr, host, sizeof(host)) ||
+			snprintf(name, size, "%s:%d", host, ntohs(inet_address->sin_port) - 6000) >= (int)size;
+	}
+	if(address.ss_family == AF_INET6) {
+		const struct sockaddr_in6 *inet6_address = (const struct sockaddr_in6 *)&address;
+		return !inet_ntop(AF_INET6, &inet6_address->sin6_addr, host, sizeof(host)) ||
+			snprintf(name, size, "%s:%d", host, ntohs(inet6_address->sin6_port) - 6000) >= (int)size;
+	}
+	return 1;
+}
+
+int runtime_file_path(char *path, size_t size, const char *display, const char *suffix) {
+	// All screens of a display share the file
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	char name[256];
+	if(!runtime_dir || display_file_name(name, sizeof(name), display)) {
+		return 1;
+	}
+
+	return snprintf(path, size, "%s/fakexrandr-%s.%s", runtime_dir, name, suffix) >= (int)size;
+}
+
+int shared_layout_path(char *path, size_t size, const char *display) {
+	return runtime_file_path(path, size, display, "layout");
+}
+
+const struct SharedLayout *open_shared_layout(const char *display) {
+	char path[512];
+	if(shared_layout_path(path, sizeof(path), display)) {
+		return NULL;
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) {
+		return NULL;
+	}
+
+	const struct SharedLayout *layout = NULL;
+	struct stat layout_stat;
+	if(flock(fd, LOCK_SH | LOCK_NB) == 0) {
+		// No daemon is running
+		flock(fd, LOCK_UN);
+	}
+	else if(fstat(fd, &layout_stat) == 0 && layout_stat.st_size >= (off_t)sizeof(struct SharedLayout)) {
+		void *mapping = mmap(NULL, sizeof(struct SharedLayout), PROT_READ, MAP_SHARED, fd, 0);
+		if(mapping != MAP_FAILED) {
+			layout = (const struct SharedLayout *)mapping;
+			if(layout->magic != SHARED_LAYOUT_MAGIC || layout->version != SHARED_LAYOUT_VERSION) {
+				munmap(mapping, sizeof(struct SharedLayout));
+				layout = NULL;
+			}
+		}
+	}
+	close(fd);
+	return layout;
+}
+
+void close_shared_layout(const struct SharedLayout *layout) {
+	if(layout) {
+		munmap((void *)layout, sizeof(struct SharedLayout));
+	}
+}
+
+int shared_output_edid(const struct SharedLayout *layout, uint32_t config_timestamp, uint32_t output, char *edid) {
+	int attempt;
+	for(attempt=0; layout && attempt<16; attempt++) {
+		const uint32_t sequence = __atomic_load_n(&layout->sequence, __ATOMIC_ACQUIRE);
+		if(sequence & 1) {
+			continue;
+		}
+
+		int length = -1;
+		if(layout->config_timestamp == config_timestamp) {
+			uint32_t i, count = layout->count < SHARED_LAYOUT_MAX_OUTPUTS ? layout->count : SHARED_LAYOUT_MAX_OUTPUTS;
+			for(i=0; i<count; i++) {
+				if(layout->outputs[i].output == output) {
+					length = layout->outputs[i].edid_length < 2 * EDID_MAX_BYTES ? layout->outputs[i].edid_length : 2 * EDID_MAX_BYTES;
+					memcpy(edid, layout->outputs[i].edid, length);
+					edid[length] = 0;
+					break;
+				}
+			}
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&layout->sequence, __ATOMIC_RELAXED) == sequence) {
+			return length;
+		}
+	}
+	return -1;
+}
+
+/*
+	Layout property
+*/
+uint32_t layout_convert_number(const char *src, char *dst, int to_host) {
+	const unsigned char *bytes = (const unsigned char *)src;
+	uint32_t value;
+	if(to_host) {
+		value = bytes[0] | bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+		if(dst) {
+			memcpy(dst, &value, 4);
+		}
+	}
+	else {
+		memcpy(&value, src, 4);
+		if(dst) {
+			dst[0] = value;
+			dst[1] = value >> 8;
+			dst[2] = value >> 16;
+			dst[3] = value >> 24;
+		}
+	}
+	return value;
+}
+
+/*
+	Check the split tree at src, of at most size bytes, for an area of width
+	x height, and convert its positions to dst like layout_convert_number().
+	Counts its leaves in leaves. Returns its size, or 0 if a node is cut off
+	or unknown, a split is not within its area, or the tree is too deep.
+*/
+static size_t layout_convert_splits(const char *src, char *dst, size_t size, uint32_t width, uint32_t height, int depth, uint32_t *leaves, int to_host) {
+	if(size < 1 || depth > LAYOUT_MAX_DEPTH) {
+		return 0;
+	}
+	if(src[0] == 'N') {
+		(*leaves)++;
+		return 1;
+	}
+	if((src[0] != 'H' && src[0] != 'V') || size < 1 + 4) {
+		return 0;
+	}
+	int horizontal = src[0] == 'H';
+	uint32_t split_pos = layout_convert_number(src + 1, dst ? dst + 1 : NULL, to_host);
+	if(split_pos == 0 || split_pos >= (horizontal ? height : width)) {
+		return 0;
+	}
+	size_t first = layout_convert_splits(src + 1 + 4, dst ? dst + 1 + 4 : NULL, size - 1 - 4,
+			horizontal ? width : split_pos, horizontal ? split_pos : height, depth + 1, leaves, to_host);
+	if(!first) {
+		return 0;
+	}
+	size_t second = layout_convert_splits(src + 1 + 4 + first, dst ? dst + 1 + 4 + first : NULL, size - 1 - 4 - first,
+			horizontal ? width : width - split_pos, horizontal ? height - split_pos : height, depth + 1, leaves, to_host);
+	return second ? 1 + 4 + first + second : 0;
+}
+
+size_t layout_convert_record(const char *src, char *dst, size_t size, int to_host) {
+	const size_t header_size = 4 + 128 + 768 + 4 + 4 + 4;
+	if(size < header_size) {
+		return 0;
+	}
+	uint32_t record_size = layout_convert_number(src, dst, to_host);
+	if(record_size > size - 4 || record_size < header_size - 4 + 1) {
+		return 0;
+	}
+	uint32_t width = layout_convert_number(src + 4 + 128 + 768, dst ? dst + 4 + 128 + 768 : NULL, to_host);
+	uint32_t height = layout_convert_number(src + 4 + 128 + 768 + 4, dst ? dst + 4 + 128 + 768 + 4 : NULL, to_host);
+	uint32_t count = layout_convert_number(src + 4 + 128 + 768 + 4 + 4, dst ? dst + 4 + 128 + 768 + 4 + 4 : NULL, to_host);
+	uint32_t leaves = 0;
+	if(width == 0 || height == 0 || !layout_convert_splits(src + header_size, dst ? dst + header_size : NULL,
+			4 + record_size - header_size, width, height, 0, &leaves, to_host) || leaves != count) {
+		return 0;
+	}
+	return 4 + record_size;
+}
+
+int layout_property_to_host(char *layout, size_t size) {
+	if(size < 4) {
+		return 1;
+	}
+	layout_convert_number(layout, layout, 1);
+	size_t offset = 4;
+	while(offset < size) {
+		if(size - offset < 4) {
+			return 1;
+		}
+		layout_convert_number(layout + offset, layout + offset, 1);
+		size_t record_size = layout_convert_record(layout + offset + 4, layout + offset + 4, size - offset - 4, 1);
+		if(!record_size) {
+			return 1;
+		}
+		offset += 4 + record_size;
+	}
+	return 0;
+}
+
+char *layout_property_record(char *layout, size_t size, uint32_t output, char *previous) {
+	char *entry = previous ? previous + 4 + *(unsigned int *)previous : layout + 4;
+	while(entry + 4 + 4 <= layout + size) {
+		char *record = entry + 4;
+		unsigned int record_size = *(unsigned int *)record;
+		if(record_size < 128 + 768 + 4 + 4 + 4 + 1 || record_size > (size_t)(layout + size - record - 4)) {
+			break;
+		}
+		if(*(uint32_t *)entry == output) {
+			return record;
+		}
+		entry = record + 4 + record_size;
+	}
+	return NULL;
+}
+
+/*
+	Layout snapshot
+*/
+static void snapshot_header(struct SnapshotHeader *header, uint32_t timestamp, uint32_t config_timestamp, uint32_t fingerprint) {
+	memset(header, 0, sizeof(struct SnapshotHeader));
+	header->magic = SNAPSHOT_MAGIC;
+	header->version = SNAPSHOT_VERSION;
+	header->timestamp = timestamp;
+	header->config_timestamp = config_timestamp;
+	header->fingerprint = fingerprint;
+	header->config_dev = config_file_stat.st_dev;
+	header->config_ino = config_file_stat.st_ino;
+	header->config_size = config_file_stat.st_size;
+	header->config_mtime_sec = config_file_stat.st_mtim.tv_sec;
+	header->config_mtime_nsec = config_file_stat.st_mtim.tv_nsec;
+}
+
+// Unmaps the snapshot unless it is the one for the given resources and the loaded configuration
+static const struct SnapshotHeader *check_snapshot(void *mapping, size_t size, uint32_t timestamp, uint32_t config_timestamp, uint32_t fingerprint) {
+	struct SnapshotHeader expected;
+	snapshot_header(&expected, timestamp, config_timestamp, fingerprint);
+	if(size >= sizeof(struct SnapshotHeader)) {
+		expected.count = ((const struct SnapshotHeader *)mapping)->count;
+		if(memcmp(mapping, &expected, sizeof(struct SnapshotHeader)) == 0) {
+			return (const struct SnapshotHeader *)mapping;
+		}
+	}
+	munmap(mapping, size);
+	return NULL;
+}
+
+// Copies of the snapshot of this process are private mappings, released like a mapped file
+const struct SnapshotHeader *open_snapshot(const char *display, uint32_t timestamp, uint32_t config_timestamp, uint32_t fingerprint, size_t *size) {
+	if(!config_file) {
+		return NULL;
+	}
+	char name[256];
+	void *copy = display_file_name(name, sizeof(name), display) ? NULL : fakexrandr_copy_snapshot(name, size);
+	if(copy && check_snapshot(copy, *size, timestamp, config_timestamp, fingerprint)) {
+		return (const struct SnapshotHeader *)copy;
+	}
+
+	char path[512];
+	if(runtime_file_path(path, sizeof(path), display, "snapshot")) {
+		return NULL;
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) {
+		return NULL;
+	}
+
+	struct stat snapshot_stat;
+	const struct SnapshotHeader *snapshot = NULL;
+	if(fstat(fd, &snapshot_stat) == 0 && snapshot_stat.st_size >= (off_t)sizeof(struct SnapshotHeader)) {
+		void *mapping = mmap(NULL, snapshot_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if(mapping != MAP_FAILED) {
+			snapshot = check_snapshot(mapping, snapshot_stat.st_size, timestamp, config_timestamp, fingerprint);
+			*size = snapshot_stat.st_size;
+		}
+	}
+	close(fd);
+	return snapshot;
+}
+
+void close_snapshot(const struct SnapshotHeader *snapshot, size_t size) {
+	if(snapshot) {
+		munmap((void *)snapshot, size);
+	}
+}
+
+const struct SnapshotEntry *snapshot_next(const struct SnapshotHeader *snapshot, size_t size, const struct SnapshotEntry *previous) {
+	const char *end = (const char *)snapshot + size;
+	const char *next = previous ? (const char *)(previous + 1) + previous->output_info_size + previous->crtc_info_size : (const char *)(snapshot + 1);
+	const struct SnapshotEntry *entry = (const struct SnapshotEntry *)next;
+	if((size_t)(end - next) < sizeof(struct SnapshotEntry)) {
+		return NULL;
+	}
+	if(entry->output_info_size < 32 || entry->crtc_info_size < 32 || (entry->output_info_size | entry->crtc_info_size) % 4 ||
+			(size_t)(end - next) - sizeof(struct SnapshotEntry) < (size_t)entry->output_info_size + entry->crtc_info_size) {
+		return NULL;
+	}
+	if((size_t)entry->record_offset + 4 + 128 + 768 + 4 + 4 + 4 + 1 > config_file_size ||
+			*(unsigned int *)&config_file[entry->record_offset] > config_file_size - entry->record_offset - 4) {
+		return NULL;
+	}
+	return entry;
+}
+
+void snapshot_begin(struct SnapshotBuffer *buffer, uint32_t timestamp, uint32_t config_timestamp, uint32_t fingerprint) {
+	buffer->size = 0;
+	buffer->capacity = 4096;
+	buffer->data = (char *)malloc(buffer->capacity);
+	buffer->failed = !buffer->data;
+	if(buffer->data) {
+		snapshot_header((struct SnapshotHeader *)buffer->data, timestamp, config_timestamp, fingerprint);
+		buffer->size = sizeof(struct SnapshotHeader);
+	}
+}
+
+struct SnapshotEntry *snapshot_append(struct SnapshotBuffer *buffer, uint32_t output, char *record, uint32_t output_info_size, uint32_t crtc_info_size) {
+	size_t size = sizeof(struct SnapshotEntry) + output_info_size + crtc_info_size;
+	if(buffer->failed || (output_info_size | crtc_info_size) % 4) {
+		buffer->failed = 1;
+		return NULL;
+	}
+	if(buffer->size + size > buffer->capacity) {
+		size_t capacity = buffer->capacity * 2 + size;
+		char *data = (char *)realloc(buffer->data, capacity);
+		if(!data) {
+			buffer->failed = 1;
+			return NULL;
+		}
+		buffer->data = data;
+		buffer->capacity = capacity;
+	}
+	struct SnapshotEntry *entry = (struct SnapshotEntry *)(buffer->data + buffer->size);
+	memset(entry, 0, size);
+	entry->output = output;
+	entry->record_offset = record - config_file;
+	entry->output_info_size = output_info_size;
+	entry->crtc_info_size = crtc_info_size;
+	buffer->size += size;
+	((struct SnapshotHeader *)buffer->data)->count++;
+	return entry;
+}
+
+void snapshot_save(struct SnapshotBuffer *buffer, const char *display) {
+	char name[256], path[512], temporary[512 + 8];
+	if(!buffer->failed && !display_file_name(name, sizeof(name), display)) {
+		fakexrandr_share_snapshot(name, buffer->data, buffer->size);
+	}
+	if(!buffer->failed && !runtime_file_path(path, sizeof(path), display, "snapshot")) {
+		snprintf(temporary, sizeof(temporary), "%s.XXXXXX", path);
+		int fd = mkstemp(temporary);
+		if(fd >= 0) {
+			int written = write(fd, buffer->data, buffer->size) == (ssize_t)buffer->size;
+			close(fd);
+			if(!written || rename(temporary, path)) {
+				unlink(temporary);
+			}
+		}
+	}
+	free(buffer->data);
+	buffer->data = NULL;
+}
+
+/*
+	Resolution leases
+*/
+#include <errno.h>
+#include <time.h>
+
+#define LEASE_POLL_MS 5
+
+static long lease_elapsed_ms(struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static int lease_take(const char *display, const char *name, long timeout_ms) {
+	char path[512];
+	if(runtime_file_path(path, sizeof(path), display, name)) {
+		return LEASE_NONE;
+	}
+	int fd = open(path, O_RDONLY | O_CREAT | O_CLOEXEC, 0600);
+	if(fd < 0) {
+		return LEASE_NONE;
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while(flock(fd, LOCK_EX | LOCK_NB)) {
+		const int error = errno;
+		if(error == EINTR) {
+			continue;
+		}
+		if(error != EWOULDBLOCK || lease_elapsed_ms(&start) >= timeout_ms) {
+			close(fd);
+			return error == EWOULDBLOCK ? LEASE_BUSY : LEASE_NONE;
+		}
+		struct timespec poll = { 0, LEASE_POLL_MS * 1000000 };
+		nanosleep(&poll, NULL);
+	}
+	return fd;
+}
+
+int probe_lease_take(const char *display) {
+	return lease_take(display, "probe", 0);
+}
+
+int resolve_lease_take(const char *display) {
+	return lease_take(display, "lease", LEASE_TIMEOUT_MS);
+}
+
+void lease_release(int lease) {
+	if(lease >= 0) {
+		close(lease);
+	}
+}
+
@@ -0,0 +1,54 @@
+/*
+	State the fake libraries share within a process
+
+	Both libraries are linked with fakexrandr-shared.c, which defines the
+	functions below with default visibility, like _is_fake_xrandr. The
+	dynamic linker binds the calls of both to the library loaded first, so a
+	process has one table of fake XIDs and one shared snapshot, however many
+	of the libraries it loads. See the XID encoding and the layout snapshots
+	in fakexrandr.h for what they are used for.
+*/
+#ifndef FAKEXRANDR_SHARED_H
+#define FAKEXRANDR_SHARED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define XID_TABLE_PAGE_SIZE    4096
+#define XID_TABLE_PAGES        64 /* 2^18 slots, resource_id_mask has at least 18 bits */
+
+struct XidTableEntry {
+	uint32_t parent;
+	uint32_t index;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+	The slot of the index-th split of parent in the table of fake XIDs, added
+	if it is new, or UINT32_MAX if the table is full
+*/
+uint32_t fakexrandr_xid_table_slot(uint32_t parent, uint32_t index);
+
+// The entry in a slot, or NULL if the slot is not used. Entries never change.
+const struct XidTableEntry *fakexrandr_xid_table_entry(uint32_t slot);
+
+/*
+	Keep a copy of the snapshot for the display, named as in the files, in
+	place of the previous one
+*/
+void fakexrandr_share_snapshot(const char *display, const void *snapshot, size_t size);
+
+/*
+	A copy of the snapshot kept for the display in a private mapping of size
+	bytes, or NULL
+*/
+void *fakexrandr_copy_snapshot(const char *display, size_t *size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
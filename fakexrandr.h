@@ -1,91 +1,520 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sched.h>
+#include "fakexrandr-shared.h"
+#include "fakexrandr-layout.h"
+
+/*
+	We flag outputs and CRTCs as fake by adding a counter in the bits above
+	those the server uses for its own resources:
+	 · xid_unsplit(xid) is the xid of the original output
+	 · xid_split_index(xid) is the counter identifying a virtual, split screen
+
+	On the choice: A typical XID is of the form
+	 client_id | (resource_id_mask & arbitrary value),
+	according to the documentation of the X-Resource extension, and
+	client_id == 0 for all reources mentioned in the RandR protocol. The
+	protocol keeps the top three bits of XIDs zero, so all bits above
+	resource_id_mask but bit 31 are free. xid_encoding_init() takes the mask
+	from the setup of the first connection. Until then, xid_split_mask
+	assumes 0x001FFFFF, which is what a server for 256 clients uses.
+
+	A counter which doesn't fit, because the server leaves few bits or an
+	output has very many splits, is stored as all ones, and the bits of
+	resource_id_mask then hold a slot in a table of parents and counters
+	instead of the parent's xid. The table is shared by both libraries, like
+	the snapshots below (see fakexrandr-shared.h), and only grows, so fake
+	XIDs stay valid for the lifetime of the process. Processes talking to
+	several servers use the encoding of the first, and don't split outputs
+	of servers whose resource_id_mask reaches into the counter.
+*/
+#define XID_SPLIT_MASK_DEFAULT 0x7FE00000
+
+static uint32_t xid_split_mask = XID_SPLIT_MASK_DEFAULT;
+
+// Returns whether outputs of a connection with this mask may be split
+static inline int xid_encoding_init(uint32_t resource_id_mask) {
+	static char done;
+	if(resource_id_mask && !__atomic_test_and_set(&done, __ATOMIC_RELAXED)) {
+		// Real XIDs don't change with the mask, and fake ones come after this
+		const uint32_t above = resource_id_mask >= 0x20000000 ? 0x20000000 : 2u << (31 - __builtin_clz(resource_id_mask));
+		__atomic_store_n(&xid_split_mask, 0x7FFFFFFF & ~(above - 1), __ATOMIC_RELAXED);
+	}
+	// Otherwise real XIDs of the connection could look like fake ones
+	return !(resource_id_mask & __atomic_load_n(&xid_split_mask, __ATOMIC_RELAXED));
+}
+
+static inline int xid_is_split(uint32_t xid) {
+	return (xid & __atomic_load_n(&xid_split_mask, __ATOMIC_RELAXED)) != 0;
+}
+
+static inline uint32_t xid_unsplit(uint32_t xid) {
+	const uint32_t mask = __atomic_load_n(&xid_split_mask, __ATOMIC_RELAXED);
+	if((xid & mask) != mask) {
+		return xid & ~mask;
+	}
+	const struct XidTableEntry *entry = fakexrandr_xid_table_entry(xid & ~mask);
+	return entry ? entry->parent : xid & ~mask;
+}
+
+static inline uint32_t xid_split_index(uint32_t xid) {
+	const uint32_t mask = __atomic_load_n(&xid_split_mask, __ATOMIC_RELAXED);
+	if((xid & mask) != mask) {
+		return (xid & mask) >> __builtin_ctz(mask);
+	}
+	const struct XidTableEntry *entry = fakexrandr_xid_table_entry(xid & ~mask);
+	return entry ? entry->index : 0;
+}
+
+// The xid of the n-th split of the output or CRTC xid
+static inline uint32_t xid_split(uint32_t xid, uint32_t n) {
+	const uint32_t mask = __atomic_load_n(&xid_split_mask, __ATOMIC_RELAXED);
+	const uint32_t parent = xid_unsplit(xid);
+	if(n < mask >> __builtin_ctz(mask)) {
+		return parent | n << __builtin_ctz(mask);
+	}
+	const uint32_t slot = fakexrandr_xid_table_slot(parent, n);
+	// With the table full, the split can't be told apart from its parent
+	return slot != UINT32_MAX ? mask | slot : parent;
+}
+
 /*
-	The management script uses this symbol to identify the fake libXrandr version
+	A screen rectangle as in the Xinerama protocol, laid out like
+	xcb_xinerama_screen_info_t. libxcb-randr fills these for libxcb-xinerama.
 */
-int _is_fake_xrandr = 1;
+struct FakeScreenRect {
+	int16_t x;
+	int16_t y;
+	uint16_t width;
+	uint16_t height;
+};
 
+#ifdef _XRANDR_H_
 /*
-	We use this XID modifier to flag outputs and CRTCs as
-	fake by adding a counter in the first few bits:
-	 · xid & ~XID_SPLIT_MASK is the xid of the original output
-	 · xid >> XID_SPLIT_SHIFT is the counter identifying a virtual, split screen
+	Batch topology, see FakeXRRGetTopology() in libXrandr.c
 
-	On the choice: A typical XID is of the form
-	 client_id | (xid_mask & arbitrary value),
-	according to the documentation of the X-Resource extension. On my system,
-	 xid_mask = 0x001FFFFF
-	and client_id == 0 for all reources mentioned in the RandR protocol.
-	All we need to do is to choose XID_SPLIT_MASK such that
-	XID_SPLIT_MASK & xid_mask == 0.
+	The screen resources with the info of every output and CRTC, real and
+	fake, in the order of resources->outputs resp. resources->crtcs. It all
+	lives in one block of memory, released by FakeXRRFreeTopology(). The
+	resources are a copy for reading and can't be passed to XRR functions.
 */
-#define XID_SPLIT_SHIFT 21
-#define XID_SPLIT_MASK  0x7FE00000
+typedef struct {
+	XRRScreenResources *resources;
+	XRROutputInfo *outputs;
+	XRRCrtcInfo *crtcs;
+} FakeXRRTopology;
+#endif
+
+/*
+	Passes over siblings, i.e. the splits of one CRTC or output
+
+	Siblings share the gamma ramps and output properties of their parent, and
+	tools like redshift or settings daemons read or set these for every CRTC or
+	output they see, once per pass. Once a request for one of them went to the
+	server, the same request for the others is answered from what we know,
+	until one of them comes up again, which starts the next pass. A pass holds
+	one bit per split counter.
+*/
+struct SiblingPass {
+	unsigned char seen[1024 / 8];
+};
+
+// Counters beyond the pass share bits, which only costs an extra request
+static inline uint32_t sibling_pass_bit(uint32_t xid) {
+	return xid_split_index(xid) % (8 * sizeof(((struct SiblingPass *)0)->seen));
+}
+
+static inline void sibling_pass_start(struct SiblingPass *pass, uint32_t xid) {
+	const uint32_t n = sibling_pass_bit(xid);
+	memset(pass->seen, 0, sizeof(pass->seen));
+	pass->seen[n / 8] |= 1 << (n % 8);
+}
+
+// Returns 1 if xid has not come up in the current pass yet, and marks it
+static inline int sibling_pass_join(struct SiblingPass *pass, uint32_t xid) {
+	const uint32_t n = sibling_pass_bit(xid);
+	if(pass->seen[n / 8] & (1 << (n % 8))) {
+		return 0;
+	}
+	pass->seen[n / 8] |= 1 << (n % 8);
+	return 1;
+}
 
 /*
 	Generated by ./configure:
 */
 #include "config.h"
 
+/*
+	The code below is shared by the libraries and fakexrandrd, and defined in
+	fakexrandr-shared.c. Unlike the functions in fakexrandr-shared.h, each of
+	them links its own copy, hidden from the others, so that state like the
+	mapped configuration stays with the library which uses it.
+*/
+#include <stddef.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#pragma GCC visibility push(hidden)
+
+/*
+	The real libraries are only loaded once the first of their functions is
+	needed, and the stubs in the skeletons look up each function on its first
+	call. Programs which never use RandR, e.g. because they only load us as
+	libXinerama, pay nothing for either.
+*/
+void *real_library_symbol(void **library, const char *path, const char *name);
+
 
 /*
     Routines used by libXrandr and libxcb-randr for loading saved configuration
+
+	The configuration stays mapped for as long as the file on disk does not
+	change. config_generation is bumped whenever a different file (or none at
+	all) is loaded, so callers may use it to invalidate anything they derived
+	from the configuration.
 */
+extern char *config_file;
+extern size_t config_file_size;
+extern unsigned int config_generation;
+extern struct stat config_file_stat;
 
-#include <sys/stat.h>
+// The directory the configuration lives in, ${XDG_CONFIG_HOME:-$HOME/.config}
+int get_config_dir(char *config_dir, size_t size);
+
+// Map fakexrandr.bin from there, unless it is mapped already. Returns 0 if it is.
+int open_configuration(void);
+
+/*
+	Layout published by fakexrandrd
+
+	The daemon keeps one X connection and, whenever RandR reports a change,
+	publishes the EDIDs of the outputs of its screen in a file in
+	$XDG_RUNTIME_DIR, so that the clients do not all query them at login or
+	after a hotplug. It holds an exclusive lock on the file for as long as it
+	keeps it up to date; if nobody does, clients query the server themselves.
+
+	The file is updated in place under a seqlock: sequence is odd while an
+	update is in progress, and readers retry if it changed while they copied.
+	Entries are only valid for the configTimestamp they were read at.
+
+	The files of a display are named after the socket of the connection, see
+	connection_display_name(), so that they are shared by all clients of the
+	same server, whatever $DISPLAY says.
+*/
 
-static char *config_file;
-static int config_file_fd;
-static size_t config_file_size;
+/*
+	EDIDs are matched by the hex digits of their first EDID_MAX_BYTES bytes,
+	which fill the 768 characters of a configuration record, as
+	fakexrandr-manage.py stores them. Hex-coded EDIDs need EDID_BUFFER_SIZE
+	bytes with the terminating zero.
+*/
+#define EDID_MAX_BYTES   384
+#define EDID_BUFFER_SIZE (2 * EDID_MAX_BYTES + 1)
+
+#define SHARED_LAYOUT_MAGIC       0x44525846
+#define SHARED_LAYOUT_VERSION     2
+#define SHARED_LAYOUT_MAX_OUTPUTS 32
+
+struct SharedOutput {
+	uint32_t output;
+	uint32_t edid_length;
+	char edid[EDID_BUFFER_SIZE];
+};
+
+struct SharedLayout {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sequence;
+	uint32_t config_timestamp;
+	uint32_t count;
+	struct SharedOutput outputs[SHARED_LAYOUT_MAX_OUTPUTS];
+};
+
+/*
+	The name of the display a connection goes to, from its socket: ":<n>" for
+	the local socket of display n, and "<host>:<n>" over TCP. Returns 1 for
+	other sockets, whose clients then share no files.
+*/
+int connection_display_name(int fd, char *name, size_t size);
+
+// Path of a per-display file in $XDG_RUNTIME_DIR, fakexrandr-<display>.<suffix>
+int runtime_file_path(char *path, size_t size, const char *display, const char *suffix);
+
+int shared_layout_path(char *path, size_t size, const char *display);
+
+// Returns NULL unless fakexrandrd keeps the layout up to date
+const struct SharedLayout *open_shared_layout(const char *display);
+void close_shared_layout(const struct SharedLayout *layout);
+
+/*
+	Copy the hex-coded EDID of an output, like get_output_edid() does, into a
+	buffer of EDID_BUFFER_SIZE bytes. Returns its length, or -1 if the layout does not
+	know the output at config_timestamp.
+*/
+int shared_output_edid(const struct SharedLayout *layout, uint32_t config_timestamp, uint32_t output, char *edid);
+
+/*
+	Layout property
 
-static void close_configuration() {
-	munmap(config_file, config_file_size);
-	close(config_file_fd);
-	config_file = NULL;
+	fakexrandrd --property also resolves the configuration for the outputs of
+	its screen, and publishes the result in the _FAKEXRANDR_LAYOUT property of
+	the root window, for clients on other hosts or in sandboxes which cannot
+	read the configuration file. The value, of format 8, starts with the
+	configTimestamp it is valid for. Each output whose EDID has configuration
+	records follows with its XID and those records, as they appear in the
+	configuration file. Outputs not listed are not split. All numbers are
+	little-endian, as the daemon and the client may run on different hosts.
+
+	Clients check a value with layout_property_to_host() before they use it,
+	and reject it as a whole if any record is malformed.
+*/
+#define LAYOUT_PROPERTY  "_FAKEXRANDR_LAYOUT"
+#define LAYOUT_MAX_DEPTH 64
+
+/*
+	Read a number at src, little-endian if to_host and in host order if not,
+	and store it at dst, if given, in the other byte order
+*/
+uint32_t layout_convert_number(const char *src, char *dst, int to_host);
+
+/*
+	Check a whole configuration record of at most size bytes, whose count must
+	match the leaves of its split tree, and convert its numbers to dst like
+	layout_convert_number(). Returns its size, or 0 if it is malformed.
+*/
+size_t layout_convert_record(const char *src, char *dst, size_t size, int to_host);
+
+/*
+	Check a layout property value and convert its numbers to host order in
+	place. Returns 1 if it is malformed, and 0 otherwise.
+*/
+int layout_property_to_host(char *layout, size_t size);
+
+/*
+	The records of an output in a checked layout property value. Pass NULL as
+	previous to get the first one, and the previous result to get the next.
+*/
+char *layout_property_record(char *layout, size_t size, uint32_t output, char *previous);
+
+/*
+	Layout snapshot
+
+	The first process which resolves the configuration for a set of screen
+	resources saves which outputs it split, and how, in
+	$XDG_RUNTIME_DIR/fakexrandr-<display>.snapshot. Later processes which get
+	the same resources map it instead of asking for EDIDs and output and CRTC
+	info. A snapshot is valid for the resources with the same timestamps and
+	fingerprint, see fingerprint_add(), and for the configuration file with
+	the same device, inode, size and mtime, whose records it refers to by
+	offset. It is replaced as a whole, by rename(), so readers never see a
+	partial one.
+
+	For each split output a struct SnapshotEntry follows the header, and then
+	its output and CRTC info replies in X11 wire format, both a multiple of 4
+	bytes. Outputs not listed are not split.
+
+	A process which loads both libXrandr and libxcb-randr, e.g. a GTK program
+	with Qt plugins, would otherwise resolve each layout twice, or read it
+	back from the file. Instead, the most recent snapshot is kept in one
+	place for both, see fakexrandr-shared.h. This works without
+	$XDG_RUNTIME_DIR, too.
+*/
+#define SNAPSHOT_MAGIC   0x53525846
+#define SNAPSHOT_VERSION 1
+
+struct SnapshotHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t timestamp;
+	uint32_t config_timestamp;
+	uint32_t fingerprint;
+	uint32_t count;
+	uint64_t config_dev;
+	uint64_t config_ino;
+	uint64_t config_size;
+	int64_t config_mtime_sec;
+	int64_t config_mtime_nsec;
+};
+
+struct SnapshotEntry {
+	uint32_t output;
+	uint32_t record_offset;
+	uint32_t output_info_size;
+	uint32_t crtc_info_size;
+};
+
+// FNV-1a step over the output, CRTC and mode XIDs of a screen resources reply, starting from 2166136261
+static inline uint32_t fingerprint_add(uint32_t hash, uint32_t xid) {
+	return (hash ^ xid) * 16777619u;
 }
 
-static int open_configuration() {
-	// Load the configuration from ${XDG_CONFIG_HOME:-$HOME/.config}/fakexrandr.bin
-	if(config_file) {
-		close_configuration();
-	}
+/*
+	Map the snapshot for the given resources and the loaded configuration,
+	preferring the one of this process. Returns NULL if there is none or it is
+	for something else. Unmap it with close_snapshot().
+*/
+const struct SnapshotHeader *open_snapshot(const char *display, uint32_t timestamp, uint32_t config_timestamp, uint32_t fingerprint, size_t *size);
+void close_snapshot(const struct SnapshotHeader *snapshot, size_t size);
 
-	char *config_dir = getenv("XDG_CONFIG_HOME");
-	if(!config_dir) {
-		char *home_dir = getenv("HOME");
-		if(!home_dir) {
-			return 1;
-		}
-		config_dir = (char*)alloca(512);
-		if(snprintf(config_dir, 512, "%s/.config", home_dir) >= 512) {
-			return 1;
-		}
-	}
+/*
+	Pass NULL as previous to get the first entry of a snapshot, and the
+	previous result to get the next one. Returns NULL at the end, or at an
+	entry which does not fit the snapshot or the configuration.
+*/
+const struct SnapshotEntry *snapshot_next(const struct SnapshotHeader *snapshot, size_t size, const struct SnapshotEntry *previous);
 
-	char config_file_path[512];
-	if(snprintf(config_file_path, 512, "%s/fakexrandr.bin", config_dir) >= 512) {
-		return 1;
-	}
-	if(access(config_file_path, R_OK)) {
-		return 1;
-	}
+/*
+	A snapshot being assembled: the header, then the entries appended with
+	snapshot_append(). If an allocation fails, nothing is saved.
+*/
+struct SnapshotBuffer {
+	char *data;
+	size_t size;
+	size_t capacity;
+	int failed;
+};
+
+void snapshot_begin(struct SnapshotBuffer *buffer, uint32_t timestamp, uint32_t config_timestamp, uint32_t fingerprint);
+
+// Append an entry; the replies are to be filled into the returned space, after the entry
+struct SnapshotEntry *snapshot_append(struct SnapshotBuffer *buffer, uint32_t output, char *record, uint32_t output_info_size, uint32_t crtc_info_size);
+
+// Save the snapshot unless something failed, and free the buffer
+void snapshot_save(struct SnapshotBuffer *buffer, const char *display);
 
-	config_file_fd = open(config_file_path, O_RDONLY);
-	if(config_file_fd < 0) {
-		perror("fakexrandr/open()");
-		return 1;
+/*
+	Resolution leases
+
+	After a hotplug, all clients are notified at once and ask for the screen
+	resources, each making the server probe the outputs again, and then each
+	matches the outputs against the configuration. Instead, the first client
+	takes the probe lease while the server probes for it, and the others,
+	which find it taken, ask for the current resources right away. The first
+	to match takes the resolve lease, and the others wait for it to save its
+	snapshot.
+
+	A lease is an flock() on a file in $XDG_RUNTIME_DIR, like the one
+	fakexrandrd holds, which the kernel releases when its holder exits. Only
+	the resolve lease is waited for, when the application waits for its reply
+	anyway, and at most LEASE_TIMEOUT_MS; a waiter which gets it after that
+	does the work itself.
+*/
+#define LEASE_TIMEOUT_MS 2000
+
+// Otherwise, a lease is the descriptor of its file
+enum {
+	LEASE_NONE = -1, // Not coalesced, e.g. without $XDG_RUNTIME_DIR
+	LEASE_BUSY = -2  // Held by another client
+};
+
+// Never waits, see above
+int probe_lease_take(const char *display);
+
+int resolve_lease_take(const char *display);
+void lease_release(int lease);
+
+#pragma GCC visibility pop
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef __cplusplus
+#include <type_traits>
+
+/*
+	Forwarding wrappers of the XCB libraries
+
+	The wrappers generated by make_skeleton.py pass their arguments to
+	forward(), which hands each of them through an Unsplit<> before calling
+	the real function. XIDs of outputs and CRTCs are plain integer typedefs in
+	XCB, so the generator marks them as SplitXid, and arrays of them as
+	SplitXids, from their declaration. Structures are told apart by their
+	type: those which carry XIDs are declared with carries_xids and need an
+	Unsplit<> specialization, like an array without a length parameter
+	(UnhandledXids), or the build fails. All other arguments are passed on
+	as they are, so that wrappers without XIDs compile to a tail call.
+*/
+struct SplitXid {
+	uint32_t xid;
+};
+
+template<typename T>
+struct SplitXids {
+	const T *xids;
+	uint32_t length;
+};
+
+template<typename T>
+struct UnhandledXids {
+	const T *xids;
+};
+
+template<typename T>
+struct carries_xids : std::false_type {};
+
+template<typename T>
+struct Unsplit {
+	static_assert(!carries_xids<typename std::remove_cv<typename std::remove_pointer<T>::type>::type>::value,
+		"this structure carries XIDs of outputs or CRTCs and needs an Unsplit<> specialization");
+	T value;
+	Unsplit(T value) : value(value) {}
+	T get() const { return value; }
+};
+
+template<>
+struct Unsplit<SplitXid> {
+	uint32_t xid;
+	Unsplit(SplitXid value) : xid(xid_unsplit(value.xid)) {}
+	uint32_t get() const { return xid; }
+};
+
+/*
+	Memory for a copy of XIDs to unsplit. Passing the caller's XIDs on as they
+	are would send fake ones to the server, which it rejects with BadValue or
+	even takes for other resources, so we rather abort the program.
+*/
+static inline void *unsplit_alloc(size_t size) {
+	void *copy = malloc(size);
+	if(!copy && size) {
+		perror("fakexrandr/malloc()");
+		abort();
 	}
-	struct stat config_stat;
-	fstat(config_file_fd, &config_stat);
-	config_file_size = config_stat.st_size;
-	if(config_file_size==0) {
-		return 1;
+	return copy;
+}
+
+template<typename T>
+struct Unsplit<SplitXids<T>> {
+	/* Short arrays, i.e. all in practice, are copied on the stack */
+	T buffer[16];
+	T *xids;
+
+	Unsplit(SplitXids<T> value) {
+		xids = value.length <= 16 ? buffer : static_cast<T *>(unsplit_alloc(value.length * sizeof(T)));
+		for(uint32_t i = 0; i < value.length; i++) {
+			xids[i] = xid_unsplit(value.xids[i]);
+		}
 	}
-	config_file = (char*)mmap(NULL, config_file_size, PROT_READ, MAP_SHARED, config_file_fd, 0);
-	if(config_file == MAP_FAILED) {
-		perror("fakexrandr/mmap()");
-		config_file = NULL;
-		close(config_file_fd);
-		return 1;
+	~Unsplit() {
+		if(xids != buffer) {
+			free(xids);
+		}
 	}
+	Unsplit(const Unsplit &) = delete;
+	const T *get() const { return xids; }
+};
+
+template<typename T>
+struct Unsplit<UnhandledXids<T>> {
+	static_assert(sizeof(T) == 0, "make_skeleton.py found no length parameter for an array of XIDs");
+	Unsplit(UnhandledXids<T>) {}
+};
 
-	return 0;
+template<typename Ret, typename... Params, typename... Args>
+static inline Ret forward(Ret (*fn)(Params...), Args... args) {
+	return fn(Unsplit<Args>(args).get()...);
 }
+#endif
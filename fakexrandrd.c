@@ -0,0 +1,314 @@
+/*
+	fakexrandrd
+
+	Every client of the fake libraries needs the EDIDs of all outputs to match
+	them against the configuration, and at login or after a hotplug dozens of
+	them ask the server at the same time. This daemon asks once per change
+	instead, and publishes the answer for the libraries to map, see struct
+	SharedLayout in fakexrandr.h. Start it with the session; the libraries
+	fall back to querying the server themselves while it does not run.
+
+	It uses the real libxcb-randr, since the fake one would fetch the EDIDs
+	all over again to build its own layout.
+
+	With --property, it also matches the EDIDs against the configuration and
+	publishes the result on the root window, see LAYOUT_PROPERTY, for clients
+	which cannot read our files. The configuration directory is watched, so
+	that an edit is published right away.
+*/
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <xcb/xcb.h>
+#include <xcb/randr.h>
+
+#include "fakexrandr.h"
+
+static xcb_extension_t *randr_id;
+static xcb_randr_query_version_cookie_t (*_xcb_randr_query_version)(xcb_connection_t *c, uint32_t major_version, uint32_t minor_version);
+static xcb_randr_query_version_reply_t *(*_xcb_randr_query_version_reply)(xcb_connection_t *c, xcb_randr_query_version_cookie_t cookie, xcb_generic_error_t **e);
+static xcb_void_cookie_t (*_xcb_randr_select_input)(xcb_connection_t *c, xcb_window_t window, uint16_t enable);
+static xcb_randr_get_screen_resources_current_cookie_t (*_xcb_randr_get_screen_resources_current)(xcb_connection_t *c, xcb_window_t window);
+static xcb_randr_get_screen_resources_current_reply_t *(*_xcb_randr_get_screen_resources_current_reply)(xcb_connection_t *c,
+		xcb_randr_get_screen_resources_current_cookie_t cookie, xcb_generic_error_t **e);
+static xcb_randr_output_t *(*_xcb_randr_get_screen_resources_current_outputs)(const xcb_randr_get_screen_resources_current_reply_t *R);
+static xcb_randr_get_output_property_cookie_t (*_xcb_randr_get_output_property)(xcb_connection_t *c, xcb_randr_output_t output, xcb_atom_t property,
+		xcb_atom_t type, uint32_t long_offset, uint32_t long_length, uint8_t _delete, uint8_t pending);
+static xcb_randr_get_output_property_reply_t *(*_xcb_randr_get_output_property_reply)(xcb_connection_t *c, xcb_randr_get_output_property_cookie_t cookie,
+		xcb_generic_error_t **e);
+static uint8_t *(*_xcb_randr_get_output_property_data)(const xcb_randr_get_output_property_reply_t *R);
+
+static int load_randr() {
+	void *library = dlopen(REAL_XCB_RANDR_LIB, RTLD_LAZY | RTLD_LOCAL);
+	if(!library) {
+		fprintf(stderr, "fakexrandrd: %s\n", dlerror());
+		return 1;
+	}
+
+	#define LOAD(name) if(!(*(void **)&_##name = dlsym(library, #name))) { fprintf(stderr, "fakexrandrd: %s\n", dlerror()); return 1; }
+	LOAD(xcb_randr_query_version);
+	LOAD(xcb_randr_query_version_reply);
+	LOAD(xcb_randr_select_input);
+	LOAD(xcb_randr_get_screen_resources_current);
+	LOAD(xcb_randr_get_screen_resources_current_reply);
+	LOAD(xcb_randr_get_screen_resources_current_outputs);
+	LOAD(xcb_randr_get_output_property);
+	LOAD(xcb_randr_get_output_property_reply);
+	LOAD(xcb_randr_get_output_property_data);
+	#undef LOAD
+
+	randr_id = dlsym(library, "xcb_randr_id");
+	return randr_id == NULL;
+}
+
+/*
+	Lay out the layout property value for the outputs in buffer, or only
+	count its size if buffer is NULL. Malformed records are left out, as the
+	clients would reject the whole value.
+*/
+static size_t layout_property_value(uint32_t config_timestamp, const struct SharedOutput *outputs, int count, char *buffer) {
+	size_t size = 4;
+	if(buffer) {
+		layout_convert_number((const char *)&config_timestamp, buffer, 0);
+	}
+	int i;
+	for(i=0; i<count; i++) {
+		if(!outputs[i].edid_length) {
+			continue;
+		}
+		char *config;
+		for(config = config_file; config + 4 + 128 + 768 <= config_file + config_file_size; config += 4 + *(unsigned int *)config) {
+			unsigned int record_size = 4 + *(unsigned int *)config;
+			if(record_size > (size_t)(config_file + config_file_size - config)) {
+				break;
+			}
+			if(strncmp(&config[4 + 128], outputs[i].edid, 768) || !layout_convert_record(config, NULL, record_size, 0)) {
+				continue;
+			}
+			if(buffer) {
+				layout_convert_number((const char *)&outputs[i].output, buffer + size, 0);
+				memcpy(buffer + size + 4, config, record_size);
+				layout_convert_record(config, buffer + size + 4, record_size, 0);
+			}
+			size += 4 + record_size;
+		}
+	}
+	return size;
+}
+
+// Publish which configuration records apply to which output, or remove the property if there is no configuration
+static void publish_property(xcb_connection_t *c, xcb_window_t root, xcb_atom_t layout_atom, uint32_t config_timestamp, const struct SharedOutput *outputs, int count) {
+	if(open_configuration()) {
+		xcb_delete_property(c, root, layout_atom);
+		return;
+	}
+	size_t size = layout_property_value(config_timestamp, outputs, count, NULL);
+	char *value = malloc(size);
+	if(!value) {
+		return;
+	}
+	layout_property_value(config_timestamp, outputs, count, value);
+	xcb_change_property(c, XCB_PROP_MODE_REPLACE, root, layout_atom, layout_atom, 8, size, value);
+	free(value);
+}
+
+/*
+	Read the EDIDs of all outputs and publish them
+
+	All requests are sent before the first reply is read, and the seqlock is
+	only held while the answers are copied.
+*/
+static void publish(xcb_connection_t *c, xcb_window_t root, xcb_atom_t edid_atom, xcb_atom_t layout_atom, struct SharedLayout *layout) {
+	xcb_randr_get_screen_resources_current_reply_t *res = _xcb_randr_get_screen_resources_current_reply(c,
+			_xcb_randr_get_screen_resources_current(c, root), NULL);
+	if(!res) {
+		return;
+	}
+	xcb_randr_output_t *outputs = _xcb_randr_get_screen_resources_current_outputs(res);
+	int i, count = res->num_outputs < SHARED_LAYOUT_MAX_OUTPUTS ? res->num_outputs : SHARED_LAYOUT_MAX_OUTPUTS;
+
+	xcb_randr_get_output_property_cookie_t cookies[SHARED_LAYOUT_MAX_OUTPUTS];
+	for(i=0; i<count; i++) {
+		cookies[i] = _xcb_randr_get_output_property(c, outputs[i], edid_atom, XCB_ATOM_ANY, 0, EDID_MAX_BYTES / 4, 0, 0);
+	}
+
+	static struct SharedOutput fresh[SHARED_LAYOUT_MAX_OUTPUTS];
+	for(i=0; i<count; i++) {
+		xcb_randr_get_output_property_reply_t *reply = _xcb_randr_get_output_property_reply(c, cookies[i], NULL);
+		fresh[i].output = outputs[i];
+		fresh[i].edid_length = 0;
+		if(!reply) {
+			continue;
+		}
+
+		// Hex-coded like get_output_edid() in the libraries does it
+		static const char digits[] = "0123456789abcdef";
+		uint8_t *data = _xcb_randr_get_output_property_data(reply);
+		uint32_t j, nitems = reply->format == 8 ? reply->num_items : 0;
+		if(nitems > EDID_MAX_BYTES) {
+			nitems = EDID_MAX_BYTES;
+		}
+		for(j=0; j<nitems; j++) {
+			fresh[i].edid[2*j] = digits[data[j] >> 4];
+			fresh[i].edid[2*j+1] = digits[data[j] & 0xf];
+		}
+		fresh[i].edid_length = 2 * nitems;
+		fresh[i].edid[2 * nitems] = 0;
+		free(reply);
+	}
+
+	__atomic_store_n(&layout->sequence, layout->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	layout->config_timestamp = res->config_timestamp;
+	layout->count = count;
+	memcpy(layout->outputs, fresh, count * sizeof(struct SharedOutput));
+	__atomic_store_n(&layout->sequence, layout->sequence + 1, __ATOMIC_RELEASE);
+
+	if(layout_atom != XCB_NONE) {
+		publish_property(c, root, layout_atom, res->config_timestamp, fresh, count);
+	}
+	xcb_flush(c);
+	free(res);
+}
+
+// Watch the directory rather than the file, which is replaced when it is saved
+static int watch_configuration() {
+	char config_dir[512];
+	if(get_config_dir(config_dir, sizeof(config_dir))) {
+		return -1;
+	}
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(fd >= 0 && inotify_add_watch(fd, config_dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE) < 0) {
+		perror("fakexrandrd/inotify_add_watch()");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int main(int argc, char *argv[]) {
+	int property = argc == 2 && strcmp(argv[1], "--property") == 0;
+	if(argc > 1 && !property) {
+		fprintf(stderr, "Usage: %s [--property]\n\nPublishes the EDIDs of the outputs of $DISPLAY for the fake RandR libraries.\n"
+				"With --property, also publishes the resolved layout in the " LAYOUT_PROPERTY " property of the root window.\n", argv[0]);
+		return 1;
+	}
+
+	if(load_randr()) {
+		return 1;
+	}
+
+	int screen_number;
+	xcb_connection_t *c = xcb_connect(NULL, &screen_number);
+	if(xcb_connection_has_error(c)) {
+		fprintf(stderr, "fakexrandrd: Failed to connect to the X server\n");
+		return 1;
+	}
+	// The libraries name the file after the socket of their connection, too
+	char display[256], path[512];
+	if(connection_display_name(xcb_get_file_descriptor(c), display, sizeof(display)) ||
+			shared_layout_path(path, sizeof(path), display)) {
+		fprintf(stderr, "fakexrandrd: XDG_RUNTIME_DIR must be set, and the X server reachable by a socket\n");
+		return 1;
+	}
+	const xcb_query_extension_reply_t *extension = xcb_get_extension_data(c, randr_id);
+	if(!extension || !extension->present) {
+		fprintf(stderr, "fakexrandrd: The X server does not support RandR\n");
+		return 1;
+	}
+	free(_xcb_randr_query_version_reply(c, _xcb_randr_query_version(c, 1, 3), NULL));
+
+	xcb_screen_iterator_t screens = xcb_setup_roots_iterator(xcb_get_setup(c));
+	for(; screens.rem && screen_number; --screen_number) {
+		xcb_screen_next(&screens);
+	}
+	xcb_window_t root = screens.data->root;
+
+	xcb_intern_atom_reply_t *atom = xcb_intern_atom_reply(c, xcb_intern_atom(c, 0, 4, "EDID"), NULL);
+	if(!atom) {
+		return 1;
+	}
+	xcb_atom_t edid_atom = atom->atom;
+	free(atom);
+
+	xcb_atom_t layout_atom = XCB_NONE;
+	int inotify_fd = -1;
+	if(property) {
+		atom = xcb_intern_atom_reply(c, xcb_intern_atom(c, 0, strlen(LAYOUT_PROPERTY), LAYOUT_PROPERTY), NULL);
+		if(!atom) {
+			return 1;
+		}
+		layout_atom = atom->atom;
+		free(atom);
+		inotify_fd = watch_configuration();
+	}
+
+	// The lock tells the libraries that the file is kept up to date. It is
+	// released when we exit, whichever way.
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(fd < 0) {
+		perror("fakexrandrd/open()");
+		return 1;
+	}
+	if(flock(fd, LOCK_EX | LOCK_NB)) {
+		fprintf(stderr, "fakexrandrd: Already running for this display\n");
+		return 1;
+	}
+	if(ftruncate(fd, sizeof(struct SharedLayout))) {
+		perror("fakexrandrd/ftruncate()");
+		return 1;
+	}
+	struct SharedLayout *layout = mmap(NULL, sizeof(struct SharedLayout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(layout == MAP_FAILED) {
+		perror("fakexrandrd/mmap()");
+		return 1;
+	}
+	layout->count = 0;
+	layout->version = SHARED_LAYOUT_VERSION;
+	layout->magic = SHARED_LAYOUT_MAGIC;
+
+	_xcb_randr_select_input(c, root, XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE | XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE |
+			XCB_RANDR_NOTIFY_MASK_OUTPUT_CHANGE | XCB_RANDR_NOTIFY_MASK_OUTPUT_PROPERTY);
+	publish(c, root, edid_atom, layout_atom, layout);
+
+	// We only selected RandR events. A hotplug sends a burst of them, which
+	// is answered once, and so is a burst of changes to the configuration
+	// directory.
+	struct pollfd fds[2] = { { xcb_get_file_descriptor(c), POLLIN, 0 }, { inotify_fd, POLLIN, 0 } };
+	for(;;) {
+		int changed = 0;
+		xcb_generic_event_t *event;
+		while((event = xcb_poll_for_event(c))) {
+			free(event);
+			changed = 1;
+		}
+		if(xcb_connection_has_error(c)) {
+			break;
+		}
+		if(fds[1].revents & POLLIN) {
+			char buffer[4096];
+			while(read(inotify_fd, buffer, sizeof(buffer)) > 0);
+			changed = 1;
+		}
+		fds[0].revents = fds[1].revents = 0;
+
+		if(changed) {
+			publish(c, root, edid_atom, layout_atom, layout);
+		}
+		else if(poll(fds, inotify_fd >= 0 ? 2 : 1, -1) < 0 && errno != EINTR) {
+			break;
+		}
+	}
+
+	xcb_disconnect(c);
+	return 0;
+}
@@ -15,6 +15,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <X11/extensions/Xrandr.h>
+#include <X11/extensions/randrproto.h>
 #include <X11/extensions/Xinerama.h>
 #include <X11/Xlib.h>
 #include <X11/Xlibint.h>
@@ -22,9 +23,15 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <string.h>
+#include <stddef.h>
 
 #include "fakexrandr.h"
 
+static void *real_symbol(const char *name) {
+	static void *xrandr_lib;
+	return real_library_symbol(&xrandr_lib, REAL_XRANDR_LIB, name);
+}
+
 /*
 	The skeleton file is created by ./make_skeleton.py
 
@@ -59,6 +66,9 @@ struct FakeScreenResources {
 	struct FakeInfo *fake_crtcs;
 	struct FakeInfo *fake_outputs;
 	struct FakeInfo *fake_modes;
+
+	// The next screen resources we handed out, see fake_resources()
+	struct FakeScreenResources *next_handed_out;
 };
 
 /*
@@ -67,43 +77,178 @@ struct FakeScreenResources {
 	The configuration file format is documented in the management script. These
 	functions load the configuration file and fill the FakeInfo lists with
 	information on the fake outputs.
+
+	Splits of an output which have the same size share one fake mode. Its
+	FakeInfo has the id of the parent's mode as parent_xid, and output_modes
+	points to the first fake mode of the output.
+*/
+
+/*
+	Names and physical sizes of the splits of an output
+
+	These only depend on the configuration record, the parent's name and its
+	physical size, so they are computed once per record and parent and copied
+	by later resource requests. The list is guarded by the global lock and
+	dropped when the configuration changes.
 */
+struct SplitLabel {
+	char *name;
+	int nameLen;
+	unsigned long mm_width;
+	unsigned long mm_height;
+};
+
+struct SplitLabels {
+	char *record;
+	RROutput parent;
+	char *parent_name;
+	int parent_nameLen;
+	unsigned long mm_width;
+	unsigned long mm_height;
+
+	// Indexed by split number - 1, filled as the splits are first visited
+	unsigned int count;
+	struct SplitLabel *labels;
+
+	struct SplitLabels *next;
+};
+
+static struct SplitLabels *split_labels;
+static unsigned int split_labels_generation;
+
+static struct SplitLabels *find_split_labels(char *record, RROutput parent, XRROutputInfo *output_info) {
+	struct SplitLabels **labels = &split_labels;
+	if(split_labels_generation != config_generation) {
+		while(*labels) {
+			struct SplitLabels *dead = *labels;
+			*labels = dead->next;
+			Xfree(dead);
+		}
+		split_labels_generation = config_generation;
+	}
+
+	for(; *labels; labels = &(*labels)->next) {
+		if((*labels)->record == record && (*labels)->parent == parent) {
+			break;
+		}
+	}
+	if(*labels) {
+		if((*labels)->parent_nameLen == output_info->nameLen && memcmp((*labels)->parent_name, output_info->name, output_info->nameLen) == 0 &&
+				(*labels)->mm_width == output_info->mm_width && (*labels)->mm_height == output_info->mm_height) {
+			return *labels;
+		}
+		struct SplitLabels *dead = *labels;
+		*labels = dead->next;
+		Xfree(dead);
+	}
+
+	unsigned int count = *(unsigned int *)&record[4 + 128 + 768 + 4 + 4];
+	size_t name_size = output_info->nameLen + sizeof("~4294967295");
+	struct SplitLabels *retval = Xcalloc(1, sizeof(struct SplitLabels) + count * (sizeof(struct SplitLabel) + name_size) + output_info->nameLen);
+	if(!retval) {
+		return NULL;
+	}
+	retval->record = record;
+	retval->parent = parent;
+	retval->mm_width = output_info->mm_width;
+	retval->mm_height = output_info->mm_height;
+	retval->count = count;
+	retval->labels = (void*)retval + sizeof(struct SplitLabels);
+	unsigned int i;
+	for(i=0; i<count; i++) {
+		retval->labels[i].name = (void*)(retval->labels + count) + i * name_size;
+	}
+	retval->parent_name = (void*)(retval->labels + count) + count * name_size;
+	retval->parent_nameLen = output_info->nameLen;
+	memcpy(retval->parent_name, output_info->name, output_info->nameLen);
+
+	retval->next = split_labels;
+	split_labels = retval;
+	return retval;
+}
+
+static RRMode intern_fake_mode(struct FakeInfo **output_modes, struct FakeInfo ***fake_modes, RRMode xid, XRRScreenResources *resources, XRRCrtcInfo *crtc_info, unsigned int width, unsigned int height) {
+	struct FakeInfo *mode;
+	for(mode = *output_modes; mode; mode = mode->next) {
+		XRRModeInfo *mode_info = mode->info;
+		if(mode->parent_xid == crtc_info->mode && mode_info->width == width && mode_info->height == height) {
+			return mode->xid;
+		}
+	}
+
+	**fake_modes = Xcalloc(1, sizeof(struct FakeInfo) + sizeof(XRRModeInfo) + sizeof("AAAAAxBBBBB"));
+	(**fake_modes)->xid = xid;
+	(**fake_modes)->parent_xid = crtc_info->mode;
+	XRRModeInfo *fake_mode_info = (**fake_modes)->info = (void*)**fake_modes + sizeof(struct FakeInfo);
+	int i;
+	for(i=0; i<resources->nmode; i++) {
+		if(resources->modes[i].id == crtc_info->mode) {
+			*fake_mode_info = resources->modes[i];
+			break;
+		}
+	}
+	fake_mode_info->id = xid;
+	fake_mode_info->width = width;
+	fake_mode_info->height = height;
+	fake_mode_info->name = (void*)fake_mode_info + sizeof(XRRModeInfo);
+	fake_mode_info->nameLength = sprintf(fake_mode_info->name, "%dx%d", width, height);
+
+	*fake_modes = &(**fake_modes)->next;
+	**fake_modes = NULL;
+	return xid;
+}
 
 static char *_config_foreach_split(char *config, unsigned int *n, unsigned int x, unsigned int y, unsigned int width, unsigned int height, XRRScreenResources *resources, RROutput output, XRROutputInfo *output_info,
-		XRRCrtcInfo *crtc_info, struct FakeInfo ***fake_crtcs, struct FakeInfo ***fake_outputs, struct FakeInfo ***fake_modes) {
+		XRRCrtcInfo *crtc_info, struct FakeInfo ***fake_crtcs, struct FakeInfo ***fake_outputs, struct FakeInfo ***fake_modes, struct FakeInfo **output_modes, struct SplitLabels *labels) {
 
 	if(config[0] == 'N') {
 		// Define a new output info
-		**fake_outputs = Xmalloc(sizeof(struct FakeInfo) + sizeof(XRROutputInfo) + output_info->nameLen + sizeof("~NNN ") + sizeof(RRCrtc) + sizeof(RROutput) * output_info->nclone + 1 * sizeof(RRMode));
-		(**fake_outputs)->xid = (output & ~XID_SPLIT_MASK) | ((++(*n)) << XID_SPLIT_SHIFT);
+		**fake_outputs = Xmalloc(sizeof(struct FakeInfo) + sizeof(XRROutputInfo) + output_info->nameLen + sizeof("~4294967295") + sizeof(RRCrtc) + sizeof(RROutput) * output_info->nclone + 1 * sizeof(RRMode));
+		(**fake_outputs)->xid = xid_split(output, ++(*n));
 		(**fake_outputs)->parent_xid = output;
 		XRROutputInfo *fake_info = (**fake_outputs)->info = (void*)**fake_outputs + sizeof(struct FakeInfo);
 		fake_info->timestamp = output_info->timestamp;
 		fake_info->name = (void*)fake_info + sizeof(XRROutputInfo);
-		fake_info->nameLen = sprintf(fake_info->name, "%s~%d", output_info->name, (*n));
-		fake_info->mm_width = output_info->mm_width * width / crtc_info->width;
-		fake_info->mm_height = output_info->mm_height * height / crtc_info->height;
+		struct SplitLabel *label = labels && *n <= labels->count ? &labels->labels[*n - 1] : NULL;
+		if(label && label->nameLen) {
+			memcpy(fake_info->name, label->name, label->nameLen + 1);
+			fake_info->nameLen = label->nameLen;
+			fake_info->mm_width = label->mm_width;
+			fake_info->mm_height = label->mm_height;
+		}
+		else {
+			fake_info->nameLen = sprintf(fake_info->name, "%s~%d", output_info->name, (*n));
+			fake_info->mm_width = output_info->mm_width * width / crtc_info->width;
+			fake_info->mm_height = output_info->mm_height * height / crtc_info->height;
+			if(label) {
+				memcpy(label->name, fake_info->name, fake_info->nameLen + 1);
+				label->nameLen = fake_info->nameLen;
+				label->mm_width = fake_info->mm_width;
+				label->mm_height = fake_info->mm_height;
+			}
+		}
 		fake_info->connection = output_info->connection;
 		fake_info->subpixel_order = output_info->subpixel_order;
 		fake_info->ncrtc = 1;
-		fake_info->crtcs = (void*)fake_info->name + output_info->nameLen + sizeof("~NNN ");
+		fake_info->crtcs = (void*)fake_info->name + output_info->nameLen + sizeof("~4294967295");
 		fake_info->nclone = output_info->nclone;
 		fake_info->clones = (void*)fake_info->crtcs + sizeof(RRCrtc);
 		int i;
 		for(i=0; i<fake_info->nclone; i++) {
-			fake_info->clones[i] = (output_info->clones[i] & ~XID_SPLIT_MASK) | ((*n) << XID_SPLIT_SHIFT);
+			fake_info->clones[i] = xid_split(output_info->clones[i], *n);
 		}
 		fake_info->nmode = 1;
 		fake_info->npreferred = 0;
 		fake_info->modes = (void*)fake_info->clones + fake_info->nclone * sizeof(RROutput);
-		fake_info->crtc = *fake_info->crtcs = *fake_info->modes = (output_info->crtc & ~XID_SPLIT_MASK) | ((*n) << XID_SPLIT_SHIFT);
+		fake_info->crtc = *fake_info->crtcs = xid_split(output_info->crtc, *n);
+		*fake_info->modes = intern_fake_mode(output_modes, fake_modes, fake_info->crtc, resources, crtc_info, width, height);
 
 		*fake_outputs = &(**fake_outputs)->next;
 		**fake_outputs = NULL;
 
 		// Define a new CRTC info
 		**fake_crtcs = Xmalloc(sizeof(struct FakeInfo) + sizeof(XRRCrtcInfo) + sizeof(RROutput));
-		(**fake_crtcs)->xid = (output_info->crtc & ~XID_SPLIT_MASK) | ((*n) << XID_SPLIT_SHIFT);
+		(**fake_crtcs)->xid = xid_split(output_info->crtc, *n);
 		(**fake_crtcs)->parent_xid = output_info->crtc;
 		XRRCrtcInfo *fake_crtc_info = (**fake_crtcs)->info = ((void*)**fake_crtcs) + sizeof(struct FakeInfo);
 		*fake_crtc_info = *crtc_info;
@@ -114,88 +259,288 @@ static char *_config_foreach_split(char *config, unsigned int *n, unsigned int x
 		fake_crtc_info->mode = *(fake_info->modes);
 		fake_crtc_info->noutput = 1;
 		fake_crtc_info->outputs = (void*)fake_crtc_info + sizeof(XRRCrtcInfo);
-		*(fake_crtc_info->outputs) = (output & ~XID_SPLIT_MASK) | (((*n)) << XID_SPLIT_SHIFT);
+		*(fake_crtc_info->outputs) = xid_split(output, *n);
 		fake_crtc_info->npossible = 1;
 		fake_crtc_info->possible = fake_crtc_info->outputs;
 
 		*fake_crtcs = &(**fake_crtcs)->next;
 		**fake_crtcs = NULL;
 
-		// Define a new fake mode
-		**fake_modes = Xcalloc(1, sizeof(struct FakeInfo) + sizeof(XRRModeInfo) + sizeof("AAAAAxBBBBB"));
-		(**fake_modes)->xid = (output_info->crtc & ~XID_SPLIT_MASK) | ((*n) << XID_SPLIT_SHIFT);
-		(**fake_modes)->parent_xid = 0;
-		XRRModeInfo *fake_mode_info = (**fake_modes)->info = (void*)**fake_modes + sizeof(struct FakeInfo);
-		for(i=0; i<resources->nmode; i++) {
-			if(resources->modes[i].id == crtc_info->mode) {
-				*fake_mode_info = resources->modes[i];
-				break;
-			}
-		}
-		fake_mode_info->id = (**fake_modes)->xid;
-		fake_mode_info->width = width;
-		fake_mode_info->height = height;
-		fake_mode_info->name = (void*)fake_mode_info + sizeof(XRRModeInfo);
-		fake_mode_info->nameLength = sprintf(fake_mode_info->name, "%dx%d", width, height);
-
-		*fake_modes = &(**fake_modes)->next;
-		**fake_modes = NULL;
-
 		return config + 1;
 	}
 	unsigned int split_pos = *(unsigned int *)&config[1];
 	if(config[0] == 'H') {
-		config = _config_foreach_split(config + 1 + 4, n, x, y, width, split_pos, resources, output, output_info, crtc_info, fake_crtcs, fake_outputs, fake_modes);
-		return _config_foreach_split(config, n, x, y + split_pos, width, height - split_pos, resources, output, output_info, crtc_info, fake_crtcs, fake_outputs, fake_modes);
+		config = _config_foreach_split(config + 1 + 4, n, x, y, width, split_pos, resources, output, output_info, crtc_info, fake_crtcs, fake_outputs, fake_modes, output_modes, labels);
+		return _config_foreach_split(config, n, x, y + split_pos, width, height - split_pos, resources, output, output_info, crtc_info, fake_crtcs, fake_outputs, fake_modes, output_modes, labels);
 	}
 	else {
 		assert(config[0] == 'V');
 
-		config = _config_foreach_split(config + 1 + 4, n, x, y, split_pos, height, resources, output, output_info, crtc_info, fake_crtcs, fake_outputs, fake_modes);
-		return _config_foreach_split(config, n, x + split_pos, y, width - split_pos, height, resources, output, output_info, crtc_info, fake_crtcs, fake_outputs, fake_modes);
+		config = _config_foreach_split(config + 1 + 4, n, x, y, split_pos, height, resources, output, output_info, crtc_info, fake_crtcs, fake_outputs, fake_modes, output_modes, labels);
+		return _config_foreach_split(config, n, x + split_pos, y, width - split_pos, height, resources, output, output_info, crtc_info, fake_crtcs, fake_outputs, fake_modes, output_modes, labels);
+	}
+}
+
+/*
+	Output and CRTC info in X11 wire format, as layout snapshots store them;
+	see SnapshotHeader in fakexrandr.h
+*/
+static uint32_t output_info_wire_size(XRROutputInfo *info) {
+	return sz_xRRGetOutputInfoReply + 4 * (info->ncrtc + info->nmode + info->nclone) + ((info->nameLen + 3) & ~3);
+}
+
+static void output_info_to_wire(XRROutputInfo *info, char *wire) {
+	xRRGetOutputInfoReply *reply = (xRRGetOutputInfoReply *)wire;
+	reply->type = X_Reply;
+	reply->status = RRSetConfigSuccess;
+	reply->length = (output_info_wire_size(info) - 32) / 4;
+	reply->timestamp = info->timestamp;
+	reply->crtc = info->crtc;
+	reply->mmWidth = info->mm_width;
+	reply->mmHeight = info->mm_height;
+	reply->connection = info->connection;
+	reply->subpixelOrder = info->subpixel_order;
+	reply->nCrtcs = info->ncrtc;
+	reply->nModes = info->nmode;
+	reply->nPreferred = info->npreferred;
+	reply->nClones = info->nclone;
+	reply->nameLength = info->nameLen;
+
+	CARD32 *ids = (CARD32 *)(wire + sz_xRRGetOutputInfoReply);
+	int i;
+	for(i=0; i<info->ncrtc; i++) {
+		*ids++ = info->crtcs[i];
+	}
+	for(i=0; i<info->nmode; i++) {
+		*ids++ = info->modes[i];
+	}
+	for(i=0; i<info->nclone; i++) {
+		*ids++ = info->clones[i];
+	}
+	memcpy(ids, info->name, info->nameLen);
+}
+
+static XRROutputInfo *output_info_from_wire(const char *wire, uint32_t size) {
+	const xRRGetOutputInfoReply *reply = (const xRRGetOutputInfoReply *)wire;
+	if(size < sz_xRRGetOutputInfoReply + 4 * (reply->nCrtcs + reply->nModes + reply->nClones) + reply->nameLength) {
+		return NULL;
+	}
+	XRROutputInfo *info = Xmalloc(sizeof(XRROutputInfo) + sizeof(RRCrtc) * reply->nCrtcs + sizeof(RRMode) * reply->nModes + sizeof(RROutput) * reply->nClones + reply->nameLength + 1);
+	if(!info) {
+		return NULL;
+	}
+	info->timestamp = reply->timestamp;
+	info->crtc = reply->crtc;
+	info->mm_width = reply->mmWidth;
+	info->mm_height = reply->mmHeight;
+	info->connection = reply->connection;
+	info->subpixel_order = reply->subpixelOrder;
+	info->ncrtc = reply->nCrtcs;
+	info->nmode = reply->nModes;
+	info->npreferred = reply->nPreferred;
+	info->nclone = reply->nClones;
+	info->nameLen = reply->nameLength;
+	info->crtcs = (void*)info + sizeof(XRROutputInfo);
+	info->modes = (void*)info->crtcs + sizeof(RRCrtc) * info->ncrtc;
+	info->clones = (void*)info->modes + sizeof(RRMode) * info->nmode;
+	info->name = (void*)info->clones + sizeof(RROutput) * info->nclone;
+
+	const CARD32 *ids = (const CARD32 *)(wire + sz_xRRGetOutputInfoReply);
+	int i;
+	for(i=0; i<info->ncrtc; i++) {
+		info->crtcs[i] = *ids++;
+	}
+	for(i=0; i<info->nmode; i++) {
+		info->modes[i] = *ids++;
+	}
+	for(i=0; i<info->nclone; i++) {
+		info->clones[i] = *ids++;
+	}
+	memcpy(info->name, ids, info->nameLen);
+	info->name[info->nameLen] = 0;
+	return info;
+}
+
+static uint32_t crtc_info_wire_size(XRRCrtcInfo *info) {
+	return sz_xRRGetCrtcInfoReply + 4 * (info->noutput + info->npossible);
+}
+
+static void crtc_info_to_wire(XRRCrtcInfo *info, char *wire) {
+	xRRGetCrtcInfoReply *reply = (xRRGetCrtcInfoReply *)wire;
+	reply->type = X_Reply;
+	reply->status = RRSetConfigSuccess;
+	reply->length = (crtc_info_wire_size(info) - 32) / 4;
+	reply->timestamp = info->timestamp;
+	reply->x = info->x;
+	reply->y = info->y;
+	reply->width = info->width;
+	reply->height = info->height;
+	reply->mode = info->mode;
+	reply->rotation = info->rotation;
+	reply->rotations = info->rotations;
+	reply->nOutput = info->noutput;
+	reply->nPossibleOutput = info->npossible;
+
+	CARD32 *ids = (CARD32 *)(wire + sz_xRRGetCrtcInfoReply);
+	int i;
+	for(i=0; i<info->noutput; i++) {
+		*ids++ = info->outputs[i];
+	}
+	for(i=0; i<info->npossible; i++) {
+		*ids++ = info->possible[i];
+	}
+}
+
+static XRRCrtcInfo *crtc_info_from_wire(const char *wire, uint32_t size) {
+	const xRRGetCrtcInfoReply *reply = (const xRRGetCrtcInfoReply *)wire;
+	if(size < sz_xRRGetCrtcInfoReply + 4 * (reply->nOutput + reply->nPossibleOutput)) {
+		return NULL;
+	}
+	XRRCrtcInfo *info = Xmalloc(sizeof(XRRCrtcInfo) + sizeof(RROutput) * (reply->nOutput + reply->nPossibleOutput));
+	if(!info) {
+		return NULL;
+	}
+	info->timestamp = reply->timestamp;
+	info->x = reply->x;
+	info->y = reply->y;
+	info->width = reply->width;
+	info->height = reply->height;
+	info->mode = reply->mode;
+	info->rotation = reply->rotation;
+	info->rotations = reply->rotations;
+	info->noutput = reply->nOutput;
+	info->npossible = reply->nPossibleOutput;
+	info->outputs = (void*)info + sizeof(XRRCrtcInfo);
+	info->possible = info->outputs + info->noutput;
+
+	const CARD32 *ids = (const CARD32 *)(wire + sz_xRRGetCrtcInfoReply);
+	int i;
+	for(i=0; i<info->noutput; i++) {
+		info->outputs[i] = *ids++;
+	}
+	for(i=0; i<info->npossible; i++) {
+		info->possible[i] = *ids++;
+	}
+	return info;
+}
+
+/*
+	Add the fake outputs/CRTCs of an output whose CRTC has the size a
+	configuration record was made for. Split labels are only kept for records
+	from the configuration file, which stay where they are until the next
+	generation.
+*/
+static void split_output_infos(XRRScreenResources *resources, RROutput output, char *record, Bool from_file, XRROutputInfo *output_info, XRRCrtcInfo *output_crtc, struct FakeInfo ***fake_crtcs, struct FakeInfo ***fake_outputs, struct FakeInfo ***fake_modes) {
+	unsigned int width = *(unsigned int *)&record[4 + 128 + 768];
+	unsigned int height = *(unsigned int *)&record[4 + 128 + 768 + 4];
+	// unsigned int count = *(unsigned int *)&record[4 + 128 + 768 + 4 + 4];
+
+	unsigned n = 0;
+	_XLockMutex(_Xglobal_lock);
+	struct SplitLabels *labels = from_file ? find_split_labels(record, output, output_info) : NULL;
+	_config_foreach_split(record + 4 + 128 + 768 + 4 + 4 + 4, &n, 0, 0, width, height, resources, output, output_info, output_crtc, fake_crtcs, fake_outputs, fake_modes, *fake_modes, labels);
+	_XUnlockMutex(_Xglobal_lock);
+}
+
+/*
+	Add the fake outputs/CRTCs of an output if its CRTC has the size a
+	configuration record was made for. Returns 1 if so, 0 if not, and -1 if the
+	output has no CRTC. Split outputs are added to the snapshot, if given.
+*/
+static int split_output(Display *dpy, XRRScreenResources *resources, RROutput output, char *record, Bool from_file, struct SnapshotBuffer *snapshot, struct FakeInfo ***fake_crtcs, struct FakeInfo ***fake_outputs, struct FakeInfo ***fake_modes) {
+	unsigned int width = *(unsigned int *)&record[4 + 128 + 768];
+	unsigned int height = *(unsigned int *)&record[4 + 128 + 768 + 4];
+
+	XRROutputInfo *output_info = _XRRGetOutputInfo(dpy, resources, output);
+	if(!output_info || output_info->crtc == 0) {
+		return -1;
+	}
+
+	XRRCrtcInfo *output_crtc = _XRRGetCrtcInfo(dpy, resources, output_info->crtc);
+	if(!output_crtc) {
+		return -1;
 	}
+
+	if(output_crtc->width != (unsigned)width || output_crtc->height != (unsigned)height) {
+		return 0;
+	}
+
+	// If the size matches, add fake outputs/crtcs to the list
+	split_output_infos(resources, output, record, from_file, output_info, output_crtc, fake_crtcs, fake_outputs, fake_modes);
+	if(snapshot) {
+		uint32_t output_info_size = output_info_wire_size(output_info);
+		struct SnapshotEntry *entry = snapshot_append(snapshot, output, record, output_info_size, crtc_info_wire_size(output_crtc));
+		if(entry) {
+			output_info_to_wire(output_info, (char *)(entry + 1));
+			crtc_info_to_wire(output_crtc, (char *)(entry + 1) + output_info_size);
+		}
+	}
+	return 1;
 }
 
-static int config_handle_output(Display *dpy, XRRScreenResources *resources, RROutput output, char *target_edid, struct FakeInfo ***fake_crtcs, struct FakeInfo ***fake_outputs, struct FakeInfo ***fake_modes) {
+/*
+	Returns 1 if the output was split, 0 if the configuration has records for
+	its EDID but none applies, and -1 if it has none.
+*/
+static int config_handle_output(Display *dpy, XRRScreenResources *resources, RROutput output, char *target_edid, struct SnapshotBuffer *snapshot, struct FakeInfo ***fake_crtcs, struct FakeInfo ***fake_outputs, struct FakeInfo ***fake_modes) {
 	char *config;
+	int retval = -1;
 	for(config = config_file; (int)(config - config_file) <= (int)config_file_size; ) {
 		// Walk through the configuration file and search for the target_edid
 		unsigned int size = *(unsigned int *)config;
 		// char *name = &config[4];
 		char *edid = &config[4 + 128];
-		unsigned int width = *(unsigned int *)&config[4 + 128 + 768];
-		unsigned int height = *(unsigned int *)&config[4 + 128 + 768 + 4];
-		// unsigned int count = *(unsigned int *)&config[4 + 128 + 768 + 4 + 4];
 
 		if(strncmp(edid, target_edid, 768) == 0) {
-			XRROutputInfo *output_info = _XRRGetOutputInfo(dpy, resources, output);
-			if(!output_info || output_info->crtc == 0) {
-				return 0;
-			}
-
-			XRRCrtcInfo *output_crtc = _XRRGetCrtcInfo(dpy, resources, output_info->crtc);
-			if(!output_crtc) {
-				return 0;
-			}
-
-			if(output_crtc->width == (unsigned)width && output_crtc->height == (unsigned)height) {
-				// If it is found and the size matches, add fake outputs/crtcs to the list
-				unsigned n = 0;
-				_config_foreach_split(config + 4 + 128 + 768 + 4 + 4 + 4, &n, 0, 0, width, height, resources, output, output_info, output_crtc, fake_crtcs, fake_outputs, fake_modes);
-				return 1;
+			int split = split_output(dpy, resources, output, config, True, snapshot, fake_crtcs, fake_outputs, fake_modes);
+			if(split) {
+				return split > 0;
 			}
+			retval = 0;
 		}
 
 		config += 4 + size;
 	}
 
+	return retval;
+}
+
+// The same for the records fakexrandrd published for an output
+static int layout_handle_output(Display *dpy, XRRScreenResources *resources, RROutput output, char *layout, size_t layout_size, struct FakeInfo ***fake_crtcs, struct FakeInfo ***fake_outputs, struct FakeInfo ***fake_modes) {
+	char *record = NULL;
+	while((record = layout_property_record(layout, layout_size, output, record))) {
+		int split = split_output(dpy, resources, output, record, False, NULL, fake_crtcs, fake_outputs, fake_modes);
+		if(split) {
+			return split > 0;
+		}
+	}
+
 	return 0;
 }
 
+// The same for all outputs a layout snapshot lists
+static void snapshot_handle_outputs(XRRScreenResources *resources, const struct SnapshotHeader *snapshot, size_t snapshot_size, struct FakeInfo ***fake_crtcs, struct FakeInfo ***fake_outputs, struct FakeInfo ***fake_modes) {
+	const struct SnapshotEntry *entry = NULL;
+	while((entry = snapshot_next(snapshot, snapshot_size, entry))) {
+		int i;
+		for(i=0; i<resources->noutput && resources->outputs[i] != entry->output; i++);
+		if(i == resources->noutput) {
+			continue;
+		}
+		XRROutputInfo *output_info = output_info_from_wire((const char *)(entry + 1), entry->output_info_size);
+		XRRCrtcInfo *output_crtc = crtc_info_from_wire((const char *)(entry + 1) + entry->output_info_size, entry->crtc_info_size);
+		if(output_info && output_crtc) {
+			split_output_infos(resources, entry->output, config_file + entry->record_offset, True, output_info, output_crtc, fake_crtcs, fake_outputs, fake_modes);
+		}
+		Xfree(output_info);
+		Xfree(output_crtc);
+	}
+}
+
 /*
 	Helper function to return a hex-coded EDID string for a given output
 
-	edid must point to a sufficiently large (768 bytes) buffer.
+	edid must point to a buffer of EDID_BUFFER_SIZE bytes.
 */
 static int get_output_edid(Display *dpy, RROutput output, char *edid) {
 	Atom actual_type;
@@ -204,9 +549,13 @@ static int get_output_edid(Display *dpy, RROutput output, char *edid) {
 	unsigned long bytes_after;
 	unsigned char *prop;
 
-	_XRRGetOutputProperty(dpy, output, XInternAtom(dpy, "EDID", 1), 0, 384,
+	// The length is counted in 32 bit units
+	_XRRGetOutputProperty(dpy, output, XInternAtom(dpy, "EDID", 1), 0, EDID_MAX_BYTES / 4,
 			0, 0, 0, &actual_type, &actual_format, &nitems, &bytes_after, &prop);
 
+	if(nitems > EDID_MAX_BYTES) {
+		nitems = EDID_MAX_BYTES;
+	}
 	if(nitems > 0) {
 		unsigned i;
 		for(i=0; i<nitems; i++) {
@@ -257,10 +606,377 @@ static struct FakeInfo *xid_in_list(struct FakeInfo *list, XID xid) {
 }
 
 /*
-	The following function augments the original XRRScreenResources with the
-	fake outputs
+	Per-display state
+
+	Xinerama clients (GTK2, Java, Wine, ...) query the screen layout on about
+	every window map or move. We keep the computed table for the default root
+	window of each display and only recompute it after the server notified us
+	of a RandR configuration change, or if the configuration file changed.
+
+	To learn about changes, we select RandR notifications on a window of our
+	own and hook into the conversion of wire events. The server reports each
+	notification once per selecting window, so the ones for our window are
+	counted and dropped there, and everything else is passed on untouched.
+	The counter only advances as the application reads its events; we never
+	read the connection just to look for notifications.
+*/
+#define WATCHED_RANDR_EVENTS (RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask | RROutputChangeNotifyMask | RROutputPropertyNotifyMask)
+
+typedef Bool (*WireToEventProc)(Display *, XEvent *, xEvent *);
+
+struct SplitInfo {
+	RROutput parent;
+	RROutput output;
+	RRCrtc parent_crtc;
+	RRCrtc crtc;
+	RRMode mode;
+	Atom name;
+	int x, y, width, height;
+	int mwidth, mheight;
+
+	// Points into the split table, after the entries
+	char *output_name;
+};
+
+// A property request for an output and its answer, see XRRGetOutputProperty()
+struct PropertyCache {
+	// The request: X_RRListOutputProperties, X_RRQueryOutputProperty or
+	// X_RRGetOutputProperty, and its parameters
+	RROutput parent;
+	int kind;
+	Atom property;
+	long offset, length;
+	Bool pending;
+	Atom req_type;
+
+	// The answer, which is valid until the next notification
+	unsigned int changes;
+	unsigned int property_changes;
+	struct SiblingPass pass;
+	void *data;
+	size_t size;
+	int count;
+	Atom actual_type;
+	int actual_format;
+	unsigned long nitems, bytes_after;
+
+	struct PropertyCache *next;
+};
+
+// What we know about the gamma of a CRTC and its splits, see XRRSetCrtcGamma()
+struct GammaCache {
+	RRCrtc parent;
+	int size;
+	struct SiblingPass size_pass;
+	XRRCrtcGamma *ramps;
+	struct SiblingPass ramps_pass;
+	struct GammaCache *next;
+};
+
+struct DisplayState {
+	Display *dpy;
+	Window root;
+	int event_base;
+	int major_opcode;
+
+	// RandR events the application selected on root through this library
+	int client_event_mask;
+
+	// The unmapped window our own notifications are selected on, or None
+	Window watch_window;
+
+	// The previous wire to event converters for RRScreenChangeNotify and RRNotify
+	WireToEventProc wire_to_event[2];
+
+	// Counts RandR change notifications. Caches remember the count they were
+	// computed at. It starts at 1, such that no cache is initially valid.
+	unsigned int changes;
+
+	// Counts output property notifications, for the property cache
+	unsigned int property_changes;
+
+	// The latest configTimestamp a notification or the resources reported
+	Time config_timestamp;
+
+	// Counts screen change notifications and new configTimestamps, and the
+	// count at the last screen resources request, see XRRGetScreenResources()
+	unsigned int screen_changes;
+	unsigned int probed_changes;
+
+	// Cached Xinerama screen table
+	unsigned int screens_changes;
+	unsigned int screens_generation;
+	Bool screens_active;
+	XineramaScreenInfo *screens;
+	int nscreens;
+
+	// Cached geometry and names of the splits, for the monitor list
+	unsigned int splits_changes;
+	unsigned int splits_generation;
+	struct SplitInfo *splits;
+	int nsplits;
+
+	// Bumped whenever the split table changes, see fakexrandr_layout_generation()
+	unsigned int layout_generation;
+
+	struct GammaCache *gamma;
+	struct PropertyCache *properties;
+
+	// See known_no_match(), known_no_record() and layout_atom()
+	struct {
+		Bool valid;
+		unsigned int generation;
+		Time timestamp;
+		Time configTimestamp;
+		uint32_t fingerprint;
+	} no_match;
+	struct {
+		Bool valid;
+		unsigned int generation;
+		Time configTimestamp;
+	} no_record;
+	struct {
+		Bool looked_up;
+		Atom atom;
+		Bool missed;
+		Time missed_at;
+	} layout_lookup;
+
+	struct DisplayState *next;
+};
+
+static struct DisplayState *display_states;
+
+static struct DisplayState *find_display_state(Display *dpy) {
+	struct DisplayState *state;
+	_XLockMutex(_Xglobal_lock);
+	for(state = display_states; state && state->dpy != dpy; state = state->next);
+	_XUnlockMutex(_Xglobal_lock);
+	return state;
+}
+
+static struct DisplayState *get_display_state(Display *dpy);
+
+/*
+	If nothing is split, the real screen resources are handed out unchanged, so
+	we keep a list of the ones we made to tell the two apart. Applications free
+	their screen resources soon, which keeps it short.
+*/
+static struct FakeScreenResources *handed_out;
+
+static struct FakeScreenResources **find_handed_out(XRRScreenResources *resources) {
+	struct FakeScreenResources **res;
+	for(res = &handed_out; *res && &(*res)->res != resources; res = &(*res)->next_handed_out);
+	return res;
+}
+
+static struct FakeScreenResources *fake_resources(XRRScreenResources *resources) {
+	if(!resources) {
+		return NULL;
+	}
+	_XLockMutex(_Xglobal_lock);
+	struct FakeScreenResources *res = *find_handed_out(resources);
+	_XUnlockMutex(_Xglobal_lock);
+	return res;
+}
+
+static void hand_out_resources(struct FakeScreenResources *res) {
+	_XLockMutex(_Xglobal_lock);
+	res->next_handed_out = handed_out;
+	handed_out = res;
+	_XUnlockMutex(_Xglobal_lock);
+}
+
+// Removes resources from the list, returning NULL if they are not ours
+static struct FakeScreenResources *take_back_resources(XRRScreenResources *resources) {
+	if(!resources) {
+		return NULL;
+	}
+	_XLockMutex(_Xglobal_lock);
+	struct FakeScreenResources **slot = find_handed_out(resources);
+	struct FakeScreenResources *res = *slot;
+	if(res) {
+		*slot = res->next_handed_out;
+	}
+	_XUnlockMutex(_Xglobal_lock);
+	return res;
+}
+
+/*
+	Negative match cache
+
+	If no output matches the configuration, the next resources request with
+	the same outputs, CRTCs, timestamps and configuration generation will not
+	match either, so it is passed through without fetching the EDIDs again.
+	Kept per display and guarded by the global lock.
+*/
+
+static uint32_t resources_fingerprint(XRRScreenResources *res) {
+	uint32_t hash = 2166136261u;
+	int i;
+	for(i=0; i<res->noutput; i++) {
+		hash = fingerprint_add(hash, res->outputs[i]);
+	}
+	for(i=0; i<res->ncrtc; i++) {
+		hash = fingerprint_add(hash, res->crtcs[i]);
+	}
+	for(i=0; i<res->nmode; i++) {
+		hash = fingerprint_add(hash, res->modes[i].id);
+	}
+	return hash;
+}
+
+static Bool known_no_match(struct DisplayState *state, XRRScreenResources *res, uint32_t fingerprint) {
+	if(!state) {
+		return False;
+	}
+	_XLockMutex(_Xglobal_lock);
+	Bool retval = state->no_match.valid && state->no_match.generation == config_generation && state->no_match.timestamp == res->timestamp &&
+		state->no_match.configTimestamp == res->configTimestamp && state->no_match.fingerprint == fingerprint;
+	_XUnlockMutex(_Xglobal_lock);
+	return retval;
+}
+
+static void set_no_match(struct DisplayState *state, XRRScreenResources *res, uint32_t fingerprint) {
+	if(!state) {
+		return;
+	}
+	_XLockMutex(_Xglobal_lock);
+	state->no_match.valid = True;
+	state->no_match.generation = config_generation;
+	state->no_match.timestamp = res->timestamp;
+	state->no_match.configTimestamp = res->configTimestamp;
+	state->no_match.fingerprint = fingerprint;
+	_XUnlockMutex(_Xglobal_lock);
+}
+
+/*
+	If no output has a record at all, nothing can be split, whatever modes are
+	set, until the outputs change, which bumps the configTimestamp, or the
+	configuration changes. Xinerama then passes through to the real library
+	without asking for the resources. Kept per display and guarded by the
+	global lock.
+*/
+static void set_no_record(Display *dpy, Time configTimestamp) {
+	struct DisplayState *state = get_display_state(dpy);
+	if(!state) {
+		return;
+	}
+	_XLockMutex(_Xglobal_lock);
+	state->no_record.valid = True;
+	state->no_record.generation = config_generation;
+	state->no_record.configTimestamp = configTimestamp;
+	_XUnlockMutex(_Xglobal_lock);
+}
+
+static Bool known_no_record(Display *dpy, Time configTimestamp) {
+	struct DisplayState *state = get_display_state(dpy);
+	if(!state) {
+		return False;
+	}
+	_XLockMutex(_Xglobal_lock);
+	Bool retval = state->no_record.valid && state->no_record.generation == config_generation && state->no_record.configTimestamp == configTimestamp;
+	_XUnlockMutex(_Xglobal_lock);
+	return retval;
+}
+
+/*
+	The layout fakexrandrd published on the root window, if it is valid for
+	the resources; see LAYOUT_PROPERTY in fakexrandr.h. Free it with XFree.
+
+	The atom is looked up once per display, i.e. only a daemon that ran before
+	is seen. If the property does not exist, we only look again once the
+	configTimestamp changed. Kept per display and guarded by the global lock.
+*/
+static Atom layout_atom(Display *dpy) {
+	struct DisplayState *state = get_display_state(dpy);
+	if(!state) {
+		return XInternAtom(dpy, LAYOUT_PROPERTY, True);
+	}
+	_XLockMutex(_Xglobal_lock);
+	Bool looked_up = state->layout_lookup.looked_up;
+	Atom atom = state->layout_lookup.atom;
+	_XUnlockMutex(_Xglobal_lock);
+	if(looked_up) {
+		return atom;
+	}
+
+	atom = XInternAtom(dpy, LAYOUT_PROPERTY, True);
+	_XLockMutex(_Xglobal_lock);
+	state->layout_lookup.looked_up = True;
+	state->layout_lookup.atom = atom;
+	state->layout_lookup.missed = False;
+	_XUnlockMutex(_Xglobal_lock);
+	return atom;
+}
+
+// Whether there is anything that may split outputs, without asking for the resources
+static Bool may_split(Display *dpy) {
+	return config_file || layout_atom(dpy) != None;
+}
+
+/*
+	The root window of the screen of window. Other windows than roots are
+	taken to be on the default screen: asking would cost a round trip, and an
+	error for a window destroyed meanwhile would go to the application.
+*/
+static Window window_root(Display *dpy, Window window) {
+	int i;
+	for(i=0; i<ScreenCount(dpy); i++) {
+		if(RootWindow(dpy, i) == window) {
+			return window;
+		}
+	}
+	return DefaultRootWindow(dpy);
+}
+
+static char *get_layout_property(Display *dpy, Window window, XRRScreenResources *res, unsigned long *size) {
+	Atom atom = layout_atom(dpy);
+	struct DisplayState *state = find_display_state(dpy);
+	_XLockMutex(_Xglobal_lock);
+	Bool missed = state && state->layout_lookup.missed && state->layout_lookup.missed_at == res->configTimestamp;
+	_XUnlockMutex(_Xglobal_lock);
+	if(atom == None || missed) {
+		return NULL;
+	}
+
+	Atom actual_type = None;
+	int actual_format = 0;
+	unsigned long nitems = 0;
+	unsigned long bytes_after;
+	unsigned char *value = NULL;
+	XGetWindowProperty(dpy, window_root(dpy, window), atom, 0, 1 << 20, False, AnyPropertyType, &actual_type, &actual_format, &nitems, &bytes_after, &value);
+
+	_XLockMutex(_Xglobal_lock);
+	if(state) {
+		state->layout_lookup.missed = actual_type == None;
+		state->layout_lookup.missed_at = res->configTimestamp;
+	}
+	_XUnlockMutex(_Xglobal_lock);
+
+	// The daemon may not have caught up with a change yet
+	if(value && (actual_format != 8 || layout_property_to_host((char *)value, nitems) || *(uint32_t *)value != (uint32_t)res->configTimestamp)) {
+		XFree(value);
+		value = NULL;
+	}
+	*size = nitems;
+	return (char *)value;
+}
+
+// The name of the display of dpy in the files shared with other clients, or NULL
+static const char *shared_display_name(Display *dpy, char *name, size_t size) {
+	return connection_display_name(ConnectionNumber(dpy), name, size) ? NULL : name;
+}
+
+/*
+	The following function augments the original XRRScreenResources, which
+	were asked for with window, with the fake outputs
 */
-static struct FakeScreenResources *augment_resources(Display *dpy, XRRScreenResources *res) {
+static XRRScreenResources *augment_resources(Display *dpy, Window window, XRRScreenResources *res) {
+	if(!xid_encoding_init(dpy->resource_mask)) {
+		return res;
+	}
+
 	struct FakeInfo *outputs = NULL;
 	struct FakeInfo *crtcs = NULL;
 	struct FakeInfo *modes = NULL;
@@ -269,20 +985,72 @@ static struct FakeScreenResources *augment_resources(Display *dpy, XRRScreenReso
 	struct FakeInfo **crtcs_end = &crtcs;
 	struct FakeInfo **modes_end = &modes;
 
-	// Fill the FakeInfo structures
-	if(open_configuration()) {
-		struct FakeScreenResources *retval = Xcalloc(1, sizeof(struct FakeScreenResources));
-		retval->res = *res;
-		retval->parent_res = res;
-		return retval;
+	if(!res) {
+		return res;
+	}
+	Bool have_configuration = !open_configuration();
+	uint32_t fingerprint = resources_fingerprint(res);
+	char name[256];
+	const char *display = have_configuration ? shared_display_name(dpy, name, sizeof(name)) : NULL;
+	struct DisplayState *state = get_display_state(dpy);
+	if(known_no_match(state, res, fingerprint)) {
+		return res;
 	}
 
+	// A layout fakexrandrd resolved for us takes precedence
+	unsigned long layout_size;
+	char *layout = get_layout_property(dpy, window, res, &layout_size);
 	int i;
-	for(i=0; i<res->noutput; i++) {
-		char output_edid[768];
-		if(get_output_edid(dpy, res->outputs[i], output_edid) > 0) {
-			config_handle_output(dpy, res, res->outputs[i], output_edid, &crtcs_end, &outputs_end, &modes_end);
+	if(layout) {
+		for(i=0; i<res->noutput; i++) {
+			layout_handle_output(dpy, res, res->outputs[i], layout, layout_size, &crtcs_end, &outputs_end, &modes_end);
+		}
+		// Past the configTimestamp, the daemon only lists outputs with records
+		if(layout_size <= 4) {
+			set_no_record(dpy, res->configTimestamp);
+		}
+		XFree(layout);
+	}
+	else if(have_configuration) {
+		// Another process may have resolved the same resources already
+		size_t snapshot_size;
+		const struct SnapshotHeader *snapshot = open_snapshot(display, res->timestamp, res->configTimestamp, fingerprint, &snapshot_size);
+		// or is about to, see resolve_lease_take(). A holder before us may have saved it.
+		int lease = snapshot ? LEASE_NONE : resolve_lease_take(display);
+		if(lease >= 0) {
+			snapshot = open_snapshot(display, res->timestamp, res->configTimestamp, fingerprint, &snapshot_size);
+		}
+		if(snapshot) {
+			snapshot_handle_outputs(res, snapshot, snapshot_size, &crtcs_end, &outputs_end, &modes_end);
+			close_snapshot(snapshot, snapshot_size);
 		}
+		else {
+			// Fill the FakeInfo structures. fakexrandrd, if it runs, knows the EDIDs.
+			struct SnapshotBuffer buffer;
+			snapshot_begin(&buffer, res->timestamp, res->configTimestamp, fingerprint);
+			const struct SharedLayout *shared = open_shared_layout(display);
+			Bool have_record = False;
+			for(i=0; i<res->noutput; i++) {
+				char output_edid[EDID_BUFFER_SIZE];
+				int length = shared_output_edid(shared, res->configTimestamp, res->outputs[i], output_edid);
+				if(length < 0) {
+					length = get_output_edid(dpy, res->outputs[i], output_edid);
+				}
+				if(length > 0 && config_handle_output(dpy, res, res->outputs[i], output_edid, &buffer, &crtcs_end, &outputs_end, &modes_end) >= 0) {
+					have_record = True;
+				}
+			}
+			close_shared_layout(shared);
+			if(!have_record) {
+				set_no_record(dpy, res->configTimestamp);
+			}
+			snapshot_save(&buffer, display);
+		}
+		lease_release(lease);
+	}
+	if(!outputs) {
+		set_no_match(state, res, fingerprint);
+		return res;
 	}
 
 	int ncrtc = res->ncrtc + list_length(crtcs);
@@ -319,7 +1087,7 @@ static struct FakeScreenResources *augment_resources(Display *dpy, XRRScreenReso
 		if(xid_in_list(outputs, res->outputs[i])) {
 			struct FakeInfo *toutput;
 			for(toutput=outputs; toutput; toutput = toutput->next) {
-				if((toutput->xid & ~XID_SPLIT_MASK) == res->outputs[i]) {
+				if(xid_unsplit(toutput->xid) == res->outputs[i]) {
 					*next_output = toutput->xid;
 					next_output++;
 					retval->res.noutput++;
@@ -340,51 +1108,580 @@ static struct FakeScreenResources *augment_resources(Display *dpy, XRRScreenReso
 	}
 	retval->fake_modes = modes;
 
-	return retval;
+	hand_out_resources(retval);
+	return &retval->res;
+}
+
+/*
+	The real Xinerama library, if configure found one. We only use it if no
+	output is split.
+*/
+static XineramaScreenInfo *(*_XineramaQueryScreens)(Display *dpy, int *number);
+
+static void load_real_xinerama() {
+#if !defined(NO_FAKE_XINERAMA) && defined(REAL_XINERAMA_LIB)
+	static void *xinerama_lib;
+	static Bool loaded;
+	_XLockMutex(_Xglobal_lock);
+	if(!loaded) {
+		loaded = True;
+		_XineramaQueryScreens = real_library_symbol(&xinerama_lib, REAL_XINERAMA_LIB, "XineramaQueryScreens");
+	}
+	_XUnlockMutex(_Xglobal_lock);
+#endif
 }
 
-static void _init() __attribute__((constructor));
-static void _init() {
-	void *xrandr_lib = dlopen(REAL_XRANDR_LIB, RTLD_LAZY | RTLD_LOCAL);
+/*
+	Event translation
+
+	A CRTC or output change of a split output is replaced by the same event for
+	the parent, reported hidden like XRRGetCrtcInfo and XRRGetOutputInfo do,
+	followed by one for each of its splits, with the fake XIDs and geometry.
+	The split table from before the change tells us how the parent was split.
 
-	/*
-		The following macro is defined by the skeleton header. It initializes
-		static variables called _XRRfn with references to the real XRRfn
-		functions.
-	*/
-	FUNCTION_POINTER_INITIALIZATIONS;
+	The converters run inside _XEnq(), which may itself run inside _XReply(),
+	so we must not call _XEnq() again. All events but the last are linked to
+	the queue by queue_event() instead, and the last one is converted into the
+	event _XEnq() appends once we return.
+*/
+static Bool queue_event(Display *dpy, struct DisplayState *state, xEvent *wire) {
+	int type = (wire->u.u.type & 0x7F) - state->event_base;
+	_XQEvent *qelt = dpy->qfree;
+	if(qelt) {
+		dpy->qfree = qelt->next;
+	}
+	else if(!(qelt = Xmalloc(sizeof(_XQEvent)))) {
+		return False;
+	}
+	qelt->next = NULL;
+	if(!state->wire_to_event[type](dpy, &qelt->event, wire)) {
+		qelt->next = dpy->qfree;
+		dpy->qfree = qelt;
+		return False;
+	}
+	qelt->qserial_num = dpy->next_event_serial_num++;
+	if(dpy->tail) {
+		dpy->tail->next = qelt;
+	}
+	else {
+		dpy->head = qelt;
+	}
+	dpy->tail = qelt;
+	dpy->qlen++;
+	return True;
+}
+static int find_splits(struct DisplayState *state, XID parent, Bool by_crtc, struct SplitInfo **splits) {
+	int i, n = 0;
+	*splits = NULL;
+	_XLockMutex(_Xglobal_lock);
+	for(i=0; i<state->nsplits; i++) {
+		if((by_crtc ? state->splits[i].parent_crtc : state->splits[i].parent) == parent) {
+			if(!*splits) {
+				*splits = Xmalloc((state->nsplits - i) * sizeof(struct SplitInfo));
+			}
+			(*splits)[n++] = state->splits[i];
+		}
+	}
+	_XUnlockMutex(_Xglobal_lock);
+	return n;
 }
 
 /*
-	Overridden library functions to add the fake output
+	Returns False if the CRTC is not split. Otherwise, queues the events for
+	the parent and all splits but the last, converts the last one into event
+	and stores the previous converter's verdict on it in result.
 */
+static Bool translate_crtc_change(Display *dpy, struct DisplayState *state, XEvent *event_out, xRRCrtcChangeNotifyEvent *wire, Bool *result) {
+	struct SplitInfo *splits;
+	int i, n = find_splits(state, wire->crtc, True, &splits);
+	if(n == 0) {
+		return False;
+	}
 
-XRRScreenResources *XRRGetScreenResources(Display *dpy, Window window) {
-	// Create a screen resources copy augmented with fake outputs & crtcs
-	XRRScreenResources *res = _XRRGetScreenResources(dpy, window);
-	struct FakeScreenResources *retval = augment_resources(dpy, res);
-	return (XRRScreenResources *)retval;
+	// The splits only persist if the parent kept its size
+	int x0 = splits[0].x, y0 = splits[0].y, x1 = x0 + splits[0].width, y1 = y0 + splits[0].height;
+	for(i=1; i<n; i++) {
+		x0 = splits[i].x < x0 ? splits[i].x : x0;
+		y0 = splits[i].y < y0 ? splits[i].y : y0;
+		x1 = splits[i].x + splits[i].width > x1 ? splits[i].x + splits[i].width : x1;
+		y1 = splits[i].y + splits[i].height > y1 ? splits[i].y + splits[i].height : y1;
+	}
+	Bool still_split = wire->mode != None && wire->width == x1 - x0 && wire->height == y1 - y0;
+
+	xRRCrtcChangeNotifyEvent event = *wire;
+	event.mode = None;
+	event.x = event.y = event.width = event.height = 0;
+	queue_event(dpy, state, (xEvent *)&event);
+	for(i=0; i<n; i++) {
+		event = *wire;
+		event.crtc = splits[i].crtc;
+		if(still_split) {
+			event.mode = splits[i].mode;
+			event.x = wire->x + splits[i].x - x0;
+			event.y = wire->y + splits[i].y - y0;
+			event.width = splits[i].width;
+			event.height = splits[i].height;
+		}
+		else {
+			event.mode = None;
+			event.x = event.y = event.width = event.height = 0;
+		}
+		if(i < n - 1) {
+			queue_event(dpy, state, (xEvent *)&event);
+		}
+	}
+	*result = state->wire_to_event[RRNotify](dpy, event_out, (xEvent *)&event);
+
+	Xfree(splits);
+	return True;
 }
 
-void XRRFreeScreenResources(XRRScreenResources *resources) {
-	struct FakeScreenResources *res = (void *)resources;
+// The same for output changes
+static Bool translate_output_change(Display *dpy, struct DisplayState *state, XEvent *event_out, xRROutputChangeNotifyEvent *wire, Bool *result) {
+	struct SplitInfo *splits;
+	int i, n = find_splits(state, wire->output, False, &splits);
+	if(n == 0) {
+		return False;
+	}
 
-	_XRRFreeScreenResources(res->parent_res);
-	free_list(res->fake_crtcs);
-	free_list(res->fake_outputs);
-	free_list(res->fake_modes);
-	Xfree(resources);
+	xRROutputChangeNotifyEvent event = *wire;
+	event.connection = RR_Disconnected;
+	queue_event(dpy, state, (xEvent *)&event);
+	for(i=0; i<n; i++) {
+		event = *wire;
+		event.output = splits[i].output;
+		// If the parent moved to another CRTC, the splits are gone
+		if(wire->crtc == splits[i].parent_crtc) {
+			event.crtc = splits[i].crtc;
+			event.mode = wire->mode != None ? splits[i].mode : None;
+		}
+		else {
+			event.crtc = event.mode = None;
+		}
+		if(i < n - 1) {
+			queue_event(dpy, state, (xEvent *)&event);
+		}
+	}
+	*result = state->wire_to_event[RRNotify](dpy, event_out, (xEvent *)&event);
+
+	Xfree(splits);
+	return True;
+}
+
+static Bool randr_wire_to_event(Display *dpy, XEvent *event, xEvent *wire) {
+	struct DisplayState *state = find_display_state(dpy);
+	int type = (wire->u.u.type & 0x7F) - state->event_base;
+
+	Window window = None;
+	int mask, sub_code = -1;
+	if(type == RRScreenChangeNotify) {
+		window = ((xRRScreenChangeNotifyEvent *)wire)->window;
+		state->config_timestamp = ((xRRScreenChangeNotifyEvent *)wire)->configTimestamp;
+		state->screen_changes++;
+		mask = RRScreenChangeNotifyMask;
+	}
+	else {
+		sub_code = ((xRRCrtcChangeNotifyEvent *)wire)->subCode;
+		if(sub_code == RRNotify_CrtcChange) {
+			window = ((xRRCrtcChangeNotifyEvent *)wire)->window;
+		}
+		else if(sub_code == RRNotify_OutputChange) {
+			window = ((xRROutputChangeNotifyEvent *)wire)->window;
+			if(state->config_timestamp != ((xRROutputChangeNotifyEvent *)wire)->configTimestamp) {
+				state->config_timestamp = ((xRROutputChangeNotifyEvent *)wire)->configTimestamp;
+				state->screen_changes++;
+			}
+		}
+		else if(sub_code == RRNotify_OutputProperty) {
+			window = ((xRROutputPropertyNotifyEvent *)wire)->window;
+		}
+		// The RRNotify sub codes are ordered like the selection mask bits
+		mask = 1 << (sub_code + 1);
+	}
+
+	if(mask & RROutputPropertyNotifyMask) {
+		state->property_changes++;
+	}
+	else if(mask & WATCHED_RANDR_EVENTS) {
+		state->changes++;
+	}
+	if(window != None && window == state->watch_window) {
+		return False;
+	}
+	Bool result;
+	if(sub_code == RRNotify_CrtcChange && translate_crtc_change(dpy, state, event, (xRRCrtcChangeNotifyEvent *)wire, &result)) {
+		return result;
+	}
+	if(sub_code == RRNotify_OutputChange && translate_output_change(dpy, state, event, (xRROutputChangeNotifyEvent *)wire, &result)) {
+		return result;
+	}
+	return state->wire_to_event[type](dpy, event, wire);
+}
+
+static int close_display(Display *dpy, XExtCodes *codes) {
+	struct DisplayState **state, *found = NULL;
+	_XLockMutex(_Xglobal_lock);
+	for(state = &display_states; *state; state = &(*state)->next) {
+		if((*state)->dpy == dpy) {
+			found = *state;
+			*state = found->next;
+			break;
+		}
+	}
+	_XUnlockMutex(_Xglobal_lock);
+
+	if(found) {
+		while(found->gamma) {
+			struct GammaCache *gamma = found->gamma;
+			found->gamma = gamma->next;
+			if(gamma->ramps) {
+				_XRRFreeGamma(gamma->ramps);
+			}
+			Xfree(gamma);
+		}
+		while(found->properties) {
+			struct PropertyCache *property = found->properties;
+			found->properties = property->next;
+			Xfree(property->data);
+			Xfree(property);
+		}
+		Xfree(found->screens);
+		Xfree(found->splits);
+		Xfree(found);
+	}
+	return 0;
+}
+
+// The real library registered RandR with the display, which saves us a query
+static int randr_major_opcode(Display *dpy) {
+	_XExtension *ext;
+	int major_opcode = 0;
+	LockDisplay(dpy);
+	for(ext = dpy->ext_procs; ext; ext = ext->next) {
+		if(ext->name && strcmp(ext->name, RANDR_NAME) == 0) {
+			major_opcode = ext->codes.major_opcode;
+			break;
+		}
+	}
+	UnlockDisplay(dpy);
+	return major_opcode;
+}
+
+static struct DisplayState *get_display_state(Display *dpy) {
+	struct DisplayState *state = find_display_state(dpy);
+	if(state) {
+		return state;
+	}
+
+	// This also makes the real library install its event converters, which we
+	// chain to below
+	int event_base, error_base;
+	if(!_XRRQueryExtension(dpy, &event_base, &error_base)) {
+		return NULL;
+	}
+
+	struct DisplayState *new_state = Xcalloc(1, sizeof(struct DisplayState));
+	new_state->dpy = dpy;
+	new_state->root = DefaultRootWindow(dpy);
+	new_state->event_base = event_base;
+	new_state->major_opcode = randr_major_opcode(dpy);
+	new_state->changes = 1;
+	new_state->layout_generation = 1;
+
+	_XLockMutex(_Xglobal_lock);
+	for(state = display_states; state && state->dpy != dpy; state = state->next);
+	if(!state) {
+		new_state->next = display_states;
+		display_states = new_state;
+	}
+	_XUnlockMutex(_Xglobal_lock);
+	if(state) {
+		// Another thread was quicker
+		Xfree(new_state);
+		return state;
+	}
+	state = new_state;
+
+	XExtCodes *codes = XAddExtension(dpy);
+	XESetCloseDisplay(dpy, codes->extension, close_display);
+
+	// Swap the converters while holding the lock, so that no event can be
+	// converted before we know the previous converters
+	LockDisplay(dpy);
+	state->wire_to_event[RRScreenChangeNotify] = dpy->event_vec[event_base + RRScreenChangeNotify];
+	state->wire_to_event[RRNotify] = dpy->event_vec[event_base + RRNotify];
+	dpy->event_vec[event_base + RRScreenChangeNotify] = randr_wire_to_event;
+	dpy->event_vec[event_base + RRNotify] = randr_wire_to_event;
+	UnlockDisplay(dpy);
+
+	return state;
+}
+
+static void watch_randr_events(Display *dpy, struct DisplayState *state) {
+	if(state->watch_window == None) {
+		// An InputOnly window is never drawn and needs no attributes. It goes
+		// away with the connection.
+		state->watch_window = XCreateWindow(dpy, state->root, -1, -1, 1, 1, 0, 0, InputOnly, CopyFromParent, 0, NULL);
+		_XRRSelectInput(dpy, state->watch_window, WATCHED_RANDR_EVENTS);
+	}
+}
+
+/*
+	Look up the state of a display, make sure we learn about RandR changes
+	and check the configuration file.
+*/
+static struct DisplayState *sync_display_state(Display *dpy) {
+	struct DisplayState *state = get_display_state(dpy);
+	if(!state) {
+		return NULL;
+	}
+	watch_randr_events(dpy, state);
+
+	open_configuration();
+	return state;
+}
+
+/*
+	The same without the configuration file, for answers which do not depend
+	on it. Once the watch window exists this is a lookup.
+*/
+static struct DisplayState *watched_display_state(Display *dpy) {
+	struct DisplayState *state = get_display_state(dpy);
+	if(state) {
+		watch_randr_events(dpy, state);
+	}
+	return state;
+}
+
+/*
+	Split table
+
+	The geometry, XIDs and names of all splits, taken from the fake outputs and
+	CRTCs of a layout. Monitors and event translation need these, and cache
+	them like the Xinerama screen table. It is rebuilt after RandR events,
+	so it asks for the current resources, which doesn't make the server probe
+	the outputs, and only interns names which are not in the previous table.
+*/
+static struct SplitInfo *query_splits(Display *dpy, struct DisplayState *state, int *number) {
+	*number = 0;
+	if(!may_split(dpy)) {
+		return NULL;
+	}
+
+	XRRScreenResources *resources = XRRGetScreenResourcesCurrent(dpy, state->root);
+	struct FakeScreenResources *res = fake_resources(resources);
+	int n = res ? list_length(res->fake_outputs) : 0;
+	struct SplitInfo *splits = NULL;
+	size_t names_size = 0;
+	struct FakeInfo *output, *crtc;
+	if(n > 0) {
+		for(output = res->fake_outputs; output; output = output->next) {
+			names_size += ((XRROutputInfo *)output->info)->nameLen + 1;
+		}
+		splits = Xmalloc(n * sizeof(struct SplitInfo) + names_size);
+	}
+	char **names = splits ? Xmalloc(n * sizeof(char *)) : NULL;
+	Atom *atoms = names ? Xmalloc(n * sizeof(Atom)) : NULL;
+	if(!atoms) {
+		Xfree(splits);
+		Xfree(names);
+		if(resources) {
+			XRRFreeScreenResources(resources);
+		}
+		return NULL;
+	}
+
+	// The fake output and CRTC of a split are created together, so the
+	// lists run in parallel
+	char *name = (char *)(splits + n);
+	int i, j, nnames = 0;
+	_XLockMutex(_Xglobal_lock);
+	for(output = res->fake_outputs, crtc = res->fake_crtcs, i = 0; i < n; output = output->next, crtc = crtc->next, i++) {
+		XRROutputInfo *output_info = output->info;
+		XRRCrtcInfo *crtc_info = crtc->info;
+		splits[i].parent = output->parent_xid;
+		splits[i].output = output->xid;
+		splits[i].parent_crtc = crtc->parent_xid;
+		splits[i].crtc = crtc->xid;
+		splits[i].mode = crtc_info->mode;
+		splits[i].x = crtc_info->x;
+		splits[i].y = crtc_info->y;
+		splits[i].width = crtc_info->width;
+		splits[i].height = crtc_info->height;
+		splits[i].mwidth = output_info->mm_width;
+		splits[i].mheight = output_info->mm_height;
+		splits[i].output_name = name;
+		memcpy(name, output_info->name, output_info->nameLen);
+		name[output_info->nameLen] = 0;
+		name += output_info->nameLen + 1;
+
+		splits[i].name = None;
+		for(j=0; j<state->nsplits; j++) {
+			if(strcmp(state->splits[j].output_name, splits[i].output_name) == 0) {
+				splits[i].name = state->splits[j].name;
+				break;
+			}
+		}
+		if(splits[i].name == None) {
+			names[nnames++] = splits[i].output_name;
+		}
+	}
+	_XUnlockMutex(_Xglobal_lock);
+
+	if(nnames) {
+		XInternAtoms(dpy, names, nnames, False, atoms);
+		for(i=0, j=0; i<n; i++) {
+			if(splits[i].name == None) {
+				splits[i].name = atoms[j++];
+			}
+		}
+	}
+	Xfree(names);
+	Xfree(atoms);
+	XRRFreeScreenResources(resources);
+
+	*number = n;
+	return splits;
+}
+
+static Bool same_splits(struct SplitInfo *a, int na, struct SplitInfo *b, int nb) {
+	int i;
+	if(na != nb) {
+		return False;
+	}
+	for(i=0; i<na; i++) {
+		if(memcmp(&a[i], &b[i], offsetof(struct SplitInfo, output_name)) || strcmp(a[i].output_name, b[i].output_name)) {
+			return False;
+		}
+	}
+	return True;
+}
+
+static struct DisplayState *update_splits(Display *dpy) {
+	struct DisplayState *state = sync_display_state(dpy);
+	if(!state) {
+		return NULL;
+	}
+
+	if(state->splits_changes != state->changes || state->splits_generation != config_generation) {
+		state->splits_changes = state->changes;
+		state->splits_generation = config_generation;
+
+		int nsplits;
+		struct SplitInfo *splits = query_splits(dpy, state, &nsplits);
+
+		_XLockMutex(_Xglobal_lock);
+		struct SplitInfo *old_splits = state->splits;
+		if(!same_splits(splits, nsplits, old_splits, state->nsplits)) {
+			state->layout_generation++;
+		}
+		state->splits = splits;
+		state->nsplits = nsplits;
+		_XUnlockMutex(_Xglobal_lock);
+		Xfree(old_splits);
+	}
+
+	return state;
+}
+
+/*
+	Public layout API, see fakexrandr-layout.h
+
+	Both functions answer from the split table, which is only queried again
+	after RandR reported a change or the configuration changed.
+*/
+int fakexrandr_get_layout(Display *dpy, struct FakexrandrMonitor **monitors, int *count) {
+	*monitors = NULL;
+	*count = 0;
+	struct DisplayState *state = update_splits(dpy);
+	if(!state) {
+		return 1;
+	}
+
+	_XLockMutex(_Xglobal_lock);
+	int i, n = state->nsplits;
+	size_t size = n * sizeof(struct FakexrandrMonitor);
+	for(i=0; i<n; i++) {
+		size += strlen(state->splits[i].output_name) + 1;
+	}
+	struct FakexrandrMonitor *retval = n ? malloc(size) : NULL;
+	char *name = (char *)(retval + n);
+	for(i=0; retval && i<n; i++) {
+		struct SplitInfo *split = &state->splits[i];
+		retval[i].name = name;
+		retval[i].output = split->output;
+		retval[i].parent = split->parent;
+		retval[i].x = split->x;
+		retval[i].y = split->y;
+		retval[i].width = split->width;
+		retval[i].height = split->height;
+		retval[i].mm_width = split->mwidth;
+		retval[i].mm_height = split->mheight;
+		strcpy(name, split->output_name);
+		name += strlen(name) + 1;
+	}
+	_XUnlockMutex(_Xglobal_lock);
+	if(n && !retval) {
+		return 1;
+	}
+
+	*monitors = retval;
+	*count = n;
+	return 0;
+}
+
+unsigned int fakexrandr_layout_generation(Display *dpy) {
+	struct DisplayState *state = update_splits(dpy);
+	return state ? state->layout_generation : 0;
+}
+
+/*
+	Overridden library functions to add the fake output
+*/
+
+XRRScreenResources *XRRGetScreenResources(Display *dpy, Window window) {
+	// Of the clients a hotplug wakes up, only the one holding the probe lease
+	// makes the server probe the outputs, see probe_lease_take(). The others
+	// ask for the current resources. Without a change since our previous
+	// request, the application gets its own probe.
+	struct DisplayState *state = find_display_state(dpy);
+	unsigned int changes = state ? state->screen_changes : 0;
+	Bool changed = state && changes != state->probed_changes;
+	char name[256];
+	int lease = changed && (!open_configuration() || may_split(dpy)) ? probe_lease_take(shared_display_name(dpy, name, sizeof(name))) : LEASE_NONE;
+	if(state) {
+		state->probed_changes = changes;
+	}
+	XRRScreenResources *res = lease == LEASE_BUSY ? _XRRGetScreenResourcesCurrent(dpy, window) : _XRRGetScreenResources(dpy, window);
+	lease_release(lease);
+
+	// Create a screen resources copy augmented with fake outputs & crtcs
+	return augment_resources(dpy, window, res);
+}
+
+void XRRFreeScreenResources(XRRScreenResources *resources) {
+	struct FakeScreenResources *res = take_back_resources(resources);
+	if(!res) {
+		_XRRFreeScreenResources(resources);
+		return;
+	}
+
+	_XRRFreeScreenResources(res->parent_res);
+	free_list(res->fake_crtcs);
+	free_list(res->fake_outputs);
+	free_list(res->fake_modes);
+	Xfree(resources);
 }
 
 XRRScreenResources *XRRGetScreenResourcesCurrent(Display *dpy, Window window) {
 	XRRScreenResources *res = _XRRGetScreenResourcesCurrent(dpy, window);
-	struct FakeScreenResources *retval = augment_resources(dpy, res);
-	return (XRRScreenResources *)retval;
+	return augment_resources(dpy, window, res);
 }
 
 XRROutputInfo *XRRGetOutputInfo(Display *dpy, XRRScreenResources *resources, RROutput output) {
-	struct FakeInfo *fake = xid_in_list(((struct FakeScreenResources *)resources)->fake_outputs, output);
-	if(fake && (output & XID_SPLIT_MASK)) {
+	struct FakeScreenResources *res = fake_resources(resources);
+	struct FakeInfo *fake = res ? xid_in_list(res->fake_outputs, output) : NULL;
+	if(fake && xid_is_split(output)) {
 		// We have to *clone* this here to mitigate issues due to the Gnome folks misusing the API, see
 		// gnome bugzilla #755934
 		XRROutputInfo *retval = Xmalloc(sizeof(XRROutputInfo));
@@ -392,7 +1689,7 @@ XRROutputInfo *XRRGetOutputInfo(Display *dpy, XRRScreenResources *resources, RRO
 		return retval;
 	}
 
-	XRROutputInfo *retval = _XRRGetOutputInfo(dpy, resources, output & ~XID_SPLIT_MASK);
+	XRROutputInfo *retval = _XRRGetOutputInfo(dpy, resources, xid_unsplit(output));
     if(fake)
         retval->connection=RR_Disconnected;
 	return retval;
@@ -404,8 +1701,9 @@ void XRRFreeOutputInfo(XRROutputInfo *outputInfo) {
 }
 
 XRRCrtcInfo *XRRGetCrtcInfo(Display *dpy, XRRScreenResources *resources, RRCrtc crtc) {
-	struct FakeInfo *fake = xid_in_list(((struct FakeScreenResources *)resources)->fake_crtcs, crtc);
-	if(fake && (crtc & XID_SPLIT_MASK)) {
+	struct FakeScreenResources *res = fake_resources(resources);
+	struct FakeInfo *fake = res ? xid_in_list(res->fake_crtcs, crtc) : NULL;
+	if(fake && xid_is_split(crtc)) {
 		// We have to *clone* this here to mitigate issues due to the Gnome folks misusing the API, see
 		// gnome bugzilla #755934
 		XRRCrtcInfo *retval = Xmalloc(sizeof(XRRCrtcInfo));
@@ -413,7 +1711,7 @@ XRRCrtcInfo *XRRGetCrtcInfo(Display *dpy, XRRScreenResources *resources, RRCrtc
 		return retval;
 	}
 
-	XRRCrtcInfo *retval = _XRRGetCrtcInfo(dpy, resources, crtc & ~XID_SPLIT_MASK);
+	XRRCrtcInfo *retval = _XRRGetCrtcInfo(dpy, resources, xid_unsplit(crtc));
     if(fake)
     {
         retval->mode=0;
@@ -428,12 +1726,12 @@ void XRRFreeCrtcInfo(XRRCrtcInfo *crtcInfo) {
 }
 
 int XRRSetCrtcConfig(Display *dpy, XRRScreenResources *resources, RRCrtc crtc, Time timestamp, int x, int y, RRMode mode, Rotation rotation, RROutput *outputs, int noutputs) {
-	if(crtc & XID_SPLIT_MASK) {
+	if(xid_is_split(crtc)) {
 		return 0;
 	}
 	int i;
 	for(i=0; i<noutputs; i++) {
-		if(outputs[i] & XID_SPLIT_MASK) {
+		if(xid_is_split(outputs[i])) {
 			return 0;
 		}
 	}
@@ -441,49 +1739,813 @@ int XRRSetCrtcConfig(Display *dpy, XRRScreenResources *resources, RRCrtc crtc, T
 	return _XRRSetCrtcConfig(dpy, resources, crtc, timestamp, x, y, mode, rotation, outputs, noutputs);
 }
 
+/*
+	Batch topology, see FakeXRRTopology in fakexrandr.h
+
+	Answers what XRRGetOutputInfo() and XRRGetCrtcInfo() would for every
+	output and CRTC of the resources. The requests for the real ones are sent
+	all at once, and the replies but the last are picked up by an async
+	handler, like Xlib's XGetWindowAttributes() does, so they cost a single
+	round trip.
+*/
+struct TopologyReplies {
+	unsigned long first;
+	unsigned long count;
+	char **wire;
+};
+
+static Bool topology_reply_handler(Display *dpy, xReply *rep, char *buf, int len, XPointer data) {
+	struct TopologyReplies *replies = (struct TopologyReplies *)data;
+	if(dpy->last_request_read < replies->first || dpy->last_request_read - replies->first >= replies->count) {
+		return False;
+	}
+	if(rep->generic.type == X_Error) {
+		// Reported as usual, the entry stays empty
+		return False;
+	}
+
+	char *wire = Xmalloc(sz_xReply + rep->generic.length * 4);
+	if(!wire) {
+		xReply discarded;
+		_XGetAsyncReply(dpy, (char *)&discarded, rep, buf, len, 0, True);
+		return True;
+	}
+	_XGetAsyncReply(dpy, wire, rep, buf, len, rep->generic.length, False);
+	replies->wire[dpy->last_request_read - replies->first] = wire;
+	return True;
+}
+
+static void topology_send_requests(Display *dpy, int major_opcode, XRRScreenResources *resources) {
+	xRRGetOutputInfoReq *output_req;
+	xRRGetCrtcInfoReq *crtc_req;
+	int i;
+	for(i=0; i<resources->noutput; i++) {
+		if(!xid_is_split(resources->outputs[i])) {
+			GetReq(RRGetOutputInfo, output_req);
+			output_req->reqType = major_opcode;
+			output_req->randrReqType = X_RRGetOutputInfo;
+			output_req->output = resources->outputs[i];
+			output_req->configTimestamp = resources->configTimestamp;
+		}
+	}
+	for(i=0; i<resources->ncrtc; i++) {
+		if(!xid_is_split(resources->crtcs[i])) {
+			GetReq(RRGetCrtcInfo, crtc_req);
+			crtc_req->reqType = major_opcode;
+			crtc_req->randrReqType = X_RRGetCrtcInfo;
+			crtc_req->crtc = resources->crtcs[i];
+			crtc_req->configTimestamp = resources->configTimestamp;
+		}
+	}
+}
+
+// Fetches the replies for the real outputs, then CRTCs, of the resources. Returns 0 on failure.
+static int topology_query(Display *dpy, XRRScreenResources *resources, char **wire, int count) {
+	struct DisplayState *state = get_display_state(dpy);
+	if(!state || !state->major_opcode) {
+		return 0;
+	}
+
+	LockDisplay(dpy);
+	topology_send_requests(dpy, state->major_opcode, resources);
+	struct TopologyReplies replies = { dpy->request - count + 1, count - 1, wire };
+	_XAsyncHandler async;
+	async.next = dpy->async_handlers;
+	async.handler = topology_reply_handler;
+	async.data = (XPointer)&replies;
+	dpy->async_handlers = &async;
+
+	xReply last;
+	int success = _XReply(dpy, &last, 0, xFalse);
+	if(success) {
+		wire[count - 1] = Xmalloc(sz_xReply + last.generic.length * 4);
+		if(wire[count - 1]) {
+			memcpy(wire[count - 1], &last, sz_xReply);
+			_XRead(dpy, wire[count - 1] + sz_xReply, last.generic.length * 4);
+		}
+		else {
+			_XEatDataWords(dpy, last.generic.length);
+		}
+	}
+	DeqAsyncHandler(dpy, &async);
+	UnlockDisplay(dpy);
+	SyncHandle();
+
+	int i;
+	for(i=0; i<count; i++) {
+		if(!wire[i]) {
+			success = 0;
+		}
+	}
+	return success;
+}
+
+static XID *topology_copy_ids(XID **ids, XID *src, int n) {
+	XID *retval = *ids;
+	memcpy(retval, src, n * sizeof(XID));
+	*ids += n;
+	return retval;
+}
+
+static char *topology_copy_name(char **chars, const char *src, int len) {
+	char *retval = *chars;
+	memcpy(retval, src, len);
+	retval[len] = 0;
+	*chars += len + 1;
+	return retval;
+}
+
+static FakeXRRTopology *get_topology(Display *dpy, XRRScreenResources *resources) {
+	struct FakeScreenResources *res = fake_resources(resources);
+	int i, k, count = 0;
+	for(i=0; i<resources->noutput; i++) {
+		count += !xid_is_split(resources->outputs[i]);
+	}
+	for(i=0; i<resources->ncrtc; i++) {
+		count += !xid_is_split(resources->crtcs[i]);
+	}
+
+	char **wire = Xcalloc(count ? count : 1, sizeof(char *));
+	XRROutputInfo **output_infos = Xcalloc(resources->noutput + 1, sizeof(XRROutputInfo *));
+	XRRCrtcInfo **crtc_infos = Xcalloc(resources->ncrtc + 1, sizeof(XRRCrtcInfo *));
+	FakeXRRTopology *retval = NULL;
+	if(!wire || !output_infos || !crtc_infos || (count && !topology_query(dpy, resources, wire, count))) {
+		goto out;
+	}
+
+	// Real ones from the replies, fake ones from the lists, in resource order
+	size_t ids = resources->ncrtc + resources->noutput;
+	size_t chars = 0;
+	for(i=0, k=0; i<resources->noutput; i++) {
+		struct FakeInfo *fake = res ? xid_in_list(res->fake_outputs, resources->outputs[i]) : NULL;
+		if(xid_is_split(resources->outputs[i])) {
+			output_infos[i] = fake ? fake->info : NULL;
+		}
+		else {
+			output_infos[i] = output_info_from_wire(wire[k], sz_xReply + ((xGenericReply *)wire[k])->length * 4);
+			k++;
+		}
+		if(!output_infos[i]) {
+			goto out;
+		}
+		ids += output_infos[i]->ncrtc + output_infos[i]->nclone + output_infos[i]->nmode;
+		chars += output_infos[i]->nameLen + 1;
+	}
+	for(i=0; i<resources->ncrtc; i++) {
+		struct FakeInfo *fake = res ? xid_in_list(res->fake_crtcs, resources->crtcs[i]) : NULL;
+		if(xid_is_split(resources->crtcs[i])) {
+			crtc_infos[i] = fake ? fake->info : NULL;
+		}
+		else {
+			crtc_infos[i] = crtc_info_from_wire(wire[k], sz_xReply + ((xGenericReply *)wire[k])->length * 4);
+			k++;
+		}
+		if(!crtc_infos[i]) {
+			goto out;
+		}
+		ids += crtc_infos[i]->noutput + crtc_infos[i]->npossible;
+	}
+	for(i=0; i<resources->nmode; i++) {
+		chars += resources->modes[i].nameLength + 1;
+	}
+
+	// The structures come first, such that the XIDs behind them are aligned
+	size_t size = sizeof(FakeXRRTopology) + sizeof(XRRScreenResources) +
+		resources->noutput * sizeof(XRROutputInfo) + resources->ncrtc * sizeof(XRRCrtcInfo) +
+		resources->nmode * sizeof(XRRModeInfo) + ids * sizeof(XID) + chars;
+	retval = Xmalloc(size);
+	if(!retval) {
+		goto out;
+	}
+	retval->resources = (XRRScreenResources *)(retval + 1);
+	retval->outputs = (XRROutputInfo *)(retval->resources + 1);
+	retval->crtcs = (XRRCrtcInfo *)(retval->outputs + resources->noutput);
+	XRRModeInfo *modes = (XRRModeInfo *)(retval->crtcs + resources->ncrtc);
+	XID *id = (XID *)(modes + resources->nmode);
+	char *name = (char *)(id + ids);
+
+	*retval->resources = *resources;
+	retval->resources->crtcs = topology_copy_ids(&id, resources->crtcs, resources->ncrtc);
+	retval->resources->outputs = topology_copy_ids(&id, resources->outputs, resources->noutput);
+	retval->resources->modes = modes;
+	for(i=0; i<resources->nmode; i++) {
+		modes[i] = resources->modes[i];
+		modes[i].name = topology_copy_name(&name, resources->modes[i].name, resources->modes[i].nameLength);
+	}
+
+	for(i=0; i<resources->noutput; i++) {
+		XRROutputInfo *info = &retval->outputs[i];
+		*info = *output_infos[i];
+		info->crtcs = topology_copy_ids(&id, output_infos[i]->crtcs, info->ncrtc);
+		info->clones = topology_copy_ids(&id, output_infos[i]->clones, info->nclone);
+		info->modes = topology_copy_ids(&id, output_infos[i]->modes, info->nmode);
+		info->name = topology_copy_name(&name, output_infos[i]->name, info->nameLen);
+		// Split outputs are reported disconnected, see XRRGetOutputInfo()
+		if(!xid_is_split(resources->outputs[i]) && res && xid_in_list(res->fake_outputs, resources->outputs[i])) {
+			info->connection = RR_Disconnected;
+		}
+	}
+
+	for(i=0; i<resources->ncrtc; i++) {
+		XRRCrtcInfo *info = &retval->crtcs[i];
+		*info = *crtc_infos[i];
+		info->outputs = topology_copy_ids(&id, crtc_infos[i]->outputs, info->noutput);
+		info->possible = topology_copy_ids(&id, crtc_infos[i]->possible, info->npossible);
+		// CRTCs of split outputs are reported without a mode, see XRRGetCrtcInfo()
+		if(!xid_is_split(resources->crtcs[i]) && res && xid_in_list(res->fake_crtcs, resources->crtcs[i])) {
+			info->mode = 0;
+			info->x = info->y = info->width = info->height = 0;
+		}
+	}
+
+out:
+	for(i=0; wire && i<count; i++) {
+		Xfree(wire[i]);
+	}
+	for(i=0; output_infos && i<resources->noutput; i++) {
+		if(!xid_is_split(resources->outputs[i])) {
+			Xfree(output_infos[i]);
+		}
+	}
+	for(i=0; crtc_infos && i<resources->ncrtc; i++) {
+		if(!xid_is_split(resources->crtcs[i])) {
+			Xfree(crtc_infos[i]);
+		}
+	}
+	Xfree(wire);
+	Xfree(output_infos);
+	Xfree(crtc_infos);
+	return retval;
+}
+
+/*
+	Takes the current screen resources, like XRRGetScreenResourcesCurrent(),
+	without asking the server to probe for new outputs
+*/
+FakeXRRTopology *FakeXRRGetTopology(Display *dpy, Window window) {
+	XRRScreenResources *resources = XRRGetScreenResourcesCurrent(dpy, window);
+	if(!resources) {
+		return NULL;
+	}
+	FakeXRRTopology *retval = get_topology(dpy, resources);
+	XRRFreeScreenResources(resources);
+	return retval;
+}
+
+void FakeXRRFreeTopology(FakeXRRTopology *topology) {
+	Xfree(topology);
+}
+
+/*
+	Gamma
+
+	Requests for the splits of a CRTC are deduplicated as described for struct
+	SiblingPass in fakexrandr.h. The cache is only touched under the global lock.
+*/
+static struct GammaCache *find_gamma_cache(struct DisplayState *state, RRCrtc parent) {
+	struct GammaCache *gamma;
+	for(gamma = state->gamma; gamma && gamma->parent != parent; gamma = gamma->next);
+	if(!gamma) {
+		gamma = Xcalloc(1, sizeof(struct GammaCache));
+		gamma->parent = parent;
+		gamma->next = state->gamma;
+		state->gamma = gamma;
+	}
+	return gamma;
+}
+
+static XRRCrtcGamma *copy_gamma(XRRCrtcGamma *gamma) {
+	XRRCrtcGamma *copy = _XRRAllocGamma(gamma->size);
+	if(copy) {
+		memcpy(copy->red, gamma->red, gamma->size * sizeof(unsigned short));
+		memcpy(copy->green, gamma->green, gamma->size * sizeof(unsigned short));
+		memcpy(copy->blue, gamma->blue, gamma->size * sizeof(unsigned short));
+	}
+	return copy;
+}
+
+static Bool same_gamma(XRRCrtcGamma *a, XRRCrtcGamma *b) {
+	return a->size == b->size &&
+		!memcmp(a->red, b->red, a->size * sizeof(unsigned short)) &&
+		!memcmp(a->green, b->green, a->size * sizeof(unsigned short)) &&
+		!memcmp(a->blue, b->blue, a->size * sizeof(unsigned short));
+}
+
+// Remember the ramps the parent has now, starting a pass at crtc
+static void store_gamma(struct DisplayState *state, RRCrtc crtc, XRRCrtcGamma *gamma) {
+	XRRCrtcGamma *copy = copy_gamma(gamma);
+	_XLockMutex(_Xglobal_lock);
+	struct GammaCache *cache = find_gamma_cache(state, xid_unsplit(crtc));
+	XRRCrtcGamma *old = cache->ramps;
+	cache->ramps = copy;
+	sibling_pass_start(&cache->ramps_pass, crtc);
+	_XUnlockMutex(_Xglobal_lock);
+	if(old) {
+		_XRRFreeGamma(old);
+	}
+}
+
+int XRRGetCrtcGammaSize(Display *dpy, RRCrtc crtc) {
+	struct DisplayState *state = get_display_state(dpy);
+	if(!state) {
+		return _XRRGetCrtcGammaSize(dpy, xid_unsplit(crtc));
+	}
+
+	int size = 0;
+	_XLockMutex(_Xglobal_lock);
+	struct GammaCache *cache = find_gamma_cache(state, xid_unsplit(crtc));
+	if(cache->size && sibling_pass_join(&cache->size_pass, crtc)) {
+		size = cache->size;
+	}
+	_XUnlockMutex(_Xglobal_lock);
+	if(size) {
+		return size;
+	}
+
+	size = _XRRGetCrtcGammaSize(dpy, xid_unsplit(crtc));
+	_XLockMutex(_Xglobal_lock);
+	cache->size = size;
+	sibling_pass_start(&cache->size_pass, crtc);
+	_XUnlockMutex(_Xglobal_lock);
+	return size;
+}
+
+XRRCrtcGamma *XRRGetCrtcGamma(Display *dpy, RRCrtc crtc) {
+	// The ramps are only cached for splits, see XRRSetCrtcGamma()
+	struct DisplayState *state = xid_is_split(crtc) ? get_display_state(dpy) : NULL;
+	if(!state) {
+		return _XRRGetCrtcGamma(dpy, xid_unsplit(crtc));
+	}
+
+	XRRCrtcGamma *gamma = NULL;
+	_XLockMutex(_Xglobal_lock);
+	struct GammaCache *cache = find_gamma_cache(state, xid_unsplit(crtc));
+	if(cache->ramps && sibling_pass_join(&cache->ramps_pass, crtc)) {
+		gamma = copy_gamma(cache->ramps);
+	}
+	_XUnlockMutex(_Xglobal_lock);
+	if(gamma) {
+		return gamma;
+	}
+
+	gamma = _XRRGetCrtcGamma(dpy, xid_unsplit(crtc));
+	if(gamma) {
+		store_gamma(state, crtc, gamma);
+	}
+	return gamma;
+}
+
+void XRRSetCrtcGamma(Display *dpy, RRCrtc crtc, XRRCrtcGamma *gamma) {
+	struct DisplayState *state = get_display_state(dpy);
+	if(!state) {
+		_XRRSetCrtcGamma(dpy, xid_unsplit(crtc), gamma);
+		return;
+	}
+
+	// Without siblings there is no write to skip, so only drop what we knew
+	if(!xid_is_split(crtc)) {
+		_XLockMutex(_Xglobal_lock);
+		struct GammaCache *cache = find_gamma_cache(state, crtc);
+		XRRCrtcGamma *old = cache->ramps;
+		cache->ramps = NULL;
+		_XUnlockMutex(_Xglobal_lock);
+		if(old) {
+			_XRRFreeGamma(old);
+		}
+		_XRRSetCrtcGamma(dpy, crtc, gamma);
+		return;
+	}
+
+	Bool skip = False;
+	_XLockMutex(_Xglobal_lock);
+	struct GammaCache *cache = find_gamma_cache(state, xid_unsplit(crtc));
+	if(cache->ramps && same_gamma(cache->ramps, gamma) && sibling_pass_join(&cache->ramps_pass, crtc)) {
+		skip = True;
+	}
+	_XUnlockMutex(_Xglobal_lock);
+	if(skip) {
+		return;
+	}
+
+	_XRRSetCrtcGamma(dpy, xid_unsplit(crtc), gamma);
+	store_gamma(state, crtc, gamma);
+}
+
+/*
+	Output properties
+
+	Requests for the splits of an output go to their parent, and are
+	deduplicated as described for struct SiblingPass in fakexrandr.h. Answers
+	are dropped on any RandR notification, and when this client changes a
+	property of the parent. They are those of the real outputs, so the
+	configuration file is not checked. The cache is only touched under the
+	global lock.
+*/
+static Bool same_property_request(struct PropertyCache *a, struct PropertyCache *b) {
+	return a->parent == b->parent && a->kind == b->kind && a->property == b->property && a->offset == b->offset &&
+		a->length == b->length && a->pending == b->pending && a->req_type == b->req_type;
+}
+
+/*
+	If the answer to the request is known, copy it to answer, with data in a
+	new allocation, and return True.
+*/
+static Bool lookup_property(struct DisplayState *state, RROutput output, struct PropertyCache *request, struct PropertyCache *answer) {
+	Bool found = False;
+	struct PropertyCache *cache;
+	_XLockMutex(_Xglobal_lock);
+	for(cache = state->properties; cache && !same_property_request(cache, request); cache = cache->next);
+	if(cache && cache->changes == state->changes && cache->property_changes == state->property_changes &&
+			sibling_pass_join(&cache->pass, output)) {
+		*answer = *cache;
+		answer->data = Xmalloc(cache->size);
+		memcpy(answer->data, cache->data, cache->size);
+		found = True;
+	}
+	_XUnlockMutex(_Xglobal_lock);
+	return found;
+}
+
+// Remember an answer, copying size bytes of its data, and start a pass at output
+static void store_property(struct DisplayState *state, RROutput output, struct PropertyCache *answer) {
+	void *data = Xmalloc(answer->size);
+	memcpy(data, answer->data, answer->size);
+
+	struct PropertyCache *cache;
+	_XLockMutex(_Xglobal_lock);
+	for(cache = state->properties; cache && !same_property_request(cache, answer); cache = cache->next);
+	if(!cache) {
+		cache = Xcalloc(1, sizeof(struct PropertyCache));
+		cache->next = state->properties;
+		state->properties = cache;
+	}
+	void *old = cache->data;
+	struct PropertyCache *next = cache->next;
+	*cache = *answer;
+	cache->next = next;
+	cache->data = data;
+	cache->changes = state->changes;
+	cache->property_changes = state->property_changes;
+	sibling_pass_start(&cache->pass, output);
+	_XUnlockMutex(_Xglobal_lock);
+	Xfree(old);
+}
+
+static void forget_properties(Display *dpy, RROutput output) {
+	struct DisplayState *state = find_display_state(dpy);
+	if(!state) {
+		return;
+	}
+	struct PropertyCache *cache;
+	_XLockMutex(_Xglobal_lock);
+	for(cache = state->properties; cache; cache = cache->next) {
+		if(cache->parent == xid_unsplit(output)) {
+			cache->changes = 0;
+		}
+	}
+	_XUnlockMutex(_Xglobal_lock);
+}
+
+Atom *XRRListOutputProperties(Display *dpy, RROutput output, int *nprop) {
+	struct PropertyCache request = { .parent = xid_unsplit(output), .kind = X_RRListOutputProperties };
+	struct DisplayState *state = watched_display_state(dpy);
+	if(state && lookup_property(state, output, &request, &request)) {
+		*nprop = request.count;
+		return request.data;
+	}
+
+	Atom *atoms = _XRRListOutputProperties(dpy, xid_unsplit(output), nprop);
+	if(state && atoms) {
+		request.data = atoms;
+		request.size = *nprop * sizeof(Atom);
+		request.count = *nprop;
+		store_property(state, output, &request);
+	}
+	return atoms;
+}
+
+XRRPropertyInfo *XRRQueryOutputProperty(Display *dpy, RROutput output, Atom property) {
+	struct PropertyCache request = { .parent = xid_unsplit(output), .kind = X_RRQueryOutputProperty, .property = property };
+	struct DisplayState *state = watched_display_state(dpy);
+	if(state && lookup_property(state, output, &request, &request)) {
+		// The values follow the structure in the same allocation
+		XRRPropertyInfo *info = request.data;
+		info->values = (long *)(info + 1);
+		return info;
+	}
+
+	XRRPropertyInfo *info = _XRRQueryOutputProperty(dpy, xid_unsplit(output), property);
+	if(state && info && info->values == (long *)(info + 1)) {
+		request.data = info;
+		request.size = sizeof(XRRPropertyInfo) + info->num_values * sizeof(long);
+		store_property(state, output, &request);
+	}
+	return info;
+}
+
+int XRRGetOutputProperty(Display *dpy, RROutput output, Atom property, long offset, long length, Bool _delete, Bool pending, Atom req_type,
+		Atom *actual_type, int *actual_format, unsigned long *nitems, unsigned long *bytes_after, unsigned char **prop) {
+	struct PropertyCache request = { .parent = xid_unsplit(output), .kind = X_RRGetOutputProperty, .property = property,
+		.offset = offset, .length = length, .pending = pending, .req_type = req_type };
+	struct DisplayState *state = _delete ? NULL : watched_display_state(dpy);
+	if(state && lookup_property(state, output, &request, &request)) {
+		*actual_type = request.actual_type;
+		*actual_format = request.actual_format;
+		*nitems = request.nitems;
+		*bytes_after = request.bytes_after;
+		*prop = request.data;
+		return Success;
+	}
+
+	int retval = _XRRGetOutputProperty(dpy, xid_unsplit(output), property, offset, length, _delete, pending, req_type,
+		actual_type, actual_format, nitems, bytes_after, prop);
+	if(_delete) {
+		forget_properties(dpy, output);
+	}
+	else if(state && retval == Success && *prop) {
+		// Like Xlib, format 32 data comes as longs, and there is a trailing zero byte
+		request.actual_type = *actual_type;
+		request.actual_format = *actual_format;
+		request.nitems = *nitems;
+		request.bytes_after = *bytes_after;
+		request.data = *prop;
+		request.size = *nitems * (*actual_format == 32 ? sizeof(long) : *actual_format / 8) + 1;
+		store_property(state, output, &request);
+	}
+	return retval;
+}
+
+void XRRChangeOutputProperty(Display *dpy, RROutput output, Atom property, Atom type, int format, int mode, _Xconst unsigned char *data, int nelements) {
+	_XRRChangeOutputProperty(dpy, xid_unsplit(output), property, type, format, mode, data, nelements);
+	forget_properties(dpy, output);
+}
+
+void XRRDeleteOutputProperty(Display *dpy, RROutput output, Atom property) {
+	_XRRDeleteOutputProperty(dpy, xid_unsplit(output), property);
+	forget_properties(dpy, output);
+}
+
+void XRRConfigureOutputProperty(Display *dpy, RROutput output, Atom property, Bool pending, Bool range, int num_values, long *values) {
+	_XRRConfigureOutputProperty(dpy, xid_unsplit(output), property, pending, range, num_values, values);
+	forget_properties(dpy, output);
+}
+
+void XRRSelectInput(Display *dpy, Window window, int mask) {
+	// Remember what the application selected on the root window. Our own
+	// notifications use another window, so its mask is passed on as is.
+	if(window == DefaultRootWindow(dpy)) {
+		struct DisplayState *state = get_display_state(dpy);
+		if(state) {
+			state->client_event_mask = mask;
+		}
+	}
+	_XRRSelectInput(dpy, window, mask);
+
+	// Event translation needs the split table before the first notification
+	if(mask & (RRCrtcChangeNotifyMask | RROutputChangeNotifyMask)) {
+		update_splits(dpy);
+	}
+}
+
+int XRRUpdateConfiguration(XEvent *event) {
+	int retval = _XRRUpdateConfiguration(event);
+
+	// Applications call this after each change. Refresh the split table for
+	// the translation of the next notifications while we may send requests.
+	struct DisplayState *state = find_display_state(event->xany.display);
+	if(state && (state->client_event_mask & (RRCrtcChangeNotifyMask | RROutputChangeNotifyMask))) {
+		update_splits(event->xany.display);
+	}
+	return retval;
+}
+
+/*
+	Monitors
+
+	Monitors which show a split output are replaced by one monitor per split,
+	named like the fake output.
+*/
+#if XRANDR_MAJOR > 1 || XRANDR_MINOR >= 5
+/*
+	Returns the index of the first split of the output the monitor shows, and
+	the number of its splits in count, or -1 if the monitor is not split. The
+	splits of one output are consecutive and must cover the monitor exactly.
+*/
+static int find_monitor_splits(struct DisplayState *state, XRRMonitorInfo *monitor, int *count) {
+	int first, last, i;
+	for(first = 0; first < state->nsplits; first = last) {
+		int x0 = state->splits[first].x, y0 = state->splits[first].y;
+		int x1 = x0 + state->splits[first].width, y1 = y0 + state->splits[first].height;
+		for(last = first; last < state->nsplits && state->splits[last].parent == state->splits[first].parent; last++) {
+			struct SplitInfo *split = &state->splits[last];
+			x0 = split->x < x0 ? split->x : x0;
+			y0 = split->y < y0 ? split->y : y0;
+			x1 = split->x + split->width > x1 ? split->x + split->width : x1;
+			y1 = split->y + split->height > y1 ? split->y + split->height : y1;
+		}
+
+		if(monitor->x != x0 || monitor->y != y0 || monitor->width != x1 - x0 || monitor->height != y1 - y0) {
+			continue;
+		}
+		for(i=0; i<monitor->noutput; i++) {
+			if(monitor->outputs[i] == state->splits[first].parent) {
+				*count = last - first;
+				return first;
+			}
+		}
+	}
+	return -1;
+}
+
+XRRMonitorInfo *XRRGetMonitors(Display *dpy, Window window, Bool get_active, int *nmonitors) {
+	XRRMonitorInfo *monitors = _XRRGetMonitors(dpy, window, get_active, nmonitors);
+	if(!monitors) {
+		return NULL;
+	}
+	struct DisplayState *state = update_splits(dpy);
+	if(!state || !state->nsplits) {
+		return monitors;
+	}
+
+	_XLockMutex(_Xglobal_lock);
+	int i, j, first, count, nresult = 0, noutput = 0;
+	for(i=0; i<*nmonitors; i++) {
+		if(find_monitor_splits(state, &monitors[i], &count) >= 0) {
+			nresult += count;
+			noutput += count;
+		}
+		else {
+			nresult++;
+			noutput += monitors[i].noutput;
+		}
+	}
+
+	// Like the real library, allocate everything in one block, such that
+	// freeing them with the real library still works
+	XRRMonitorInfo *result = Xmalloc(nresult * sizeof(XRRMonitorInfo) + noutput * sizeof(RROutput));
+	if(!result) {
+		_XUnlockMutex(_Xglobal_lock);
+		return monitors;
+	}
+	RROutput *outputs = (RROutput *)(result + nresult);
+	XRRMonitorInfo *next = result;
+	for(i=0; i<*nmonitors; i++) {
+		first = find_monitor_splits(state, &monitors[i], &count);
+		if(first < 0) {
+			*next = monitors[i];
+			next->outputs = outputs;
+			memcpy(outputs, monitors[i].outputs, monitors[i].noutput * sizeof(RROutput));
+			outputs += monitors[i].noutput;
+			next++;
+			continue;
+		}
+		for(j=first; j<first + count; j++) {
+			struct SplitInfo *split = &state->splits[j];
+			next->name = split->name;
+			next->primary = monitors[i].primary && j == first;
+			next->automatic = True;
+			next->noutput = 1;
+			next->x = split->x;
+			next->y = split->y;
+			next->width = split->width;
+			next->height = split->height;
+			next->mwidth = split->mwidth;
+			next->mheight = split->mheight;
+			next->outputs = outputs;
+			*outputs++ = split->output;
+			next++;
+		}
+	}
+	_XUnlockMutex(_Xglobal_lock);
+
+	_XRRFreeMonitors(monitors);
+	*nmonitors = nresult;
+	return result;
+}
+#endif
+
 /*
 	Fake Xinerama
 
-	This is little overhead with all the work we already did above..
+	This is little overhead with all the work we already did above.. If no
+	output is split, the screens are taken from the real Xinerama library
+	instead.
 */
 #ifndef NO_FAKE_XINERAMA
 Bool XineramaQueryExtension(Display *dpy, int *event_base, int *error_base) {
 	return xTrue;
 }
-Bool XineramaIsActive(Display *dpy) {
-	return xTrue;
-}
 Status XineramaQueryVersion(Display *dpy, int *major, int *minor) {
 	*major = 1;
 	*minor = 0;
 	return xTrue;
 }
 
-XineramaScreenInfo* XineramaQueryScreens(Display *dpy, int *number) {
-	XRRScreenResources *res = XRRGetScreenResources(dpy, XDefaultRootWindow(dpy));
+static XineramaScreenInfo *query_xinerama_screens(Display *dpy, struct DisplayState *state, int *number, Bool *active) {
+	XRRScreenResources *res = NULL;
+	load_real_xinerama();
+	if(may_split(dpy) && !(_XineramaQueryScreens && known_no_record(dpy, state->config_timestamp))) {
+		res = XRRGetScreenResources(dpy, state->root);
+		if(res) {
+			state->config_timestamp = res->configTimestamp;
+		}
+	}
+	if(_XineramaQueryScreens && !fake_resources(res)) {
+		// Nothing is split, so the real extension has the right answer and
+		// needs a single request for it. It only reports screens while it is
+		// active, which saves asking for that separately.
+		if(res) {
+			XRRFreeScreenResources(res);
+		}
+		XineramaScreenInfo *screens = _XineramaQueryScreens(dpy, number);
+		*active = *number > 0;
+		return screens;
+	}
+	if(!res) {
+		res = XRRGetScreenResources(dpy, state->root);
+	}
 
-	XineramaScreenInfo *retval = Xmalloc(res->noutput * sizeof(XineramaScreenInfo));
-	int i;
+	*active = True;
 	*number = 0;
-	for(i=0; i<res->noutput; i++) {
-		XRROutputInfo *output = XRRGetOutputInfo(dpy, res, res->outputs[i]);
-		if(output->crtc) {
-			XRRCrtcInfo *crtc = XRRGetCrtcInfo(dpy, res, output->crtc);
+	FakeXRRTopology *topology = get_topology(dpy, res);
+	XRRFreeScreenResources(res);
+	if(!topology) {
+		return NULL;
+	}
 
-			retval[*number].screen_number = *number;
-			retval[*number].x_org = crtc->x;
-			retval[*number].y_org = crtc->y;
-			retval[*number].width = crtc->width;
-			retval[*number].height = crtc->height;
-			(*number)++;
-			XRRFreeCrtcInfo(crtc);
+	XineramaScreenInfo *retval = Xmalloc(topology->resources->noutput * sizeof(XineramaScreenInfo));
+	int i, j;
+	for(i=0; retval && i<topology->resources->noutput; i++) {
+		XRROutputInfo *output = &topology->outputs[i];
+		for(j=0; output->crtc && j<topology->resources->ncrtc; j++) {
+			XRRCrtcInfo *crtc = &topology->crtcs[j];
+
+			// CRTCs of split outputs are reported without a mode
+			if(topology->resources->crtcs[j] == output->crtc && crtc->mode != None) {
+				retval[*number].screen_number = *number;
+				retval[*number].x_org = crtc->x;
+				retval[*number].y_org = crtc->y;
+				retval[*number].width = crtc->width;
+				retval[*number].height = crtc->height;
+				(*number)++;
+			}
 		}
+	}
+
+	FakeXRRFreeTopology(topology);
 
-		XRRFreeOutputInfo(output);
+	return retval;
+}
+
+static struct DisplayState *update_xinerama_screens(Display *dpy) {
+	struct DisplayState *state = sync_display_state(dpy);
+	if(!state) {
+		return NULL;
 	}
 
-	XRRFreeScreenResources(res);
+	if(state->screens_changes != state->changes || state->screens_generation != config_generation) {
+		// Remember the counter before querying, such that notifications
+		// arriving meanwhile invalidate the result again
+		state->screens_changes = state->changes;
+		state->screens_generation = config_generation;
+
+		int nscreens;
+		Bool active;
+		XineramaScreenInfo *screens = query_xinerama_screens(dpy, state, &nscreens, &active);
+
+		_XLockMutex(_Xglobal_lock);
+		XineramaScreenInfo *old_screens = state->screens;
+		state->screens = screens;
+		state->nscreens = screens ? nscreens : 0;
+		state->screens_active = active;
+		_XUnlockMutex(_Xglobal_lock);
+		Xfree(old_screens);
+	}
+
+	return state;
+}
+
+Bool XineramaIsActive(Display *dpy) {
+	struct DisplayState *state = update_xinerama_screens(dpy);
+	return state ? state->screens_active : xFalse;
+}
 
-    return retval;
+XineramaScreenInfo* XineramaQueryScreens(Display *dpy, int *number) {
+	struct DisplayState *state = update_xinerama_screens(dpy);
+	XineramaScreenInfo *retval = NULL;
+	*number = 0;
+	if(!state) {
+		return NULL;
+	}
+
+	_XLockMutex(_Xglobal_lock);
+	if(state->nscreens > 0) {
+		retval = Xmalloc(state->nscreens * sizeof(XineramaScreenInfo));
+		memcpy(retval, state->screens, state->nscreens * sizeof(XineramaScreenInfo));
+		*number = state->nscreens;
+	}
+	_XUnlockMutex(_Xglobal_lock);
+
+	return retval;
 }
 #endif
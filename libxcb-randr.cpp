@@ -17,16 +17,66 @@
 #include <xcb/randr.h>
 #include <xcb/xcb.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <string.h>
+#include <pthread.h>
 #include <algorithm>
+#include <atomic>
 #include <type_traits>
 
 #include "fakexrandr.h"
 
+#ifdef XCB_RANDR_GET_MONITORS
+/*
+    Monitors set by clients list their outputs after the structure, which
+    may include fake ones. The real function gets a copy with these replaced.
+*/
+template<>
+struct carries_xids<xcb_randr_monitor_info_t> : std::true_type {};
+
+template<>
+struct Unsplit<xcb_randr_monitor_info_t*>
+{
+    xcb_randr_monitor_info_t* monitor;
+    xcb_randr_monitor_info_t* copy;
+
+    Unsplit(xcb_randr_monitor_info_t* monitor)
+        : monitor(monitor), copy(nullptr)
+    {
+        if(!monitor)
+            return;
+        const auto size=sizeof(*monitor)+monitor->nOutput*sizeof(xcb_randr_output_t);
+        copy=static_cast<xcb_randr_monitor_info_t*>(unsplit_alloc(size));
+        memcpy(copy, monitor, size);
+        const auto outputs=reinterpret_cast<xcb_randr_output_t*>(copy+1);
+        for(int i=0; i<copy->nOutput; ++i)
+            outputs[i] = xid_unsplit(outputs[i]);
+    }
+    ~Unsplit() { free(copy); }
+    Unsplit(Unsplit const&) = delete;
+    xcb_randr_monitor_info_t* get() const { return copy ? copy : monitor; }
+};
+
+// The accessors only read the structure
+template<>
+struct Unsplit<const xcb_randr_monitor_info_t*>
+{
+    const xcb_randr_monitor_info_t* monitor;
+    Unsplit(const xcb_randr_monitor_info_t* monitor) : monitor(monitor) {}
+    const xcb_randr_monitor_info_t* get() const { return monitor; }
+};
+#endif
+
 extern "C"
 {
+static void* real_symbol(const char* name)
+{
+    static void* xrandr_lib;
+    return real_library_symbol(&xrandr_lib, REAL_XCB_RANDR_LIB, name);
+}
+
 /*
     The skeleton file is created by ./make_skeleton.py
 
@@ -49,12 +99,6 @@ T* newObj(Args&&...args)
     return p;
 }
 
-template<typename T>
-T* newArr(size_t size)
-{
-    return static_cast<T*>(malloc(size*sizeof(T)));
-}
-
 template<typename T>
 void deleteObj(T* p)
 {
@@ -74,28 +118,133 @@ int list_length(T* list)
     return i;
 }
 
-template<typename T>
-void free_list(T* list)
+/*
+    Bump allocator for the fake objects of one layout generation
+
+    Everything _config_foreach_split creates lives exactly as long as the
+    OutputBlock or FakeScreenResources it belongs to, so instead of allocating
+    and later freeing every object and each of its arrays separately, we carve
+    them all from one block and release that as a whole. The block is sized from an
+    estimate; should it still run out, a twice as large one is chained.
+*/
+class Arena
 {
-    while(list)
+    struct Block
     {
-        T* last = list;
-        list = list->nextInList;
-        deleteObj(last);
+        Block* next;
+        size_t size;
+        size_t used;
+    };
+    Block* blocks=nullptr;
+
+    static size_t alignUp(size_t n)
+    {
+        return (n + alignof(max_align_t)-1) & ~(alignof(max_align_t)-1);
     }
-}
+    void addBlock(size_t size)
+    {
+        const auto block=static_cast<Block*>(malloc(alignUp(sizeof(Block))+size));
+        block->next=blocks;
+        block->size=size;
+        block->used=0;
+        blocks=block;
+    }
+public:
+    explicit Arena(size_t initialSize)
+    {
+        addBlock(initialSize);
+    }
+    Arena(Arena const&)=delete;
+    Arena& operator=(Arena const&)=delete;
+    ~Arena()
+    {
+        while(blocks)
+        {
+            Block* last = blocks;
+            blocks = blocks->next;
+            free(last);
+        }
+    }
+    void* allocate(size_t size)
+    {
+        size=alignUp(size);
+        if(blocks->used+size > blocks->size)
+            addBlock(std::max(size, 2*blocks->size));
+        const auto p=reinterpret_cast<char*>(blocks)+alignUp(sizeof(Block))+blocks->used;
+        blocks->used+=size;
+        return p;
+    }
+    template<typename T, typename...Args>
+    T* newObj(Args&&...args)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "Arena never runs destructors");
+        return new (allocate(sizeof(T))) T(std::forward<Args>(args)...);
+    }
+    template<typename T>
+    T* newArr(size_t size)
+    {
+        return static_cast<T*>(allocate(size*sizeof(T)));
+    }
+};
+
+/*
+    Open-addressing hash map from XIDs to fake objects
 
+    It is filled once per layout generation, with its table in the arena of
+    that generation, and never modified afterwards. XID 0 (None) marks empty
+    slots. Inserting a key which is already present keeps the first value.
+*/
 template<typename T>
-bool xid_in_list(T* list, uint32_t xid)
+class XidMap
 {
-    while(list)
+    struct Slot
     {
-        if(list->xid == xid || list->parent_xid == xid)
-            return true;
-        list = list->nextInList;
+        uint32_t xid;
+        T* value;
+    };
+    Slot* slots=nullptr;
+    uint32_t mask=0;
+
+    static uint32_t hash(uint32_t xid)
+    {
+        // Multiplicative hashing; fake XIDs differ only in their high bits
+        return (xid * 2654435769u) ^ (xid >> 16);
     }
-    return false;
-}
+public:
+    void reserve(Arena& arena, unsigned entries)
+    {
+        unsigned size=8;
+        while(size < 2*entries)
+            size*=2;
+        slots=arena.newArr<Slot>(size);
+        memset(slots, 0, size*sizeof(Slot));
+        mask=size-1;
+    }
+    void insert(uint32_t xid, T* value)
+    {
+        for(uint32_t i=hash(xid)&mask; ; i=(i+1)&mask)
+        {
+            if(slots[i].xid==xid)
+                return;
+            if(slots[i].xid)
+                continue;
+            slots[i].xid=xid;
+            slots[i].value=value;
+            return;
+        }
+    }
+    T* find(uint32_t xid) const
+    {
+        if(!slots || !xid)
+            return nullptr;
+        for(uint32_t i=hash(xid)&mask; slots[i].xid; i=(i+1)&mask)
+        {
+            if(slots[i].xid==xid)
+                return slots[i].value;
+        }
+        return nullptr;
+    }
+};
 
 template<typename T>
 struct List
@@ -127,6 +276,21 @@ struct List
         }
     }
     template<typename Match>
+    void eraseIf(Match const& matches)
+    {
+        for(ListItem** curr=&first; *curr; )
+        {
+            if(!matches((*curr)->data))
+            {
+                curr=&(*curr)->nextInList;
+                continue;
+            }
+            const auto dead=*curr;
+            *curr=dead->nextInList;
+            deleteObj(dead);
+        }
+    }
+    template<typename Match>
     ListItem* find(Match const& matches)
     {
         for(ListItem* curr=first; curr; curr=curr->nextInList)
@@ -158,10 +322,23 @@ public:
     {
         pairs.erase(pair);
     }
+    template<typename Match>
+    void eraseIf(Match const& matches)
+    {
+        pairs.eraseIf([&](KeyValuePair const& p){return matches(p.key);});
+    }
 private:
     List<KeyValuePair> pairs;
 };
 
+// A request in flight, as key of the lists of requests whose reply we hook
+struct ConnectionCookie
+{
+    xcb_connection_t* c;
+    unsigned sequence;
+    bool operator==(ConnectionCookie const& other) const { return c==other.c && sequence==other.sequence; }
+};
+
 struct FakeCrtcInfo
 {
     FakeCrtcInfo* nextInList=nullptr;
@@ -208,15 +385,17 @@ struct FakeOutputInfo
     xcb_randr_mode_t* modes=nullptr;
     xcb_randr_output_t* clones=nullptr;
     uint8_t* name=nullptr;
+    // The position in the layout's fake_outputs, see intern_output_names()
+    int index=0;
 
-    FakeOutputInfo(const uint32_t xid, const uint32_t parent_xid, xcb_randr_get_output_info_reply_t const& origInfo,
+    FakeOutputInfo(Arena& arena, const uint32_t xid, const uint32_t parent_xid, xcb_randr_get_output_info_reply_t const& origInfo,
                    const uint16_t num_modes, const uint16_t num_clones,
                    const uint32_t mm_width, const uint32_t mm_height, const unsigned suffixIndex)
         : xid(xid)
         , parent_xid(parent_xid)
         , orig_output_info(origInfo)
-        , modes(newArr<xcb_randr_mode_t>(num_modes))
-        , clones(newArr<xcb_randr_output_t>(num_clones))
+        , modes(arena.newArr<xcb_randr_mode_t>(num_modes))
+        , clones(arena.newArr<xcb_randr_output_t>(num_clones))
     {
         orig_output_info.mm_width=mm_width;
         orig_output_info.mm_height=mm_height;
@@ -225,9 +404,12 @@ struct FakeOutputInfo
         orig_output_info.num_preferred=0;
         orig_output_info.num_clones=num_clones;
         const auto parentName=_xcb_randr_get_output_info_name(&origInfo); // not from our copy, because this function references variable-length fields
-        orig_output_info.name_len=snprintf(nullptr, 0, "%*s~%d", origInfo.name_len, parentName, suffixIndex);
-        name=static_cast<uint8_t*>(malloc(orig_output_info.name_len+1)); // newly-calculated length
-        snprintf(reinterpret_cast<char*>(name), orig_output_info.name_len+1, "%*s~%d", origInfo.name_len, parentName, suffixIndex);
+        char suffix[sizeof("~4294967295")];
+        const int suffixLen=snprintf(suffix, sizeof suffix, "~%u", suffixIndex);
+        orig_output_info.name_len=origInfo.name_len+suffixLen; // newly-calculated length
+        name=arena.newArr<uint8_t>(orig_output_info.name_len+1);
+        memcpy(name, parentName, origInfo.name_len);
+        memcpy(name+origInfo.name_len, suffix, suffixLen+1);
     }
     xcb_randr_get_output_info_reply_t* makeReturnValue() const
     {
@@ -244,66 +426,220 @@ struct FakeOutputInfo
         std::copy_n(name, orig_output_info.name_len, _xcb_randr_get_output_info_name(p));
         return p;
     }
-    ~FakeOutputInfo()
-    {
-        free(modes);
-        free(clones);
-    }
 };
 
 struct FakeModeInfo : xcb_randr_mode_info_t
 {
     FakeModeInfo* nextInList=nullptr;
     char* name;
+    // The mode of the parent CRTC
+    xcb_randr_mode_t base;
 
-    FakeModeInfo(const uint32_t xid, xcb_randr_mode_info_t const& baseMode,
+    FakeModeInfo(Arena& arena, const uint32_t xid, xcb_randr_mode_info_t const& baseMode,
                  const uint16_t width, const uint16_t height)
         : xcb_randr_mode_info_t(baseMode)
+        , base(baseMode.id)
     {
         id=xid;
         this->width = width;
         this->height = height;
-        name_len = snprintf(nullptr, 0, "%dx%d", width, height);
-        name=static_cast<char*>(malloc(name_len+1));
-        snprintf(name, name_len+1, "%dx%d", width, height);
+        char buffer[sizeof("65535x65535")];
+        name_len = snprintf(buffer, sizeof buffer, "%dx%d", width, height);
+        name=arena.newArr<char>(name_len+1);
+        memcpy(name, buffer, name_len+1);
     }
     void setModeInfo(xcb_randr_mode_info_t const& info)
     {
         static_cast<xcb_randr_mode_info_t&>(*this) = info;
     }
-    ~FakeModeInfo()
+};
+
+size_t resources_reply_size(xcb_randr_get_screen_resources_reply_t const* res)
+{
+    const auto end=_xcb_randr_get_screen_resources_names(res)+res->names_len;
+    return reinterpret_cast<const char*>(end)-reinterpret_cast<const char*>(res);
+}
+
+// Compares two replies from the given field on, i.e. ignoring the sequence number and timestamp
+template<typename Reply>
+bool same_reply_from(Reply const* a, Reply const* b, size_t offset)
+{
+    if(!a || !b)
+        return a==b;
+    // The length counts the 4-byte units after the first 32 bytes of a reply
+    const auto size=32+a->length*4;
+    return a->length==b->length &&
+           memcmp(reinterpret_cast<const char*>(a)+offset, reinterpret_cast<const char*>(b)+offset, size-offset)==0;
+}
+
+template<typename Reply>
+Reply* copy_reply(Reply const* reply)
+{
+    if(!reply)
+        return nullptr;
+    const auto size=32+reply->length*4;
+    const auto copy=static_cast<Reply*>(malloc(size));
+    memcpy(copy, reply, size);
+    return copy;
+}
+
+/*
+    The fake objects of one output
+
+    A layout is assembled from one block per output. Blocks remember the EDID,
+    configuration record, output info and CRTC info they were built from, and
+    are shared by all later layouts in which these are unchanged. This way a
+    change of one output only costs the EDID query and split expansion of that
+    one. Blocks of outputs which are not split hold no fake objects but save
+    the EDID query all the same.
+*/
+struct OutputBlock
+{
+    std::atomic<unsigned> refs{1};
+    Arena arena;
+
+    xcb_randr_output_t output;
+    xcb_randr_get_output_info_reply_t* output_info;
+    xcb_randr_get_crtc_info_reply_t* crtc_info;
+    char* edid=nullptr;
+    char* record=nullptr;
+    unsigned record_size=0;
+    // Whether the record came from fakexrandrd's layout property rather than the configuration
+    bool from_layout=false;
+
+    // Set when a notification reports a change of the output or its CRTC
+    std::atomic<bool> stale{false};
+
+    FakeCrtcInfo* fake_crtcs=nullptr;
+    FakeOutputInfo* fake_outputs=nullptr;
+    FakeModeInfo* fake_modes=nullptr;
+
+    // Takes ownership of the replies
+    OutputBlock(size_t arenaSize, xcb_randr_output_t output, xcb_randr_get_output_info_reply_t* outputInfo,
+                xcb_randr_get_crtc_info_reply_t* crtcInfo)
+        : arena(arenaSize)
+        , output(output)
+        , output_info(outputInfo)
+        , crtc_info(crtcInfo)
+    {
+    }
+    ~OutputBlock()
+    {
+        free(output_info);
+        free(crtc_info);
+    }
+    bool isBuiltFrom(xcb_randr_get_output_info_reply_t const* outputInfo, xcb_randr_get_crtc_info_reply_t const* crtcInfo) const
+    {
+        return !stale &&
+               same_reply_from(outputInfo, output_info, offsetof(xcb_randr_get_output_info_reply_t, crtc)) &&
+               same_reply_from(crtcInfo, crtc_info, offsetof(xcb_randr_get_crtc_info_reply_t, x));
+    }
+};
+
+// The atoms of the fake output names of a layout on one connection, in the order of its fake_outputs
+struct NameAtoms
+{
+    NameAtoms* nextInList=nullptr;
+    xcb_connection_t* c;
+    // The disconnect_serial when they were interned, see intern_output_names()
+    unsigned disconnects;
+    xcb_atom_t* atoms;
+
+    NameAtoms(xcb_connection_t* c, unsigned disconnects, xcb_atom_t* atoms)
+        : c(c)
+        , disconnects(disconnects)
+        , atoms(atoms)
     {
-        free(name);
     }
 };
 
 struct FakeScreenResources
 {
+    // Layouts are shared between the client's thread and the watcher thread,
+    // see acquire()/release()
+    std::atomic<unsigned> refs{1};
+
+    // Owns all the fake objects in the lists below
+    Arena arena;
+
+    // The reply we got from the real library. We take ownership of it.
     xcb_randr_get_screen_resources_reply_t* origRes;
-    FakeCrtcInfo* fake_crtcs;
-    FakeOutputInfo* fake_outputs;
-    FakeModeInfo* fake_modes;
-
-    FakeScreenResources(xcb_randr_get_screen_resources_reply_t const& originalResources,
-                        FakeCrtcInfo* fake_crtcs, FakeOutputInfo* fake_outputs, FakeModeInfo* fake_modes)
-        : fake_crtcs(fake_crtcs)
-        , fake_outputs(fake_outputs)
-        , fake_modes(fake_modes)
-    {
-        const auto begin=&originalResources;
-        const auto end=_xcb_randr_get_screen_resources_names(begin)+originalResources.names_len;
-        const auto size=reinterpret_cast<const char*>(end)-reinterpret_cast<const char*>(begin);
-        origRes=static_cast<xcb_randr_get_screen_resources_reply_t*>(malloc(size));
-        memcpy(origRes, &originalResources, size);
+    FakeCrtcInfo* fake_crtcs=nullptr;
+    FakeOutputInfo* fake_outputs=nullptr;
+    FakeModeInfo* fake_modes=nullptr;
+
+    // Both map fake XIDs to their object, and the XIDs of real CRTCs/outputs
+    // which were split to the first of their splits
+    XidMap<FakeCrtcInfo> crtcs_by_xid;
+    XidMap<FakeOutputInfo> outputs_by_xid;
+
+    // The augmented screen resources reply, built once by buildReply()
+    xcb_randr_get_screen_resources_reply_t* reply=nullptr;
+    size_t reply_size=0;
+
+    // The config_generation this layout was built from
+    unsigned generation=0;
+
+    // Taken from layout_serial when built, see fakexrandr_xcb_layout_generation()
+    unsigned serial=0;
+
+    // The blocks the fake objects above were copied from, one per output
+    OutputBlock** blocks=nullptr;
+    int num_blocks=0;
+
+    // The fake output names interned on each connection that asked for monitors
+    pthread_mutex_t atoms_mutex=PTHREAD_MUTEX_INITIALIZER;
+    NameAtoms* name_atoms=nullptr;
+
+    FakeScreenResources(xcb_randr_get_screen_resources_reply_t* originalResources, size_t arenaSize)
+        : arena(arenaSize)
+        , origRes(originalResources)
+    {
+    }
+    ~FakeScreenResources();
+    OutputBlock* findBlock(xcb_randr_output_t output) const
+    {
+        for(int i=0; i<num_blocks; ++i)
+        {
+            if(blocks[i] && blocks[i]->output==output)
+                return blocks[i];
+        }
+        return nullptr;
+    }
+    void buildXidMaps()
+    {
+        crtcs_by_xid.reserve(arena, 2*list_length(fake_crtcs));
+        for(auto* crtc=fake_crtcs; crtc; crtc=crtc->nextInList)
+        {
+            crtcs_by_xid.insert(crtc->xid, crtc);
+            crtcs_by_xid.insert(xid_unsplit(crtc->xid), crtc);
+        }
+        outputs_by_xid.reserve(arena, 2*list_length(fake_outputs));
+        int index=0;
+        for(auto* output=fake_outputs; output; output=output->nextInList)
+        {
+            output->index=index++;
+            outputs_by_xid.insert(output->xid, output);
+            outputs_by_xid.insert(output->parent_xid, output);
+        }
+    }
+    // Does this layout belong to the given (unmodified) screen resources reply?
+    bool isBuiltFrom(xcb_randr_get_screen_resources_reply_t const* res) const
+    {
+        // Skip the header, which contains the sequence number
+        const auto offset=offsetof(xcb_randr_get_screen_resources_reply_t, timestamp);
+        const auto size=resources_reply_size(res);
+        return size==resources_reply_size(origRes) &&
+               memcmp(reinterpret_cast<const char*>(res)+offset, reinterpret_cast<const char*>(origRes)+offset, size-offset)==0;
     }
-    ~FakeScreenResources()
+    xcb_randr_get_screen_resources_reply_t* makeReturnValue(uint16_t sequence) const
     {
-        free(origRes);
-        free_list(fake_crtcs);
-        free_list(fake_outputs);
-        free_list(fake_modes);
+        const auto p=static_cast<xcb_randr_get_screen_resources_reply_t*>(malloc(reply_size));
+        memcpy(p, reply, reply_size);
+        p->sequence=sequence;
+        return p;
     }
-    xcb_randr_get_screen_resources_reply_t* makeReturnValue()
+    void buildReply()
     {
         unsigned fakeNamesTotalLen=0;
         for(auto* mode=fake_modes; mode; mode=mode->nextInList)
@@ -319,7 +655,7 @@ struct FakeScreenResources
                         num_fake_outputs*sizeof(xcb_randr_output_t) +
                         num_fake_modes*sizeof(xcb_randr_mode_info_t);
         const auto size=reinterpret_cast<const char*>(end)-reinterpret_cast<const char*>(begin);
-        const auto p=static_cast<xcb_randr_get_screen_resources_reply_t*>(malloc(size));
+        const auto p=static_cast<xcb_randr_get_screen_resources_reply_t*>(arena.allocate(size));
         // Copy fixed-size part
         *p=*origRes;
 
@@ -362,13 +698,45 @@ struct FakeScreenResources
             strcat(reinterpret_cast<char*>(namesToFill), mode->name);
         p->names_len=strlen(reinterpret_cast<const char*>(namesToFill));
 
-        return p;
+        p->length=(size-sizeof(xcb_randr_get_screen_resources_reply_t)+3)/4;
+
+        reply=p;
+        reply_size=size;
     }
 };
 
+// Layouts and output blocks are reference counted
+template<typename T>
+T* acquire(T* res)
+{
+    if(res)
+        ++res->refs;
+    return res;
+}
+
+template<typename T>
+void release(T* res)
+{
+    if(res && --res->refs==0)
+        deleteObj(res);
+}
+
+FakeScreenResources::~FakeScreenResources()
+{
+    for(int i=0; i<num_blocks; ++i)
+        release(blocks[i]);
+    while(auto* names=name_atoms)
+    {
+        name_atoms=names->nextInList;
+        free(names->atoms);
+        deleteObj(names);
+    }
+    free(origRes);
+}
+
 uint32_t augmentXID(uint32_t xid, uint32_t n)
 {
-    return (xid & ~XID_SPLIT_MASK) | (n << XID_SPLIT_SHIFT);
+    return xid_split(xid, n);
 }
 
 /*
@@ -377,17 +745,44 @@ uint32_t augmentXID(uint32_t xid, uint32_t n)
     The configuration file format is documented in the management script. These
     functions load the configuration file and fill the FakeInfo lists with
     information on the fake outputs.
+
+    Splits of an output which have the same size share one fake mode;
+    output_modes is the list of the output's fake modes so far.
 */
 
-char* _config_foreach_split(char* config, unsigned int* n, unsigned int x, unsigned int y, unsigned int width, unsigned int height,
+xcb_randr_mode_t intern_fake_mode(Arena& arena, FakeModeInfo* output_modes, FakeModeInfo*** fake_modes, const uint32_t xid,
+                                  xcb_randr_get_screen_resources_reply_t* resources, xcb_randr_get_crtc_info_reply_t* crtc_info,
+                                  const uint16_t width, const uint16_t height)
+{
+    for(auto* mode=output_modes; mode; mode=mode->nextInList)
+    {
+        if(mode->base==crtc_info->mode && mode->width==width && mode->height==height)
+            return mode->id;
+    }
+
+    const auto resources_modes = _xcb_randr_get_screen_resources_modes(resources);
+    for(int i=0; i<resources->num_modes; i++)
+    {
+        if(resources_modes[i].id != crtc_info->mode)
+            continue;
+
+        **fake_modes = arena.newObj<FakeModeInfo>(arena, xid, resources_modes[i], width, height);
+        *fake_modes = &(**fake_modes)->nextInList;
+        **fake_modes = NULL;
+        break;
+    }
+    return xid;
+}
+
+char* _config_foreach_split(Arena& arena, char* config, unsigned int* n, unsigned int x, unsigned int y, unsigned int width, unsigned int height,
                             xcb_randr_get_screen_resources_reply_t* resources, xcb_randr_output_t output,
                             xcb_randr_get_output_info_reply_t* output_info, xcb_randr_get_crtc_info_reply_t* crtc_info,
-                            FakeCrtcInfo*** fake_crtcs, FakeOutputInfo*** fake_outputs, FakeModeInfo*** fake_modes)
+                            FakeCrtcInfo*** fake_crtcs, FakeOutputInfo*** fake_outputs, FakeModeInfo*** fake_modes, FakeModeInfo** output_modes)
 {
     if(config[0] == 'N')
     {
         // Define a new output info
-        **fake_outputs = newObj<FakeOutputInfo>(augmentXID(output, ++(*n)), output, *output_info,
+        **fake_outputs = arena.newObj<FakeOutputInfo>(arena, augmentXID(output, ++(*n)), output, *output_info,
                                                 1, output_info->num_clones,
                                                 output_info->mm_width * width / crtc_info->width,
                                                 output_info->mm_height * height / crtc_info->height, *n);
@@ -395,97 +790,101 @@ char* _config_foreach_split(char* config, unsigned int* n, unsigned int x, unsig
         xcb_randr_output_t*const output_clones = _xcb_randr_get_output_info_clones(output_info);
         for(int i=0; i<fake_output_info->orig_output_info.num_clones; i++)
             fake_output_info->clones[i] = augmentXID(output_clones[i], *n);
-        fake_output_info->orig_output_info.crtc = *fake_output_info->modes = augmentXID(output_info->crtc, *n);
+        fake_output_info->orig_output_info.crtc = augmentXID(output_info->crtc, *n);
+        *fake_output_info->modes = intern_fake_mode(arena, *output_modes, fake_modes, fake_output_info->orig_output_info.crtc,
+                                                    resources, crtc_info, width, height);
 
         *fake_outputs = &(**fake_outputs)->nextInList;
         **fake_outputs = NULL;
 
         // Define a new CRTC info
-        **fake_crtcs = newObj<FakeCrtcInfo>(augmentXID(output_info->crtc, *n), augmentXID(output, *n), *crtc_info,
+        **fake_crtcs = arena.newObj<FakeCrtcInfo>(augmentXID(output_info->crtc, *n), augmentXID(output, *n), *crtc_info,
                                             crtc_info->x + x, crtc_info->y + y, width, height, fake_output_info->modes[0]);
         *fake_crtcs = &(**fake_crtcs)->nextInList;
         **fake_crtcs = NULL;
 
-        // Define a new fake mode
-        const auto resources_modes = _xcb_randr_get_screen_resources_modes(resources);
-        for(int i=0; i<resources->num_modes; i++)
-        {
-            if(resources_modes[i].id != crtc_info->mode)
-                continue;
-
-            **fake_modes = newObj<FakeModeInfo>(augmentXID(output_info->crtc, *n), resources_modes[i], width, height);
-            *fake_modes = &(**fake_modes)->nextInList;
-            **fake_modes = NULL;
-            break;
-        }
-
         return config + 1;
     }
     unsigned int split_pos = *(unsigned int *)&config[1];
     if(config[0] == 'H')
     {
-        config = _config_foreach_split(config + 1 + 4, n, x, y, width, split_pos, resources, output, output_info, crtc_info,
-                                       fake_crtcs, fake_outputs, fake_modes);
-        return _config_foreach_split(config, n, x, y + split_pos, width, height - split_pos, resources, output, output_info, crtc_info,
-                                     fake_crtcs, fake_outputs, fake_modes);
+        config = _config_foreach_split(arena, config + 1 + 4, n, x, y, width, split_pos, resources, output, output_info, crtc_info,
+                                       fake_crtcs, fake_outputs, fake_modes, output_modes);
+        return _config_foreach_split(arena, config, n, x, y + split_pos, width, height - split_pos, resources, output, output_info, crtc_info,
+                                     fake_crtcs, fake_outputs, fake_modes, output_modes);
     }
     else
     {
         assert(config[0] == 'V');
 
-        config = _config_foreach_split(config + 1 + 4, n, x, y, split_pos, height, resources, output, output_info, crtc_info,
-                                       fake_crtcs, fake_outputs, fake_modes);
-        return _config_foreach_split(config, n, x + split_pos, y, width - split_pos, height, resources, output, output_info, crtc_info,
-                                     fake_crtcs, fake_outputs, fake_modes);
+        config = _config_foreach_split(arena, config + 1 + 4, n, x, y, split_pos, height, resources, output, output_info, crtc_info,
+                                       fake_crtcs, fake_outputs, fake_modes, output_modes);
+        return _config_foreach_split(arena, config, n, x + split_pos, y, width - split_pos, height, resources, output, output_info, crtc_info,
+                                     fake_crtcs, fake_outputs, fake_modes, output_modes);
     }
 }
 
-int config_handle_output(xcb_connection_t* c, xcb_randr_get_screen_resources_reply_t* resources, xcb_randr_output_t output, char* target_edid,
-                         FakeCrtcInfo*** fake_crtcs, FakeOutputInfo*** fake_outputs, FakeModeInfo*** fake_modes)
+// Size of the arena for the splits of a configuration record, see arena_size_estimate()
+size_t record_arena_size(char const* record)
+{
+    const auto count = *reinterpret_cast<unsigned const*>(&record[4 + 128 + 768 + 4 + 4]);
+    return count * (sizeof(FakeOutputInfo) + sizeof(FakeCrtcInfo) + sizeof(FakeModeInfo) + 256);
+}
+
+/*
+    Find the configuration record for an output with the given EDID whose
+    size matches that of its CRTC
+*/
+char* find_config_record(char const* target_edid, xcb_randr_get_crtc_info_reply_t const* crtc_info)
 {
+    if(!crtc_info)
+        return nullptr;
     for(char* config = config_file; (int)(config - config_file) <= (int)config_file_size; )
     {
         // Walk through the configuration file and search for the target_edid
         const auto size = *reinterpret_cast<unsigned*>(config);
-        const char*const name = &config[4];
         const char*const edid = &config[4 + 128];
         const auto width = *reinterpret_cast<unsigned*>(&config[4 + 128 + 768]);
         const auto height = *reinterpret_cast<unsigned*>(&config[4 + 128 + 768 + 4]);
-        const auto count = *reinterpret_cast<unsigned*>(&config[4 + 128 + 768 + 4 + 4]);
-
-        if(strncmp(edid, target_edid, 768) == 0)
-        {
-            xcb_randr_get_output_info_cookie_t output_info_cookie = _xcb_randr_get_output_info(c, output, resources->config_timestamp);
-            xcb_randr_get_output_info_reply_t* output_info = _xcb_randr_get_output_info_reply(c, output_info_cookie, NULL);
-            if(!output_info) return 0;
-
-            xcb_randr_get_crtc_info_cookie_t output_crtc_cookie = _xcb_randr_get_crtc_info(c, output_info->crtc, resources->config_timestamp);
-            xcb_randr_get_crtc_info_reply_t* output_crtc = _xcb_randr_get_crtc_info_reply(c, output_crtc_cookie, NULL);
-            if(!output_crtc) return 0;
-
-            if(output_crtc->width == (int)width && output_crtc->height == (int)height)
-            {
-                // If it is found and the size matches, add fake outputs/crtcs to the list
-                unsigned n = 0;
-                _config_foreach_split(config + 4 + 128 + 768 + 4 + 4 + 4, &n, 0, 0, width, height, resources,
-                                      output, output_info, output_crtc, fake_crtcs, fake_outputs, fake_modes);
-                return 1;
-            }
 
-            free(output_info);
-            free(output_crtc);
-        }
+        if(strncmp(edid, target_edid, 768) == 0 && crtc_info->width == (int)width && crtc_info->height == (int)height)
+            return config;
 
         config += 4 + size;
     }
 
-    return 0;
+    return nullptr;
+}
+
+// The same for the records fakexrandrd published for an output, see LAYOUT_PROPERTY
+char* find_layout_record(char* layout, size_t layout_size, xcb_randr_output_t output, xcb_randr_get_crtc_info_reply_t const* crtc_info)
+{
+    if(!crtc_info)
+        return nullptr;
+    for(char* record=nullptr; (record=layout_property_record(layout, layout_size, output, record)); )
+    {
+        const auto width = *reinterpret_cast<unsigned*>(&record[4 + 128 + 768]);
+        const auto height = *reinterpret_cast<unsigned*>(&record[4 + 128 + 768 + 4]);
+        if(crtc_info->width == (int)width && crtc_info->height == (int)height)
+            return record;
+    }
+    return nullptr;
 }
 
+/*
+    Build the block of an output, taking ownership of its info replies
+
+    If fakexrandrd published a layout, its record for the output is used and
+    no EDID is needed. Otherwise the EDID is queried unless given, i.e. known
+    from an earlier block of the same output.
+*/
+OutputBlock* build_output_block(xcb_connection_t* c, xcb_randr_get_screen_resources_reply_t* resources, xcb_randr_output_t output,
+                                xcb_randr_get_output_info_reply_t* output_info, xcb_randr_get_crtc_info_reply_t* crtc_info,
+                                char* layout, size_t layout_size, char const* known_edid);
 /*
     Helper function to return a hex-coded EDID string for a given output
 
-    edid must point to a sufficiently large (768 bytes) buffer.
+    edid must point to a buffer of EDID_BUFFER_SIZE bytes.
 */
 
 int get_output_edid(xcb_connection_t* c, xcb_randr_output_t output, char* edid)
@@ -494,12 +893,12 @@ int get_output_edid(xcb_connection_t* c, xcb_randr_output_t output, char* edid)
     xcb_intern_atom_reply_t* edid_atom = xcb_intern_atom_reply(c, edid_atom_cookie, NULL);
     if(!edid_atom) return 0;
 
-    xcb_randr_get_output_property_cookie_t edid_prop_cookie = _xcb_randr_get_output_property(c, output, edid_atom->atom, 0, 0, 384, 0, 0);
+    xcb_randr_get_output_property_cookie_t edid_prop_cookie = _xcb_randr_get_output_property(c, output, edid_atom->atom, 0, 0, EDID_MAX_BYTES / 4, 0, 0);
     xcb_randr_get_output_property_reply_t* edid_prop = _xcb_randr_get_output_property_reply(c, edid_prop_cookie, NULL);
     if(!edid_prop) return 0;
 
     // EDID property is 8 bits (format = 8), according to protocol spec, num_items and xcb's length methods work equally
-    const auto num_items = edid_prop->num_items;
+    const auto num_items = edid_prop->num_items < EDID_MAX_BYTES ? edid_prop->num_items : EDID_MAX_BYTES;
     if(num_items > 0)
     {
         uint8_t* prop = _xcb_randr_get_output_property_data(edid_prop);
@@ -518,7 +917,7 @@ int get_output_edid(xcb_connection_t* c, xcb_randr_output_t output, char* edid)
                 edid[2*i+1] += 'a' - '0' - 10;
             }
         }
-        edid[num_items*2] = 0; // (nms): overflow? what's going on with the edid buffer?
+        edid[num_items*2] = 0;
 
         free(edid_prop);
     }
@@ -529,167 +928,2066 @@ int get_output_edid(xcb_connection_t* c, xcb_randr_output_t output, char* edid)
     return num_items * 2;
 }
 
-FakeScreenResources* fakeScreenResources;
-void updateFakeResources(xcb_connection_t* c, xcb_randr_get_screen_resources_reply_t* res, bool current)
+OutputBlock* build_output_block(xcb_connection_t* c, xcb_randr_get_screen_resources_reply_t* resources, xcb_randr_output_t output,
+                                xcb_randr_get_output_info_reply_t* output_info, xcb_randr_get_crtc_info_reply_t* crtc_info,
+                                char* layout, size_t layout_size, char const* known_edid)
+{
+    char output_edid[EDID_BUFFER_SIZE];
+    if(layout)
+        output_edid[0] = 0;
+    else if(known_edid)
+        strcpy(output_edid, known_edid);
+    else if(get_output_edid(c, output, output_edid) <= 0)
+        output_edid[0] = 0;
+
+    char* record = layout ? find_layout_record(layout, layout_size, output, crtc_info) :
+                   output_edid[0] ? find_config_record(output_edid, crtc_info) : nullptr;
+    const auto block = newObj<OutputBlock>(record ? record_arena_size(record) + EDID_BUFFER_SIZE : EDID_BUFFER_SIZE, output, output_info, crtc_info);
+    block->from_layout = layout != nullptr;
+    block->edid = block->arena.newArr<char>(strlen(output_edid)+1);
+    strcpy(block->edid, output_edid);
+    if(record)
+    {
+        // If it is found and the size matches, add fake outputs/crtcs to the block
+        block->record_size = 4 + *reinterpret_cast<unsigned*>(record);
+        block->record = block->arena.newArr<char>(block->record_size);
+        memcpy(block->record, record, block->record_size);
+
+        FakeCrtcInfo** fake_crtcs_end = &block->fake_crtcs;
+        FakeOutputInfo** fake_outputs_end = &block->fake_outputs;
+        FakeModeInfo** fake_modes_end = &block->fake_modes;
+        unsigned n = 0;
+        const auto width = *reinterpret_cast<unsigned*>(&record[4 + 128 + 768]);
+        const auto height = *reinterpret_cast<unsigned*>(&record[4 + 128 + 768 + 4]);
+        _config_foreach_split(block->arena, record + 4 + 128 + 768 + 4 + 4 + 4, &n, 0, 0, width, height, resources,
+                              output, output_info, crtc_info, &fake_crtcs_end, &fake_outputs_end, &fake_modes_end, &block->fake_modes);
+    }
+    return block;
+}
+
+// Whether the configuration, or fakexrandrd's layout if given, still says the same about a block's output
+bool same_config_record(OutputBlock const* block, char* layout, size_t layout_size)
 {
-    FakeOutputInfo* fake_outputs = NULL;
-    FakeCrtcInfo* fake_crtcs = NULL;
-    FakeModeInfo* fake_modes = NULL;
+    char const* record;
+    if(layout)
+        record = find_layout_record(layout, layout_size, block->output, block->crtc_info);
+    else if(block->from_layout)
+        return false;
+    else if(!block->edid[0])
+        return true;
+    else
+        record = find_config_record(block->edid, block->crtc_info);
+    if(!record || !block->record)
+        return record == block->record;
+    return 4 + *reinterpret_cast<unsigned const*>(record) == block->record_size &&
+           memcmp(record, block->record, block->record_size) == 0;
+}
 
-    FakeOutputInfo** fake_outputs_end = &fake_outputs;
-    FakeCrtcInfo** fake_crtcs_end = &fake_crtcs;
-    FakeModeInfo** fake_modes_end = &fake_modes;
+/*
+    Estimate the arena space one layout generation needs
 
-    if(open_configuration())
+    The number of splits is bounded by the split counts of all configuration
+    records. The variable-length parts of a split (clones, names) live in the
+    output blocks; the layout only needs copies of the fixed-size objects, the
+    XID maps and the reply, for which a fixed allowance per split suffices.
+*/
+size_t arena_size_estimate()
+{
+    size_t splits = 0;
+    for(char* config = config_file; config + 4 + 128 + 768 + 4 + 4 + 4 <= config_file + config_file_size; )
     {
-        fakeScreenResources=nullptr;
-        return;
+        const auto size = *reinterpret_cast<unsigned*>(config);
+        splits += *reinterpret_cast<unsigned*>(&config[4 + 128 + 768 + 4 + 4]);
+        config += 4 + size;
     }
+    return splits * (sizeof(FakeOutputInfo) + sizeof(FakeCrtcInfo) + sizeof(FakeModeInfo) + 256) + 256;
+}
 
-    xcb_randr_get_screen_resources_current_reply_t*const resc=(xcb_randr_get_screen_resources_current_reply_t*)res;
-    xcb_randr_output_t*const res_outputs = current ? (xcb_randr_output_t*)_xcb_randr_get_screen_resources_current_outputs(resc)
-                                                   :                      _xcb_randr_get_screen_resources_outputs(res);
+// Serializes layout builds, which share the mapping of the configuration file
+pthread_mutex_t build_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+    The layout fakexrandrd published on the root window, see LAYOUT_PROPERTY in
+    fakexrandr.h. Its atom is looked up once per connection, so only a daemon
+    that was started before is seen. If the property is missing, we only ask
+    again once the configTimestamp changed. Guarded by build_mutex.
+*/
+struct LayoutLookup
+{
+    xcb_connection_t* c=nullptr;
+    xcb_atom_t atom=XCB_NONE;
+    bool missed=false;
+    xcb_timestamp_t missed_at=0;
+} layout_lookup;
 
-    for(int i=0; i < res->num_outputs; ++i)
+xcb_atom_t layout_atom(xcb_connection_t* c)
+{
+    if(layout_lookup.c!=c)
     {
-        char output_edid[768];
-        if(get_output_edid(c, res_outputs[i], output_edid) > 0)
-            config_handle_output(c, res, res_outputs[i], output_edid, &fake_crtcs_end, &fake_outputs_end, &fake_modes_end);
+        const auto reply=xcb_intern_atom_reply(c, xcb_intern_atom(c, 1, strlen(LAYOUT_PROPERTY), LAYOUT_PROPERTY), NULL);
+        layout_lookup=LayoutLookup();
+        layout_lookup.c=c;
+        layout_lookup.atom=reply ? reply->atom : XCB_NONE;
+        free(reply);
     }
-
-    fakeScreenResources = newObj<FakeScreenResources>(*res, fake_crtcs, fake_outputs, fake_modes);
+    return layout_lookup.atom;
 }
 
-void _init() __attribute__((constructor));
-void _init()
+// Whether a layout property may exist for a reply with the given timestamp
+bool may_have_layout(xcb_connection_t* c, xcb_timestamp_t config_timestamp)
 {
-    void* xrandr_lib = dlopen(REAL_XCB_RANDR_LIB, RTLD_LAZY | RTLD_LOCAL);
+    return layout_atom(c)!=XCB_NONE && !(layout_lookup.missed && layout_lookup.missed_at==config_timestamp);
+}
 
-    /*
-        The following macro is defined by the skeleton header. It initializes
-        static variables called _xcb_randr_ with references to the real
-        xcb_randr_ functions.
-        */
-    FUNCTION_POINTER_INITIALIZATIONS;
+// The root window of the screen of window, where fakexrandrd publishes the layout
+xcb_window_t window_root(xcb_connection_t* c, xcb_window_t window)
+{
+    for(auto iter=xcb_setup_roots_iterator(xcb_get_setup(c)); iter.rem; xcb_screen_next(&iter))
+    {
+        if(iter.data->root==window)
+            return window;
+    }
+    const auto geometry=window ? xcb_get_geometry_reply(c, xcb_get_geometry(c, window), NULL) : nullptr;
+    const auto root=geometry ? geometry->root : xcb_setup_roots_iterator(xcb_get_setup(c)).data->root;
+    free(geometry);
+    return root;
+}
 
-    const auto randr_id=dlsym(xrandr_lib, "xcb_randr_id");
-    memcpy(&xcb_randr_id, randr_id, sizeof xcb_randr_id);
+void forget_layout_lookup(xcb_connection_t* c)
+{
+    pthread_mutex_lock(&build_mutex);
+    if(layout_lookup.c==c)
+        layout_lookup.c=nullptr;
+    pthread_mutex_unlock(&build_mutex);
 }
 
-} // namespace
+// Bumped by every layout build and output property change we learn about; see PropertyCache
+std::atomic<unsigned> property_serial{1};
+
+// Bumped by every layout build, never 0
+std::atomic<unsigned> layout_serial{0};
+
+// The generation of the configuration file as it is now
+unsigned current_config_generation()
+{
+    pthread_mutex_lock(&build_mutex);
+    open_configuration();
+    const auto generation = config_generation;
+    pthread_mutex_unlock(&build_mutex);
+    return generation;
+}
 
 /*
-    Overridden library functions to add the fake output
+    Layout snapshots, see SnapshotHeader in fakexrandr.h
 */
-
-extern "C"
+uint32_t resources_fingerprint(xcb_randr_get_screen_resources_reply_t* res, xcb_randr_output_t const* outputs)
 {
-xcb_randr_get_screen_resources_current_reply_t* xcb_randr_get_screen_resources_current_reply(xcb_connection_t* c,
-                                                                                             xcb_randr_get_screen_resources_current_cookie_t cookie,
-                                                                                             xcb_generic_error_t** e)
+    uint32_t hash = 2166136261u;
+    for(int i=0; i<res->num_outputs; ++i)
+        hash = fingerprint_add(hash, outputs[i]);
+    const auto crtcs = _xcb_randr_get_screen_resources_crtcs(res);
+    for(int i=0; i<res->num_crtcs; ++i)
+        hash = fingerprint_add(hash, crtcs[i]);
+    const auto modes = _xcb_randr_get_screen_resources_modes(res);
+    for(int i=0; i<res->num_modes; ++i)
+        hash = fingerprint_add(hash, modes[i].id);
+    return hash;
+}
+
+// A copy of a reply stored in a snapshot, or NULL if it is malformed
+template<typename Reply>
+Reply* snapshot_reply(char const* data, uint32_t size)
 {
-    if(fakeScreenResources)
-        deleteObj(fakeScreenResources);
-    auto*const screen_resources = _xcb_randr_get_screen_resources_current_reply(c, cookie, e);
-    updateFakeResources(c, reinterpret_cast<xcb_randr_get_screen_resources_reply_t*>(screen_resources), true);
-    if(!fakeScreenResources) return screen_resources;
-    return reinterpret_cast<xcb_randr_get_screen_resources_current_reply_t*>(fakeScreenResources->makeReturnValue());
+    const auto reply = reinterpret_cast<Reply const*>(data);
+    if(size < sizeof(Reply) || 32 + 4 * reply->length != size)
+        return nullptr;
+    const auto copy = static_cast<Reply*>(malloc(size));
+    memcpy(copy, data, size);
+    return copy;
 }
-xcb_randr_get_screen_resources_reply_t* xcb_randr_get_screen_resources_reply(xcb_connection_t* c,
-                                                                             xcb_randr_get_screen_resources_cookie_t cookie,
-                                                                             xcb_generic_error_t** e)
+
+// Fill in the info replies and records of the outputs a snapshot lists. The others stay NULL, i.e. are not split.
+void read_snapshot(SnapshotHeader const* snapshot, size_t size, xcb_randr_output_t const* outputs, int num_outputs,
+                   xcb_randr_get_output_info_reply_t** output_infos, xcb_randr_get_crtc_info_reply_t** crtc_infos, char** records)
 {
-    if(fakeScreenResources)
-        deleteObj(fakeScreenResources);
-    auto*const screen_resources = _xcb_randr_get_screen_resources_reply(c, cookie, e);
-    updateFakeResources(c, screen_resources, false);
-    if(!fakeScreenResources) return screen_resources;
-    return fakeScreenResources->makeReturnValue();
+    std::fill_n(output_infos, num_outputs, nullptr);
+    std::fill_n(crtc_infos, num_outputs, nullptr);
+    std::fill_n(records, num_outputs, nullptr);
+    for(auto* entry=snapshot_next(snapshot, size, nullptr); entry; entry=snapshot_next(snapshot, size, entry))
+    {
+        const auto i = std::find(outputs, outputs+num_outputs, entry->output) - outputs;
+        if(i == num_outputs || output_infos[i])
+            continue;
+        const auto data = reinterpret_cast<char const*>(entry + 1);
+        output_infos[i] = snapshot_reply<xcb_randr_get_output_info_reply_t>(data, entry->output_info_size);
+        crtc_infos[i] = snapshot_reply<xcb_randr_get_crtc_info_reply_t>(data + entry->output_info_size, entry->crtc_info_size);
+        records[i] = config_file + entry->record_offset;
+        if(!output_infos[i] || !crtc_infos[i] || !output_infos[i]->crtc)
+        {
+            free(output_infos[i]);
+            free(crtc_infos[i]);
+            output_infos[i] = nullptr;
+            crtc_infos[i] = nullptr;
+        }
+    }
 }
 
-// --------------------- CRTC info ---------------------------
-static AssocList<decltype(xcb_randr_get_crtc_info_cookie_t::sequence), xcb_randr_crtc_t> crtc_info_cookies;
-xcb_randr_get_crtc_info_cookie_t xcb_randr_get_crtc_info(xcb_connection_t* c, xcb_randr_crtc_t crtc, xcb_timestamp_t config_timestamp)
+// The name of the display of c in the files shared with other clients, or NULL
+static const char* shared_display_name(xcb_connection_t* c, char* name, size_t size)
 {
-    const auto cookie = _xcb_randr_get_crtc_info(c,crtc & ~XID_SPLIT_MASK, config_timestamp);
-    crtc_info_cookies.insert(cookie.sequence,crtc);
-    return cookie;
+    return connection_display_name(xcb_get_file_descriptor(c), name, size) ? nullptr : name;
+}
+
+// Save which outputs of a layout built from the configuration are split, for other processes
+void save_snapshot(FakeScreenResources const* layout, uint32_t fingerprint, const char* display)
+{
+    SnapshotBuffer buffer;
+    snapshot_begin(&buffer, layout->origRes->timestamp, layout->origRes->config_timestamp, fingerprint);
+    for(int i=0; i<layout->num_blocks; ++i)
+    {
+        const auto block = layout->blocks[i];
+        if(!block)
+            buffer.failed = 1;
+        if(!block || !block->fake_outputs)
+            continue;
+        const auto output_info_size = 32 + 4 * block->output_info->length;
+        const auto crtc_info_size = 32 + 4 * block->crtc_info->length;
+        const auto entry = snapshot_append(&buffer, block->output, find_config_record(block->edid, block->crtc_info),
+                                           output_info_size, crtc_info_size);
+        if(!entry)
+            continue;
+        memcpy(entry + 1, block->output_info, output_info_size);
+        memcpy(reinterpret_cast<char*>(entry + 1) + output_info_size, block->crtc_info, crtc_info_size);
+    }
+    snapshot_save(&buffer, display);
+}
+
+/*
+    Build the fake layout for a screen resources reply
+
+    On success, the returned layout takes ownership of res, which was asked
+    for with window. Returns NULL if there is neither a configuration nor a
+    layout property, leaving res to the caller. The blocks of outputs which did not change since the previous
+    layout, if given, are shared with it. If another process left a snapshot
+    for the same reply, no requests are needed at all.
+*/
+FakeScreenResources* buildFakeResources(xcb_connection_t* c, xcb_randr_get_screen_resources_reply_t* res, bool current,
+                                        FakeScreenResources const* previous, xcb_window_t window)
+{
+    if(!xid_encoding_init(xcb_get_setup(c)->resource_id_mask))
+        return nullptr;
+    pthread_mutex_lock(&build_mutex);
+    const bool may_use_snapshot = !open_configuration() && !may_have_layout(c, res->config_timestamp);
+    pthread_mutex_unlock(&build_mutex);
+
+    xcb_randr_get_screen_resources_current_reply_t*const resc=(xcb_randr_get_screen_resources_current_reply_t*)res;
+    xcb_randr_output_t*const res_outputs = current ? (xcb_randr_output_t*)_xcb_randr_get_screen_resources_current_outputs(resc)
+                                                   :                      _xcb_randr_get_screen_resources_outputs(res);
+
+    // Another process may have resolved the same resources already
+    const auto fingerprint = resources_fingerprint(res, res_outputs);
+    char name[256];
+    const auto display = shared_display_name(c, name, sizeof name);
+    size_t snapshot_size = 0;
+    auto snapshot = may_use_snapshot ? open_snapshot(display, res->timestamp, res->config_timestamp, fingerprint, &snapshot_size) : nullptr;
+    // or is about to, see resolve_lease_take(). We wait for it without build_mutex, which our other connections need.
+    const auto lease = may_use_snapshot && !snapshot ? resolve_lease_take(display) : LEASE_NONE;
+    if(lease >= 0)
+        snapshot = open_snapshot(display, res->timestamp, res->config_timestamp, fingerprint, &snapshot_size);
+
+    pthread_mutex_lock(&build_mutex);
+    const bool have_config = !open_configuration();
+    const bool ask_layout = may_have_layout(c, res->config_timestamp);
+    // The configuration or the layout property may have changed meanwhile
+    if(snapshot && (!have_config || ask_layout))
+    {
+        close_snapshot(snapshot, snapshot_size);
+        snapshot = nullptr;
+    }
+    if(!have_config && !ask_layout)
+    {
+        pthread_mutex_unlock(&build_mutex);
+        lease_release(lease);
+        return nullptr;
+    }
+
+    // Otherwise fetch the layout property and output info, and then the CRTC info of all outputs in two round trips
+    xcb_get_property_cookie_t layout_cookie;
+    if(ask_layout)
+        layout_cookie = xcb_get_property(c, 0, window_root(c, window), layout_lookup.atom, XCB_GET_PROPERTY_TYPE_ANY, 0, 1 << 20);
+    const auto num_outputs = res->num_outputs;
+    const auto output_cookies = static_cast<xcb_randr_get_output_info_cookie_t*>(malloc(num_outputs * sizeof(xcb_randr_get_output_info_cookie_t)));
+    const auto output_infos = static_cast<xcb_randr_get_output_info_reply_t**>(malloc(num_outputs * sizeof(xcb_randr_get_output_info_reply_t*)));
+    const auto crtc_cookies = static_cast<xcb_randr_get_crtc_info_cookie_t*>(malloc(num_outputs * sizeof(xcb_randr_get_crtc_info_cookie_t)));
+    const auto crtc_infos = static_cast<xcb_randr_get_crtc_info_reply_t**>(malloc(num_outputs * sizeof(xcb_randr_get_crtc_info_reply_t*)));
+    const auto snapshot_records = snapshot ? static_cast<char**>(malloc(num_outputs * sizeof(char*))) : nullptr;
+
+    // With the timestamps of the previous layout, the server changed no output or CRTC since. The blocks no
+    // notification marked stale are reused as they are, and only the other outputs are asked about.
+    const bool unchanged = previous && !snapshot && previous->origRes->timestamp == res->timestamp &&
+                           previous->origRes->config_timestamp == res->config_timestamp;
+    const auto kept = static_cast<OutputBlock**>(calloc(num_outputs, sizeof(OutputBlock*)));
+    for(int i=0; unchanged && i < num_outputs; ++i)
+    {
+        const auto old = previous->findBlock(res_outputs[i]);
+        kept[i] = old && !old->stale ? old : nullptr;
+    }
+    for(int i=0; !snapshot && i < num_outputs; ++i)
+    {
+        if(!kept[i])
+            output_cookies[i] = _xcb_randr_get_output_info(c, res_outputs[i], res->config_timestamp);
+    }
+
+    // A layout fakexrandrd resolved for us takes precedence. It may not have caught up with a change yet.
+    xcb_get_property_reply_t* layout_reply = ask_layout ? xcb_get_property_reply(c, layout_cookie, NULL) : nullptr;
+    if(ask_layout)
+    {
+        layout_lookup.missed = !layout_reply || layout_reply->type == XCB_NONE;
+        layout_lookup.missed_at = res->config_timestamp;
+    }
+    char* layout_value = nullptr;
+    size_t layout_size = 0;
+    if(layout_reply && layout_reply->format == 8 &&
+       !layout_property_to_host(static_cast<char*>(xcb_get_property_value(layout_reply)), xcb_get_property_value_length(layout_reply)) &&
+       *static_cast<uint32_t*>(xcb_get_property_value(layout_reply)) == res->config_timestamp)
+    {
+        layout_value = static_cast<char*>(xcb_get_property_value(layout_reply));
+        layout_size = xcb_get_property_value_length(layout_reply);
+    }
+    if(!layout_value && !have_config)
+    {
+        for(int i=0; !snapshot && i < num_outputs; ++i)
+        {
+            if(!kept[i])
+                xcb_discard_reply(c, output_cookies[i].sequence);
+        }
+        free(kept);
+        free(output_cookies);
+        free(output_infos);
+        free(crtc_cookies);
+        free(crtc_infos);
+        free(layout_reply);
+        pthread_mutex_unlock(&build_mutex);
+        lease_release(lease);
+        return nullptr;
+    }
+
+    const auto layout = newObj<FakeScreenResources>(res, arena_size_estimate() + res->num_outputs * sizeof(OutputBlock*));
+    layout->generation = config_generation;
+    layout->serial = ++layout_serial;
+    ++property_serial;
+    auto& arena = layout->arena;
+    FakeOutputInfo** fake_outputs_end = &layout->fake_outputs;
+    FakeCrtcInfo** fake_crtcs_end = &layout->fake_crtcs;
+    FakeModeInfo** fake_modes_end = &layout->fake_modes;
+
+    if(snapshot)
+        read_snapshot(snapshot, snapshot_size, res_outputs, num_outputs, output_infos, crtc_infos, snapshot_records);
+    else
+    {
+        for(int i=0; i < num_outputs; ++i)
+        {
+            if(kept[i])
+            {
+                // Copies, which are compared and freed like fresh replies below
+                output_infos[i] = copy_reply(kept[i]->output_info);
+                crtc_infos[i] = copy_reply(kept[i]->crtc_info);
+                continue;
+            }
+            output_infos[i] = _xcb_randr_get_output_info_reply(c, output_cookies[i], NULL);
+            if(output_infos[i] && output_infos[i]->crtc)
+                crtc_cookies[i] = _xcb_randr_get_crtc_info(c, output_infos[i]->crtc, res->config_timestamp);
+        }
+        for(int i=0; i < num_outputs; ++i)
+        {
+            if(!kept[i])
+                crtc_infos[i] = output_infos[i] && output_infos[i]->crtc ? _xcb_randr_get_crtc_info_reply(c, crtc_cookies[i], NULL) : nullptr;
+        }
+    }
+
+    layout->blocks = arena.newArr<OutputBlock*>(num_outputs);
+    layout->num_blocks = num_outputs;
+    const auto shared = layout_value ? nullptr : open_shared_layout(display);
+    for(int i=0; i < num_outputs; ++i)
+    {
+        const auto output_info = output_infos[i];
+        const auto crtc_info = crtc_infos[i];
+        OutputBlock* block = nullptr;
+        if(output_info)
+        {
+            const auto old = previous ? previous->findBlock(res_outputs[i]) : nullptr;
+            if(old && old->isBuiltFrom(output_info, crtc_info) && same_config_record(old, layout_value, layout_size))
+            {
+                block = acquire(old);
+                free(output_info);
+                free(crtc_info);
+            }
+            else
+            {
+                // If only the CRTC changed, the monitor and thus the EDID is the same. Otherwise the record in a
+                // snapshot has it, or fakexrandrd, if it runs, may know it.
+                const bool same_monitor = old && !old->from_layout && !old->stale &&
+                                          same_reply_from(output_info, old->output_info, offsetof(xcb_randr_get_output_info_reply_t, crtc));
+                char shared_edid[EDID_BUFFER_SIZE];
+                const char* known_edid = same_monitor ? old->edid : nullptr;
+                if(!known_edid && snapshot_records)
+                {
+                    memcpy(shared_edid, snapshot_records[i] + 4 + 128, 2 * EDID_MAX_BYTES);
+                    shared_edid[2 * EDID_MAX_BYTES] = 0;
+                    known_edid = shared_edid;
+                }
+                else if(!known_edid && shared_output_edid(shared, res->config_timestamp, res_outputs[i], shared_edid) >= 0)
+                    known_edid = shared_edid;
+                block = build_output_block(c, res, res_outputs[i], output_info, crtc_info, layout_value, layout_size, known_edid);
+            }
+        }
+        layout->blocks[i] = block;
+        if(!block)
+            continue;
+
+        // The layout links copies of the fixed-size objects in its own lists
+        for(auto* crtc=block->fake_crtcs; crtc; crtc=crtc->nextInList)
+        {
+            *fake_crtcs_end = arena.newObj<FakeCrtcInfo>(*crtc);
+            fake_crtcs_end = &(*fake_crtcs_end)->nextInList;
+        }
+        for(auto* output=block->fake_outputs; output; output=output->nextInList)
+        {
+            *fake_outputs_end = arena.newObj<FakeOutputInfo>(*output);
+            fake_outputs_end = &(*fake_outputs_end)->nextInList;
+        }
+        for(auto* mode=block->fake_modes; mode; mode=mode->nextInList)
+        {
+            *fake_modes_end = arena.newObj<FakeModeInfo>(*mode);
+            fake_modes_end = &(*fake_modes_end)->nextInList;
+        }
+        *fake_crtcs_end = NULL;
+        *fake_outputs_end = NULL;
+        *fake_modes_end = NULL;
+    }
+    free(kept);
+    free(output_cookies);
+    free(output_infos);
+    free(crtc_cookies);
+    free(crtc_infos);
+    free(snapshot_records);
+    free(layout_reply);
+    close_shared_layout(shared);
+
+    layout->buildXidMaps();
+    layout->buildReply();
+    if(snapshot)
+        close_snapshot(snapshot, snapshot_size);
+    else if(!layout_value)
+        save_snapshot(layout, fingerprint, display);
+    pthread_mutex_unlock(&build_mutex);
+    lease_release(lease);
+    return layout;
+}
+
+// Make the next layout rebuild the block of an output or CRTC reported changed
+void mark_stale(FakeScreenResources const* layout, uint32_t xid)
+{
+    for(int i=0; layout && i<layout->num_blocks; ++i)
+    {
+        const auto block=layout->blocks[i];
+        if(block && (block->output==xid || (block->output_info->crtc && block->output_info->crtc==xid)))
+            block->stale=true;
+    }
+}
+
+/*
+    The latest configTimestamp any screen resources reply or RandR
+    notification reported. A layout built for another one is out of date,
+    whether or not it splits anything.
+*/
+std::atomic<uint32_t> latest_config_timestamp{0};
+
+/*
+    Counts the screen change notifications and new configTimestamps we saw,
+    and the count at the last screen resources request. Only requests after
+    a change are coalesced with other processes, see leased_resources_request().
+*/
+std::atomic<unsigned> screen_changes{0};
+std::atomic<unsigned> probed_changes{0};
+
+/*
+    Optional background watcher
+
+    With FAKEXRANDR_WATCHER=1 in the environment, the first screen resources
+    reply starts a thread with a private connection to $DISPLAY. It subscribes
+    to RandR notify events on the root window and rebuilds the layout after
+    each burst of them, so that a hotplug is not paid for on the client's
+    thread. The reply hooks only need to check whether the published layout
+    was built from the same reply they received, and copy its prebuilt reply.
+*/
+pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+FakeScreenResources* snapshot;
+
+void publish_snapshot(FakeScreenResources* res)
+{
+    pthread_mutex_lock(&snapshot_mutex);
+    const auto old = snapshot;
+    snapshot = res;
+    pthread_mutex_unlock(&snapshot_mutex);
+    release(old);
+}
+
+FakeScreenResources* acquire_snapshot()
+{
+    pthread_mutex_lock(&snapshot_mutex);
+    const auto res = acquire(snapshot);
+    pthread_mutex_unlock(&snapshot_mutex);
+    return res;
+}
+
+void* watcher_main(void*)
+{
+    int screen_num;
+    xcb_connection_t* c = xcb_connect(NULL, &screen_num);
+    if(xcb_connection_has_error(c))
+    {
+        xcb_disconnect(c);
+        return NULL;
+    }
+    xcb_screen_iterator_t iter = xcb_setup_roots_iterator(xcb_get_setup(c));
+    for(; iter.rem && screen_num; --screen_num)
+        xcb_screen_next(&iter);
+    const xcb_window_t root = iter.data->root;
+
+    _xcb_randr_select_input(c, root, XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE |
+                                     XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE |
+                                     XCB_RANDR_NOTIFY_MASK_OUTPUT_CHANGE);
+    const auto notify_type = xcb_get_extension_data(c, &xcb_randr_id)->first_event + XCB_RANDR_NOTIFY;
+    FakeScreenResources* layout = nullptr;
+    for(;;)
+    {
+        const auto cookie = _xcb_randr_get_screen_resources_current(c, root);
+        const auto res = reinterpret_cast<xcb_randr_get_screen_resources_reply_t*>(_xcb_randr_get_screen_resources_current_reply(c, cookie, NULL));
+        if(!res)
+            break;
+        latest_config_timestamp = res->config_timestamp;
+        const auto previous = layout;
+        layout = buildFakeResources(c, res, true, previous, root);
+        release(previous);
+        if(!layout)
+            free(res);
+        publish_snapshot(acquire(layout));
+
+        // We selected nothing but RandR events. Wait for one, then coalesce the burst.
+        xcb_generic_event_t* event = xcb_wait_for_event(c);
+        if(!event)
+            break;
+        do
+        {
+            // Only the outputs the burst is about need to be rebuilt
+            if(layout && (event->response_type & 0x7f) == notify_type)
+            {
+                const auto notify = reinterpret_cast<xcb_randr_notify_event_t*>(event);
+                if(notify->subCode == XCB_RANDR_NOTIFY_CRTC_CHANGE)
+                    mark_stale(layout, notify->u.cc.crtc);
+                else if(notify->subCode == XCB_RANDR_NOTIFY_OUTPUT_CHANGE)
+                    mark_stale(layout, notify->u.oc.output);
+            }
+            free(event);
+        }
+        while((event = xcb_poll_for_event(c)));
+    }
+    release(layout);
+
+    publish_snapshot(NULL);
+    xcb_disconnect(c);
+    return NULL;
+}
+
+void start_watcher()
+{
+    const char* enabled = getenv("FAKEXRANDR_WATCHER");
+    if(!enabled || strcmp(enabled, "1"))
+        return;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&thread, &attr, watcher_main, NULL);
+    pthread_attr_destroy(&attr);
+}
+
+/*
+    The current layout, the one the last screen resources reply belongs to.
+    The reply hooks of all threads look at it, so it is only swapped and
+    acquired under current_mutex, like the watcher's snapshot.
+*/
+pthread_mutex_t current_mutex = PTHREAD_MUTEX_INITIALIZER;
+FakeScreenResources* fakeScreenResources;
+
+void publish_current(FakeScreenResources* res)
+{
+    pthread_mutex_lock(&current_mutex);
+    const auto old = fakeScreenResources;
+    fakeScreenResources = res;
+    pthread_mutex_unlock(&current_mutex);
+    release(old);
+}
+
+FakeScreenResources* acquire_current()
+{
+    pthread_mutex_lock(&current_mutex);
+    const auto res = acquire(fakeScreenResources);
+    pthread_mutex_unlock(&current_mutex);
+    return res;
+}
+
+pthread_once_t watcher_once = PTHREAD_ONCE_INIT;
+
+// The window it was made for, and the reply if we read it for the application already, see leased_resources_request()
+struct ResourcesRequest
+{
+    xcb_window_t window=XCB_NONE;
+    bool have_reply=false;
+    xcb_randr_get_screen_resources_reply_t* reply=nullptr;
+    xcb_generic_error_t* error=nullptr;
+};
+
+// The screen resources requests whose reply was not read yet
+pthread_mutex_t resources_cookies_mutex = PTHREAD_MUTEX_INITIALIZER;
+AssocList<ConnectionCookie, ResourcesRequest> resources_cookies;
+
+void note_resources_request(xcb_connection_t* c, unsigned sequence, ResourcesRequest const& request)
+{
+    pthread_mutex_lock(&resources_cookies_mutex);
+    resources_cookies.insert(ConnectionCookie{c, sequence}, request);
+    pthread_mutex_unlock(&resources_cookies_mutex);
+}
+void note_resources_request(xcb_connection_t* c, unsigned sequence, xcb_window_t window)
+{
+    ResourcesRequest request;
+    request.window = window;
+    note_resources_request(c, sequence, request);
+}
+
+// The request, with window XCB_NONE if we did not see it
+ResourcesRequest take_resources_request(xcb_connection_t* c, unsigned sequence)
+{
+    pthread_mutex_lock(&resources_cookies_mutex);
+    const auto item = resources_cookies.find(ConnectionCookie{c, sequence});
+    ResourcesRequest request;
+    if(item)
+    {
+        request = item->data.value;
+        resources_cookies.erase(item);
+    }
+    pthread_mutex_unlock(&resources_cookies_mutex);
+    return request;
+}
+
+/*
+    Common part of the screen resources reply hooks: replace the reply to a
+    request for window by one including the fake outputs, and make the layout
+    it belongs to current.
+*/
+xcb_randr_get_screen_resources_reply_t* augment_reply(xcb_connection_t* c, xcb_randr_get_screen_resources_reply_t* res, bool current,
+                                                      xcb_window_t window)
+{
+    if(!res)
+        return res;
+    pthread_once(&watcher_once, start_watcher);
+    latest_config_timestamp = res->config_timestamp;
+
+    // A layout built from the same reply can be reused if the configuration
+    // did not change: the watcher's snapshot always, and the previous layout
+    // if it has no splits. In the latter case the real reply is the answer,
+    // and the request costs neither EDID queries nor a copy.
+    const auto previous = acquire_current();
+    const auto snapshot = acquire_snapshot();
+    const auto known = snapshot ? snapshot : previous;
+    xcb_randr_get_screen_resources_reply_t* result;
+    if(known && known->isBuiltFrom(res) && (known==snapshot || !known->fake_outputs) &&
+       known->generation==current_config_generation())
+    {
+        if(snapshot)
+            publish_current(acquire(snapshot));
+        if(known->fake_outputs)
+        {
+            result = known->makeReturnValue(res->sequence);
+            free(res);
+        }
+        else
+            result = res;
+    }
+    else
+    {
+        const auto layout = buildFakeResources(c, res, current, known, window);
+        publish_current(acquire(layout));
+        result = layout ? layout->makeReturnValue(res->sequence) : res;
+        release(layout);
+    }
+    release(snapshot);
+    release(previous);
+    return result;
+}
+
+/*
+    Layout lookup for the Xinerama screen and monitor lists
+
+    The screens or monitors the server reports are checked against the most
+    recent layout: each split parent, i.e. the bounding box of its splits, must
+    be one of them. Only if it is not, or if the configuration changed, the
+    layout is built anew. In the steady state this costs no RandR requests.
+*/
+FakeScreenRect split_rect(FakeCrtcInfo const* crtc)
+{
+    const auto& info = crtc->orig_crtc_info;
+    return FakeScreenRect{info.x, info.y, info.width, info.height};
+}
+
+bool same_rect(FakeScreenRect const& a, FakeScreenRect const& b)
+{
+    return a.x==b.x && a.y==b.y && a.width==b.width && a.height==b.height;
+}
+
+// Calls fn(parentRect, firstSplit, endOfSplits) for each split CRTC. The splits
+// of one parent are consecutive in fake_crtcs.
+template<typename Fn>
+void for_each_split_parent(FakeScreenResources const* layout, Fn const& fn)
+{
+    for(auto* first=layout->fake_crtcs; first; )
+    {
+        const auto parent=xid_unsplit(first->xid);
+        int x0=first->orig_crtc_info.x, y0=first->orig_crtc_info.y;
+        int x1=x0+first->orig_crtc_info.width, y1=y0+first->orig_crtc_info.height;
+        auto* end=first;
+        for(; end && xid_unsplit(end->xid)==parent; end=end->nextInList)
+        {
+            const auto& info=end->orig_crtc_info;
+            x0=std::min<int>(x0, info.x);
+            y0=std::min<int>(y0, info.y);
+            x1=std::max<int>(x1, info.x+info.width);
+            y1=std::max<int>(y1, info.y+info.height);
+        }
+        fn(FakeScreenRect{int16_t(x0), int16_t(y0), uint16_t(x1-x0), uint16_t(y1-y0)}, first, end);
+        first=end;
+    }
+}
+
+bool layout_matches_screens(FakeScreenResources const* layout, FakeScreenRect const* screens, int num_screens)
+{
+    bool matches=true;
+    for_each_split_parent(layout, [&](FakeScreenRect const& parent, FakeCrtcInfo*, FakeCrtcInfo*)
+    {
+        if(std::none_of(screens, screens+num_screens, [&](FakeScreenRect const& s){return same_rect(s, parent);}))
+            matches=false;
+    });
+    return matches;
+}
+
+// Whether there is anything that may split outputs, without asking for the resources
+bool may_split(xcb_connection_t* c)
+{
+    pthread_mutex_lock(&build_mutex);
+    const bool result = !open_configuration() || layout_atom(c)!=XCB_NONE;
+    pthread_mutex_unlock(&build_mutex);
+    return result;
+}
+
+FakeScreenResources* acquire_current_layout(xcb_connection_t* c, FakeScreenRect const* screens, int num_screens)
+{
+    pthread_mutex_lock(&build_mutex);
+    const bool haveConfig = !open_configuration() || layout_atom(c)!=XCB_NONE;
+    const auto generation = config_generation;
+    pthread_mutex_unlock(&build_mutex);
+    if(!haveConfig)
+        return nullptr;
+
+    auto layout = acquire_snapshot();
+    if(!layout)
+        layout = acquire_current();
+    if(layout && layout->generation==generation && layout->origRes->config_timestamp==latest_config_timestamp &&
+       (!screens || layout_matches_screens(layout, screens, num_screens)))
+        return layout;
+    const auto previous = layout;
+
+    // Xinerama has no notion of screens, so we use the first root window
+    const auto root = xcb_setup_roots_iterator(xcb_get_setup(c)).data->root;
+    const auto cookie = _xcb_randr_get_screen_resources_current(c, root);
+    const auto res = reinterpret_cast<xcb_randr_get_screen_resources_reply_t*>(_xcb_randr_get_screen_resources_current_reply(c, cookie, NULL));
+    if(!res)
+    {
+        release(previous);
+        return nullptr;
+    }
+    latest_config_timestamp = res->config_timestamp;
+    layout = buildFakeResources(c, res, true, previous, root);
+    release(previous);
+    if(!layout)
+    {
+        free(res);
+        return nullptr;
+    }
+    publish_current(acquire(layout));
+    return layout;
+}
+
+#ifdef XCB_RANDR_GET_MONITORS
+/*
+    Monitors
+
+    Monitors which show a split output are replaced by one monitor per split,
+    named like the fake output. The names are interned once per layout and
+    connection, with all requests in flight at the same time. Atoms belong to
+    a server, and a layout may be used with connections to several of them.
+    A connection which is gone may leave its address to a new one, so any
+    disconnect makes the interned names of the connections before it stale.
+*/
+std::atomic<unsigned> disconnect_serial{0};
+
+// Returns the atoms indexed by FakeOutputInfo::index, valid as long as the layout
+const xcb_atom_t* intern_output_names(xcb_connection_t* c, FakeScreenResources* layout)
+{
+    const unsigned disconnects=disconnect_serial;
+    pthread_mutex_lock(&layout->atoms_mutex);
+    auto* names=layout->name_atoms;
+    while(names && (names->c!=c || names->disconnects!=disconnects))
+        names=names->nextInList;
+    pthread_mutex_unlock(&layout->atoms_mutex);
+    if(names)
+        return names->atoms;
+
+    // Stale entries stay until the layout goes, since other threads may still use their atoms
+    const int n=list_length(layout->fake_outputs);
+    const auto cookies=static_cast<xcb_intern_atom_cookie_t*>(malloc(n*sizeof(xcb_intern_atom_cookie_t)));
+    const auto atoms=static_cast<xcb_atom_t*>(calloc(n, sizeof(xcb_atom_t)));
+    for(auto* output=layout->fake_outputs; output; output=output->nextInList)
+        cookies[output->index]=xcb_intern_atom(c, 0, output->orig_output_info.name_len, reinterpret_cast<const char*>(output->name));
+    for(int i=0; i<n; ++i)
+    {
+        const auto atom=xcb_intern_atom_reply(c, cookies[i], NULL);
+        if(!atom)
+            continue;
+        atoms[i]=atom->atom;
+        free(atom);
+    }
+    free(cookies);
+
+    names=newObj<NameAtoms>(c, disconnects, atoms);
+    pthread_mutex_lock(&layout->atoms_mutex);
+    names->nextInList=layout->name_atoms;
+    layout->name_atoms=names;
+    pthread_mutex_unlock(&layout->atoms_mutex);
+    return atoms;
+}
+
+// Finds the splits of the output a monitor shows, if it covers exactly that output
+bool find_monitor_splits(FakeScreenResources const* layout, xcb_randr_monitor_info_t const* monitor,
+                         FakeCrtcInfo** first, FakeCrtcInfo** end)
+{
+    const FakeScreenRect rect{monitor->x, monitor->y, monitor->width, monitor->height};
+    const auto outputs=_xcb_randr_monitor_info_outputs(monitor);
+    bool found=false;
+    for_each_split_parent(layout, [&](FakeScreenRect const& parent, FakeCrtcInfo* firstSplit, FakeCrtcInfo* endOfSplits)
+    {
+        const auto parentOutput=xid_unsplit(firstSplit->output);
+        if(found || !same_rect(parent, rect) || std::find(outputs, outputs+monitor->nOutput, parentOutput)==outputs+monitor->nOutput)
+            return;
+        *first=firstSplit;
+        *end=endOfSplits;
+        found=true;
+    });
+    return found;
+}
+
+xcb_randr_get_monitors_reply_t* augment_monitors_reply(xcb_connection_t* c, xcb_randr_get_monitors_reply_t* reply)
+{
+    const auto rects=static_cast<FakeScreenRect*>(malloc(reply->nMonitors*sizeof(FakeScreenRect)));
+    int num_rects=0;
+    for(auto it=_xcb_randr_get_monitors_monitors_iterator(reply); it.rem; _xcb_randr_monitor_info_next(&it))
+        rects[num_rects++]=FakeScreenRect{it.data->x, it.data->y, it.data->width, it.data->height};
+    const auto layout=acquire_current_layout(c, rects, num_rects);
+    free(rects);
+    if(!layout || !layout->fake_crtcs)
+    {
+        release(layout);
+        return reply;
+    }
+    const auto name_atoms=intern_output_names(c, layout);
+
+    FakeCrtcInfo *first, *end;
+    size_t size=sizeof(*reply);
+    for(auto it=_xcb_randr_get_monitors_monitors_iterator(reply); it.rem; _xcb_randr_monitor_info_next(&it))
+    {
+        if(find_monitor_splits(layout, it.data, &first, &end))
+        {
+            for(auto* crtc=first; crtc!=end; crtc=crtc->nextInList)
+                size+=sizeof(xcb_randr_monitor_info_t)+sizeof(xcb_randr_output_t);
+        }
+        else
+            size+=sizeof(xcb_randr_monitor_info_t)+it.data->nOutput*sizeof(xcb_randr_output_t);
+    }
+
+    const auto p=static_cast<xcb_randr_get_monitors_reply_t*>(malloc(size));
+    // Copy fixed-size part
+    *p=*reply;
+    p->nMonitors=p->nOutputs=0;
+    // Now fill in the variable-length data
+    auto dst=reinterpret_cast<char*>(p+1);
+    for(auto it=_xcb_randr_get_monitors_monitors_iterator(reply); it.rem; _xcb_randr_monitor_info_next(&it))
+    {
+        if(!find_monitor_splits(layout, it.data, &first, &end))
+        {
+            const auto monitorSize=sizeof(xcb_randr_monitor_info_t)+it.data->nOutput*sizeof(xcb_randr_output_t);
+            memcpy(dst, it.data, monitorSize);
+            dst+=monitorSize;
+            ++p->nMonitors;
+            p->nOutputs+=it.data->nOutput;
+            continue;
+        }
+        for(auto* crtc=first; crtc!=end; crtc=crtc->nextInList)
+        {
+            const auto output=layout->outputs_by_xid.find(crtc->output);
+            const auto monitor=reinterpret_cast<xcb_randr_monitor_info_t*>(dst);
+            monitor->name=output ? name_atoms[output->index] : XCB_ATOM_NONE;
+            monitor->primary=it.data->primary && crtc==first;
+            monitor->automatic=1;
+            monitor->nOutput=1;
+            monitor->x=crtc->orig_crtc_info.x;
+            monitor->y=crtc->orig_crtc_info.y;
+            monitor->width=crtc->orig_crtc_info.width;
+            monitor->height=crtc->orig_crtc_info.height;
+            monitor->width_in_millimeters=output ? output->orig_output_info.mm_width : 0;
+            monitor->height_in_millimeters=output ? output->orig_output_info.mm_height : 0;
+            *_xcb_randr_monitor_info_outputs(monitor)=crtc->output;
+            dst+=sizeof(xcb_randr_monitor_info_t)+sizeof(xcb_randr_output_t);
+            ++p->nMonitors;
+            ++p->nOutputs;
+        }
+    }
+    p->length=(size-sizeof(*reply))/4;
+    release(layout);
+
+    free(reply);
+    return p;
+}
+#endif
+
+/*
+    Event translation
+
+    A CRTC or output change notification of a split output is returned for the
+    parent, hidden like in the CRTC and output info replies, and followed by
+    one for each split with the fake XIDs and geometry. The layout from before
+    the change tells us how the parent was split. This hooks the event
+    functions of libxcb, so it needs this library to precede libxcb in the
+    symbol lookup order. Only connections which selected RandR notifications
+    through this library are translated, so events which Xlib reads through
+    xcb are not translated twice.
+*/
+struct QueuedEvent
+{
+    QueuedEvent* next=nullptr;
+    xcb_generic_event_t* event;
+
+    explicit QueuedEvent(xcb_generic_event_t* event)
+        : event(event)
+    {
+    }
+};
+
+struct EventConnection
+{
+    EventConnection* nextInList=nullptr;
+    xcb_connection_t* c;
+    uint8_t notify_type;
+
+    // Translated events not yet returned to the application
+    QueuedEvent* pending=nullptr;
+    QueuedEvent** pending_end=&pending;
+
+    EventConnection(xcb_connection_t* c, uint8_t notify_type)
+        : c(c)
+        , notify_type(notify_type)
+    {
+    }
+};
+
+pthread_mutex_t events_mutex = PTHREAD_MUTEX_INITIALIZER;
+EventConnection* event_connections;
+// Lets connections without RandR notifications skip the mutex
+std::atomic<bool> have_event_connections{false};
+
+xcb_generic_event_t* (*real_wait_for_event)(xcb_connection_t* c);
+xcb_generic_event_t* (*real_poll_for_event)(xcb_connection_t* c);
+xcb_generic_event_t* (*real_poll_for_queued_event)(xcb_connection_t* c);
+void (*real_disconnect)(xcb_connection_t* c);
+
+EventConnection** find_event_connection(xcb_connection_t* c)
+{
+    auto** conn=&event_connections;
+    while(*conn && (*conn)->c!=c)
+        conn=&(*conn)->nextInList;
+    return conn;
+}
+
+void watch_notify_events(xcb_connection_t* c)
+{
+    const auto ext=xcb_get_extension_data(c, &xcb_randr_id);
+    if(!ext || !ext->present)
+        return;
+    pthread_mutex_lock(&events_mutex);
+    auto** conn=find_event_connection(c);
+    if(!*conn)
+    {
+        *conn=newObj<EventConnection>(c, ext->first_event+XCB_RANDR_NOTIFY);
+        have_event_connections=true;
+    }
+    pthread_mutex_unlock(&events_mutex);
+}
+
+void forget_event_connection(xcb_connection_t* c)
+{
+    pthread_mutex_lock(&events_mutex);
+    auto** conn=find_event_connection(c);
+    if(auto* dead=*conn)
+    {
+        *conn=dead->nextInList;
+        while(auto* queued=dead->pending)
+        {
+            dead->pending=queued->next;
+            free(queued->event);
+            deleteObj(queued);
+        }
+        deleteObj(dead);
+    }
+    pthread_mutex_unlock(&events_mutex);
+}
+
+xcb_randr_notify_event_t* copy_notify_event(xcb_randr_notify_event_t const& event, uint32_t full_sequence)
+{
+    // libxcb allocates all events with the size of the generic event
+    const auto p=static_cast<xcb_generic_event_t*>(malloc(sizeof(xcb_generic_event_t)));
+    memcpy(p, &event, sizeof event);
+    p->full_sequence=full_sequence;
+    return reinterpret_cast<xcb_randr_notify_event_t*>(p);
+}
+
+// Modifies the event for the parent in place and appends those for the splits
+void translate_notify_event(xcb_randr_notify_event_t* event, QueuedEvent**& queue_end)
+{
+    if(event->subCode!=XCB_RANDR_NOTIFY_CRTC_CHANGE && event->subCode!=XCB_RANDR_NOTIFY_OUTPUT_CHANGE)
+        return;
+    auto* layout=acquire_snapshot();
+    if(!layout)
+        layout=acquire_current();
+    if(!layout)
+        return;
+    mark_stale(layout, event->subCode==XCB_RANDR_NOTIFY_CRTC_CHANGE ? event->u.cc.crtc : event->u.oc.output);
+
+    const auto append=[&](xcb_randr_notify_event_t* split)
+    {
+        *queue_end=newObj<QueuedEvent>(reinterpret_cast<xcb_generic_event_t*>(split));
+        queue_end=&(*queue_end)->next;
+    };
+    const auto original=*event;
+    const auto full_sequence=reinterpret_cast<xcb_generic_event_t*>(event)->full_sequence;
+    for_each_split_parent(layout, [&](FakeScreenRect const& parent, FakeCrtcInfo* first, FakeCrtcInfo* end)
+    {
+        const auto parentCrtc=xid_unsplit(first->xid);
+        if(original.subCode==XCB_RANDR_NOTIFY_CRTC_CHANGE)
+        {
+            const auto& cc=original.u.cc;
+            if(cc.crtc!=parentCrtc)
+                return;
+            // The splits only persist if the parent kept its size
+            const bool stillSplit=cc.mode && cc.width==parent.width && cc.height==parent.height;
+            event->u.cc.mode=0;
+            event->u.cc.x=event->u.cc.y=event->u.cc.width=event->u.cc.height=0;
+            for(auto* crtc=first; crtc!=end; crtc=crtc->nextInList)
+            {
+                const auto split=copy_notify_event(original, full_sequence);
+                const auto& info=crtc->orig_crtc_info;
+                split->u.cc.crtc=crtc->xid;
+                split->u.cc.mode=stillSplit ? info.mode : 0;
+                split->u.cc.x=stillSplit ? cc.x+info.x-parent.x : 0;
+                split->u.cc.y=stillSplit ? cc.y+info.y-parent.y : 0;
+                split->u.cc.width=stillSplit ? info.width : 0;
+                split->u.cc.height=stillSplit ? info.height : 0;
+                append(split);
+            }
+        }
+        else
+        {
+            const auto& oc=original.u.oc;
+            if(oc.output!=xid_unsplit(first->output))
+                return;
+            event->u.oc.connection=XCB_RANDR_CONNECTION_DISCONNECTED;
+            for(auto* crtc=first; crtc!=end; crtc=crtc->nextInList)
+            {
+                const auto split=copy_notify_event(original, full_sequence);
+                // If the parent moved to another CRTC, the splits are gone
+                const bool sameCrtc=oc.crtc==parentCrtc;
+                split->u.oc.output=crtc->output;
+                split->u.oc.crtc=sameCrtc ? crtc->xid : 0;
+                split->u.oc.mode=sameCrtc && oc.mode ? crtc->orig_crtc_info.mode : 0;
+                append(split);
+            }
+        }
+    });
+    release(layout);
+}
+
+// Common part of the event hooks
+xcb_generic_event_t* next_event(xcb_connection_t* c, xcb_generic_event_t* (*real)(xcb_connection_t* c))
+{
+    if(!real)
+        return nullptr;
+    if(!have_event_connections)
+        return real(c);
+
+    pthread_mutex_lock(&events_mutex);
+    auto* conn=*find_event_connection(c);
+    if(!conn)
+    {
+        pthread_mutex_unlock(&events_mutex);
+        return real(c);
+    }
+    if(auto* queued=conn->pending)
+    {
+        conn->pending=queued->next;
+        if(!conn->pending)
+            conn->pending_end=&conn->pending;
+        pthread_mutex_unlock(&events_mutex);
+        const auto event=queued->event;
+        deleteObj(queued);
+        return event;
+    }
+    const auto notify_type=conn->notify_type;
+    pthread_mutex_unlock(&events_mutex);
+
+    // Do not hold the mutex while waiting
+    const auto event=real(c);
+    if(event && (event->response_type & 0x7f)==notify_type-XCB_RANDR_NOTIFY+XCB_RANDR_SCREEN_CHANGE_NOTIFY)
+    {
+        latest_config_timestamp=reinterpret_cast<xcb_randr_screen_change_notify_event_t*>(event)->config_timestamp;
+        ++screen_changes;
+    }
+    if(!event || (event->response_type & 0x7f)!=notify_type)
+        return event;
+    const auto notify=reinterpret_cast<xcb_randr_notify_event_t*>(event);
+    if(notify->subCode==XCB_RANDR_NOTIFY_OUTPUT_PROPERTY)
+        ++property_serial;
+    else if(notify->subCode==XCB_RANDR_NOTIFY_OUTPUT_CHANGE)
+    {
+        if(latest_config_timestamp.exchange(notify->u.oc.config_timestamp)!=notify->u.oc.config_timestamp)
+            ++screen_changes;
+    }
+
+    QueuedEvent* splits=nullptr;
+    QueuedEvent** splits_end=&splits;
+    translate_notify_event(reinterpret_cast<xcb_randr_notify_event_t*>(event), splits_end);
+    if(splits)
+    {
+        pthread_mutex_lock(&events_mutex);
+        if(auto* conn=*find_event_connection(c))
+        {
+            *conn->pending_end=splits;
+            conn->pending_end=splits_end;
+        }
+        pthread_mutex_unlock(&events_mutex);
+    }
+    return event;
+}
+
+/*
+    Gamma
+
+    Requests for the splits of a CRTC are deduplicated as described for struct
+    SiblingPass in fakexrandr.h. Reads still send their request, since the
+    application needs a cookie, but only the first one per parent and pass
+    waits for its reply; the others are discarded and answered from the cache.
+*/
+struct GammaCache
+{
+    GammaCache* nextInList=nullptr;
+    xcb_connection_t* c;
+    xcb_randr_crtc_t parent;
+
+    uint16_t size=0;
+    SiblingPass size_pass;
+
+    // A reply with the ramps the parent has now, and the request which set
+    // them, if it was ours
+    xcb_randr_get_crtc_gamma_reply_t* ramps=nullptr;
+    SiblingPass ramps_pass;
+    xcb_void_cookie_t set_cookie{0};
+
+    GammaCache(xcb_connection_t* c, xcb_randr_crtc_t parent)
+        : c(c)
+        , parent(parent)
+    {
+    }
+};
+
+// Guards the gamma caches and the cookie lists of the gamma requests
+pthread_mutex_t gamma_mutex = PTHREAD_MUTEX_INITIALIZER;
+GammaCache* gamma_caches;
+
+// The CRTCs the application asked for, by request
+AssocList<ConnectionCookie, xcb_randr_crtc_t> gamma_size_cookies;
+AssocList<ConnectionCookie, xcb_randr_crtc_t> gamma_cookies;
+
+bool take_gamma_cookie(AssocList<ConnectionCookie, xcb_randr_crtc_t>& cookies, xcb_connection_t* c, unsigned sequence, xcb_randr_crtc_t& crtc)
+{
+    pthread_mutex_lock(&gamma_mutex);
+    const auto item=cookies.find(ConnectionCookie{c, sequence});
+    if(item)
+    {
+        crtc=item->data.value;
+        cookies.erase(item);
+    }
+    pthread_mutex_unlock(&gamma_mutex);
+    return item;
+}
+
+GammaCache* find_gamma_cache(xcb_connection_t* c, xcb_randr_crtc_t parent)
+{
+    auto* cache=gamma_caches;
+    while(cache && (cache->c!=c || cache->parent!=parent))
+        cache=cache->nextInList;
+    if(!cache)
+    {
+        cache=newObj<GammaCache>(c, parent);
+        cache->nextInList=gamma_caches;
+        gamma_caches=cache;
+    }
+    return cache;
+}
+
+void forget_gamma_caches(xcb_connection_t* c)
+{
+    pthread_mutex_lock(&gamma_mutex);
+    for(auto** cache=&gamma_caches; *cache; )
+    {
+        if((*cache)->c!=c)
+        {
+            cache=&(*cache)->nextInList;
+            continue;
+        }
+        const auto dead=*cache;
+        *cache=dead->nextInList;
+        free(dead->ramps);
+        deleteObj(dead);
+    }
+    const auto on_c=[c](ConnectionCookie const& cookie){return cookie.c==c;};
+    gamma_size_cookies.eraseIf(on_c);
+    gamma_cookies.eraseIf(on_c);
+    pthread_mutex_unlock(&gamma_mutex);
+}
+
+size_t gamma_reply_size(xcb_randr_get_crtc_gamma_reply_t const* reply)
+{
+    return sizeof(*reply)+reply->length*4;
+}
+
+xcb_randr_get_crtc_gamma_reply_t* make_gamma_reply(uint16_t size, const uint16_t* red, const uint16_t* green, const uint16_t* blue)
+{
+    const uint32_t length=(3*size*sizeof(uint16_t)+3)/4;
+    const auto p=static_cast<xcb_randr_get_crtc_gamma_reply_t*>(calloc(1, sizeof(xcb_randr_get_crtc_gamma_reply_t)+length*4));
+    p->response_type=1; // X_Reply
+    p->length=length;
+    p->size=size;
+    // The three ramps follow the fixed-size part without padding between them
+    const auto ramps=reinterpret_cast<uint16_t*>(p+1);
+    std::copy_n(red, size, ramps);
+    std::copy_n(green, size, ramps+size);
+    std::copy_n(blue, size, ramps+2*size);
+    return p;
+}
+
+// Drop the ramps we know for the parent of crtc, e.g. since it was set without splits
+void forget_gamma(xcb_connection_t* c, xcb_randr_crtc_t crtc)
+{
+    for(auto* cache=gamma_caches; cache; cache=cache->nextInList)
+    {
+        if(cache->c!=c || cache->parent!=xid_unsplit(crtc))
+            continue;
+        free(cache->ramps);
+        cache->ramps=nullptr;
+        cache->set_cookie.sequence=0;
+    }
+}
+
+// Remember the ramps the parent has now, starting a pass at crtc. Takes ownership of ramps.
+void store_gamma(GammaCache* cache, xcb_randr_crtc_t crtc, xcb_randr_get_crtc_gamma_reply_t* ramps, xcb_void_cookie_t set_cookie)
+{
+    free(cache->ramps);
+    cache->ramps=ramps;
+    cache->set_cookie=set_cookie;
+    sibling_pass_start(&cache->ramps_pass, crtc);
+}
+
+/*
+    Output properties
+
+    Requests for the splits of an output go to their parent, and are
+    deduplicated like those for gamma. Answers are dropped whenever a layout
+    is built, on output property notifications read through this library, and
+    when this client changes a property.
+*/
+struct PropertyRequest
+{
+    uint8_t opcode=0;
+    xcb_randr_output_t parent=0;
+    xcb_atom_t property=0;
+    xcb_atom_t type=0;
+    uint32_t offset=0;
+    uint32_t length=0;
+    uint8_t pending=0;
+
+    bool operator==(PropertyRequest const& other) const
+    {
+        return opcode==other.opcode && parent==other.parent && property==other.property && type==other.type &&
+               offset==other.offset && length==other.length && pending==other.pending;
+    }
+};
+
+struct PropertyCache
+{
+    PropertyCache* nextInList=nullptr;
+    xcb_connection_t* c;
+    PropertyRequest request;
+
+    // The property_serial the reply is valid for
+    unsigned serial=0;
+    SiblingPass pass;
+    void* reply=nullptr;
+    size_t reply_size=0;
+
+    PropertyCache(xcb_connection_t* c, PropertyRequest const& request)
+        : c(c)
+        , request(request)
+    {
+    }
+};
+
+// What a cookie of one of these requests was for
+struct PendingProperty
+{
+    xcb_randr_output_t output;
+    PropertyRequest request;
+};
+
+// Guards the property caches and the cookie list
+pthread_mutex_t properties_mutex = PTHREAD_MUTEX_INITIALIZER;
+PropertyCache* property_caches;
+AssocList<ConnectionCookie, PendingProperty> property_cookies;
+
+void note_property_request(xcb_connection_t* c, unsigned sequence, xcb_randr_output_t output, PropertyRequest request)
+{
+    request.parent=xid_unsplit(output);
+    pthread_mutex_lock(&properties_mutex);
+    property_cookies.insert(ConnectionCookie{c, sequence}, PendingProperty{output, request});
+    pthread_mutex_unlock(&properties_mutex);
+}
+
+void forget_property_caches(xcb_connection_t* c)
+{
+    pthread_mutex_lock(&properties_mutex);
+    for(auto** cache=&property_caches; *cache; )
+    {
+        if((*cache)->c!=c)
+        {
+            cache=&(*cache)->nextInList;
+            continue;
+        }
+        const auto dead=*cache;
+        *cache=dead->nextInList;
+        free(dead->reply);
+        deleteObj(dead);
+    }
+    property_cookies.eraseIf([c](ConnectionCookie const& cookie){return cookie.c==c;});
+    pthread_mutex_unlock(&properties_mutex);
+}
+
+// Common part of the property reply hooks
+template<typename Reply, typename Cookie>
+Reply* property_reply(xcb_connection_t* c, Cookie cookie, xcb_generic_error_t** e,
+                      Reply* (*real)(xcb_connection_t* c, Cookie cookie, xcb_generic_error_t** e))
+{
+    pthread_mutex_lock(&properties_mutex);
+    const auto item=property_cookies.find(ConnectionCookie{c, cookie.sequence});
+    if(!item)
+    {
+        pthread_mutex_unlock(&properties_mutex);
+        return real(c, cookie, e);
+    }
+    const auto pending=item->data.value;
+    property_cookies.erase(item);
+
+    auto* cache=property_caches;
+    while(cache && (cache->c!=c || !(cache->request==pending.request)))
+        cache=cache->nextInList;
+    Reply* copy=nullptr;
+    if(cache && cache->serial==property_serial && sibling_pass_join(&cache->pass, pending.output))
+    {
+        copy=static_cast<Reply*>(malloc(cache->reply_size));
+        memcpy(copy, cache->reply, cache->reply_size);
+    }
+    pthread_mutex_unlock(&properties_mutex);
+    if(copy)
+    {
+        xcb_discard_reply(c, cookie.sequence);
+        if(e)
+            *e=nullptr;
+        copy->sequence=cookie.sequence;
+        return copy;
+    }
+
+    const unsigned serial=property_serial;
+    const auto reply=real(c, cookie, e);
+    if(!reply)
+        return reply;
+    const auto size=sizeof(Reply)+reply->length*4;
+    const auto stored=malloc(size);
+    memcpy(stored, reply, size);
+
+    pthread_mutex_lock(&properties_mutex);
+    cache=property_caches;
+    while(cache && (cache->c!=c || !(cache->request==pending.request)))
+        cache=cache->nextInList;
+    if(!cache)
+    {
+        cache=newObj<PropertyCache>(c, pending.request);
+        cache->nextInList=property_caches;
+        property_caches=cache;
+    }
+    free(cache->reply);
+    cache->reply=stored;
+    cache->reply_size=size;
+    cache->serial=serial;
+    sibling_pass_start(&cache->pass, pending.output);
+    pthread_mutex_unlock(&properties_mutex);
+    return reply;
+}
+
+/*
+    Looks up a libxcb function wrapped for event translation on first use.
+    RTLD_NEXT only finds libxcb if it comes after us in the lookup order,
+    e.g. not if the application dlopen()ed us itself, so we fall back to
+    opening libxcb by name.
+*/
+void* xcb_lib;
+
+template<typename Fn>
+Fn next_symbol(Fn* fn, const char* name)
+{
+    auto found=__atomic_load_n(fn, __ATOMIC_ACQUIRE);
+    if(!found)
+    {
+        found=(Fn)dlsym(RTLD_NEXT, name);
+        if(!found)
+            found=(Fn)real_library_symbol(&xcb_lib, "libxcb.so.1", name);
+        __atomic_store_n(fn, found, __ATOMIC_RELEASE);
+    }
+    return found;
+}
+
+} // namespace
+
+/*
+    Overridden library functions to add the fake output
+*/
+
+extern "C"
+{
+xcb_randr_get_screen_resources_current_cookie_t xcb_randr_get_screen_resources_current(xcb_connection_t* c, xcb_window_t window)
+{
+    const auto cookie = _xcb_randr_get_screen_resources_current(c, window);
+    note_resources_request(c, cookie.sequence, window);
+    return cookie;
+}
+xcb_randr_get_screen_resources_current_cookie_t xcb_randr_get_screen_resources_current_unchecked(xcb_connection_t* c, xcb_window_t window)
+{
+    const auto cookie = _xcb_randr_get_screen_resources_current_unchecked(c, window);
+    note_resources_request(c, cookie.sequence, window);
+    return cookie;
+}
+xcb_randr_get_screen_resources_current_reply_t* xcb_randr_get_screen_resources_current_reply(xcb_connection_t* c,
+                                                                                             xcb_randr_get_screen_resources_current_cookie_t cookie,
+                                                                                             xcb_generic_error_t** e)
+{
+    const auto window = take_resources_request(c, cookie.sequence).window;
+    auto*const screen_resources = _xcb_randr_get_screen_resources_current_reply(c, cookie, e);
+    return reinterpret_cast<xcb_randr_get_screen_resources_current_reply_t*>(
+            augment_reply(c, reinterpret_cast<xcb_randr_get_screen_resources_reply_t*>(screen_resources), true, window));
+}
+
+/*
+    Of the clients a hotplug wakes up, only the one holding the probe lease
+    makes the server probe the outputs, see probe_lease_take(). The others ask
+    for the current resources. Without a change since our previous request,
+    the application gets its own probe.
+
+    The holder reads the reply right away, so that the lease is not held until
+    the application gets around to read it. The reply is kept for it with the
+    request, and augmented once it is read.
+*/
+static xcb_randr_get_screen_resources_cookie_t leased_resources_request(xcb_connection_t* c, xcb_window_t window, bool checked)
+{
+    const unsigned changes = screen_changes;
+    char name[256];
+    const auto lease = changes != probed_changes.exchange(changes) && may_split(c) ?
+        probe_lease_take(shared_display_name(c, name, sizeof name)) : LEASE_NONE;
+    if(lease == LEASE_BUSY)
+    {
+        const auto cookie = checked ? _xcb_randr_get_screen_resources_current(c, window)
+                                    : _xcb_randr_get_screen_resources_current_unchecked(c, window);
+        note_resources_request(c, cookie.sequence, window);
+        return xcb_randr_get_screen_resources_cookie_t{cookie.sequence};
+    }
+    const auto cookie = checked ? _xcb_randr_get_screen_resources(c, window) : _xcb_randr_get_screen_resources_unchecked(c, window);
+    if(lease < 0)
+    {
+        note_resources_request(c, cookie.sequence, window);
+        return cookie;
+    }
+    ResourcesRequest request;
+    request.window = window;
+    request.have_reply = true;
+    request.reply = _xcb_randr_get_screen_resources_reply(c, cookie, &request.error);
+    lease_release(lease);
+    note_resources_request(c, cookie.sequence, request);
+    return cookie;
+}
+xcb_randr_get_screen_resources_cookie_t xcb_randr_get_screen_resources(xcb_connection_t* c, xcb_window_t window)
+{
+    return leased_resources_request(c, window, true);
+}
+xcb_randr_get_screen_resources_cookie_t xcb_randr_get_screen_resources_unchecked(xcb_connection_t* c, xcb_window_t window)
+{
+    return leased_resources_request(c, window, false);
+}
+xcb_randr_get_screen_resources_reply_t* xcb_randr_get_screen_resources_reply(xcb_connection_t* c,
+                                                                             xcb_randr_get_screen_resources_cookie_t cookie,
+                                                                             xcb_generic_error_t** e)
+{
+    const auto request = take_resources_request(c, cookie.sequence);
+    if(request.have_reply)
+    {
+        if(e)
+            *e = request.error;
+        else
+            free(request.error);
+        return augment_reply(c, request.reply, false, request.window);
+    }
+    auto*const screen_resources = _xcb_randr_get_screen_resources_reply(c, cookie, e);
+    return augment_reply(c, screen_resources, false, request.window);
+}
+
+// --------------------- CRTC info ---------------------------
+static AssocList<decltype(xcb_randr_get_crtc_info_cookie_t::sequence), xcb_randr_crtc_t> crtc_info_cookies;
+xcb_randr_get_crtc_info_cookie_t xcb_randr_get_crtc_info(xcb_connection_t* c, xcb_randr_crtc_t crtc, xcb_timestamp_t config_timestamp)
+{
+    const auto cookie = _xcb_randr_get_crtc_info(c,xid_unsplit(crtc), config_timestamp);
+    crtc_info_cookies.insert(cookie.sequence,crtc);
+    return cookie;
 }
 xcb_randr_get_crtc_info_cookie_t xcb_randr_get_crtc_info_unchecked(xcb_connection_t* c, xcb_randr_crtc_t crtc, xcb_timestamp_t config_timestamp)
 {
-    const auto cookie = _xcb_randr_get_crtc_info_unchecked(c,crtc & ~XID_SPLIT_MASK, config_timestamp);
+    const auto cookie = _xcb_randr_get_crtc_info_unchecked(c,xid_unsplit(crtc), config_timestamp);
     crtc_info_cookies.insert(cookie.sequence,crtc);
     return cookie;
 }
 xcb_randr_get_crtc_info_reply_t* xcb_randr_get_crtc_info_reply(xcb_connection_t* c, xcb_randr_get_crtc_info_cookie_t cookie, xcb_generic_error_t** e)
 {
     const auto fakeCrtcItem=crtc_info_cookies.find(cookie.sequence);
-    if(!fakeCrtcItem || !fakeScreenResources)
+    const auto layout=fakeCrtcItem ? acquire_current() : nullptr;
+    if(!layout)
         return _xcb_randr_get_crtc_info_reply(c,cookie,e);
 
     const auto crtcId=fakeCrtcItem->data.value;
     crtc_info_cookies.erase(fakeCrtcItem);
-    if(!(crtcId & XID_SPLIT_MASK))
+    const auto fakeCrtc=layout->crtcs_by_xid.find(crtcId);
+    xcb_randr_get_crtc_info_reply_t* info=nullptr;
+    if(!xid_is_split(crtcId))
     {
-        const auto info=_xcb_randr_get_crtc_info_reply(c,cookie,e);
-        for(const auto* output=fakeScreenResources->fake_outputs; output; output=output->nextInList)
+        info=_xcb_randr_get_crtc_info_reply(c,cookie,e);
+        if(fakeCrtc && info)
         {
-            if((output->orig_output_info.crtc & ~XID_SPLIT_MASK)!=crtcId)
-                continue;
             // This CRTC corresponds to a fake output. Hide its current mode.
             info->mode=0;
             info->x=info->y=info->width=info->height=0;
-            break;
         }
-        return info;
-    }
-    for(auto* crtc=fakeScreenResources->fake_crtcs; crtc; crtc=crtc->nextInList)
-    {
-        if(crtc->xid!=crtcId) continue;
-        return crtc->makeReturnValue();
     }
-    return nullptr;
+    else if(fakeCrtc)
+        info=fakeCrtc->makeReturnValue();
+    release(layout);
+    return info;
 }
 
 // --------------------- Output info ---------------------------
 static AssocList<decltype(xcb_randr_get_output_info_cookie_t::sequence), xcb_randr_output_t> output_info_cookies;
 xcb_randr_get_output_info_cookie_t xcb_randr_get_output_info(xcb_connection_t* c, xcb_randr_output_t output, xcb_timestamp_t config_timestamp)
 {
-    const auto cookie = _xcb_randr_get_output_info(c,output & ~XID_SPLIT_MASK, config_timestamp);
+    const auto cookie = _xcb_randr_get_output_info(c,xid_unsplit(output), config_timestamp);
     output_info_cookies.insert(cookie.sequence,output);
     return cookie;
 }
 xcb_randr_get_output_info_cookie_t xcb_randr_get_output_info_unchecked(xcb_connection_t* c, xcb_randr_output_t output, xcb_timestamp_t config_timestamp)
 {
-    const auto cookie = _xcb_randr_get_output_info_unchecked(c,output & ~XID_SPLIT_MASK, config_timestamp);
+    const auto cookie = _xcb_randr_get_output_info_unchecked(c,xid_unsplit(output), config_timestamp);
     output_info_cookies.insert(cookie.sequence,output);
     return cookie;
 }
 xcb_randr_get_output_info_reply_t* xcb_randr_get_output_info_reply(xcb_connection_t* c, xcb_randr_get_output_info_cookie_t cookie, xcb_generic_error_t** e)
 {
     const auto fakeOutputItem=output_info_cookies.find(cookie.sequence);
-    if(!fakeOutputItem || !fakeScreenResources)
+    const auto layout=fakeOutputItem ? acquire_current() : nullptr;
+    if(!layout)
         return _xcb_randr_get_output_info_reply(c,cookie,e);
 
     const auto outputId=fakeOutputItem->data.value;
     output_info_cookies.erase(fakeOutputItem);
-    if(!(outputId & XID_SPLIT_MASK))
+    const auto fakeOutput=layout->outputs_by_xid.find(outputId);
+    xcb_randr_get_output_info_reply_t* outputInfo=nullptr;
+    if(!xid_is_split(outputId))
     {
-        const auto outputInfo=_xcb_randr_get_output_info_reply(c,cookie,e);
-        if(xid_in_list(fakeScreenResources->fake_outputs, outputId))
+        outputInfo=_xcb_randr_get_output_info_reply(c,cookie,e);
+        if(fakeOutput && outputInfo)
         {
             // This output is fake. Make it look disconnected.
             outputInfo->connection=XCB_RANDR_CONNECTION_DISCONNECTED;
         }
-        return outputInfo;
     }
-    for(auto* output=fakeScreenResources->fake_outputs; output; output=output->nextInList)
+    else if(fakeOutput)
+        outputInfo=fakeOutput->makeReturnValue();
+    release(layout);
+    return outputInfo;
+}
+
+// --------------------- Events ---------------------------
+xcb_void_cookie_t xcb_randr_select_input(xcb_connection_t* c, xcb_window_t window, uint16_t enable)
+{
+    const auto cookie=_xcb_randr_select_input(c, window, enable);
+    if(enable & (XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE | XCB_RANDR_NOTIFY_MASK_OUTPUT_CHANGE | XCB_RANDR_NOTIFY_MASK_OUTPUT_PROPERTY))
+        watch_notify_events(c);
+    return cookie;
+}
+xcb_void_cookie_t xcb_randr_select_input_checked(xcb_connection_t* c, xcb_window_t window, uint16_t enable)
+{
+    const auto cookie=_xcb_randr_select_input_checked(c, window, enable);
+    if(enable & (XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE | XCB_RANDR_NOTIFY_MASK_OUTPUT_CHANGE | XCB_RANDR_NOTIFY_MASK_OUTPUT_PROPERTY))
+        watch_notify_events(c);
+    return cookie;
+}
+xcb_generic_event_t* xcb_wait_for_event(xcb_connection_t* c)
+{
+    return next_event(c, next_symbol(&real_wait_for_event, "xcb_wait_for_event"));
+}
+xcb_generic_event_t* xcb_poll_for_event(xcb_connection_t* c)
+{
+    return next_event(c, next_symbol(&real_poll_for_event, "xcb_poll_for_event"));
+}
+xcb_generic_event_t* xcb_poll_for_queued_event(xcb_connection_t* c)
+{
+    return next_event(c, next_symbol(&real_poll_for_queued_event, "xcb_poll_for_queued_event"));
+}
+void xcb_disconnect(xcb_connection_t* c)
+{
+    if(have_event_connections)
+        forget_event_connection(c);
+    forget_gamma_caches(c);
+    forget_property_caches(c);
+    forget_layout_lookup(c);
+#ifdef XCB_RANDR_GET_MONITORS
+    ++disconnect_serial;
+#endif
+    if(const auto real=next_symbol(&real_disconnect, "xcb_disconnect"))
+        real(c);
+}
+
+// --------------------- Output properties ---------------------------
+xcb_randr_list_output_properties_cookie_t xcb_randr_list_output_properties(xcb_connection_t* c, xcb_randr_output_t output)
+{
+    const auto cookie=_xcb_randr_list_output_properties(c, xid_unsplit(output));
+    PropertyRequest request;
+    request.opcode=XCB_RANDR_LIST_OUTPUT_PROPERTIES;
+    note_property_request(c, cookie.sequence, output, request);
+    return cookie;
+}
+xcb_randr_list_output_properties_cookie_t xcb_randr_list_output_properties_unchecked(xcb_connection_t* c, xcb_randr_output_t output)
+{
+    const auto cookie=_xcb_randr_list_output_properties_unchecked(c, xid_unsplit(output));
+    PropertyRequest request;
+    request.opcode=XCB_RANDR_LIST_OUTPUT_PROPERTIES;
+    note_property_request(c, cookie.sequence, output, request);
+    return cookie;
+}
+xcb_randr_list_output_properties_reply_t* xcb_randr_list_output_properties_reply(xcb_connection_t* c, xcb_randr_list_output_properties_cookie_t cookie,
+                                                                                 xcb_generic_error_t** e)
+{
+    return property_reply(c, cookie, e, _xcb_randr_list_output_properties_reply);
+}
+xcb_randr_query_output_property_cookie_t xcb_randr_query_output_property(xcb_connection_t* c, xcb_randr_output_t output, xcb_atom_t property)
+{
+    const auto cookie=_xcb_randr_query_output_property(c, xid_unsplit(output), property);
+    PropertyRequest request;
+    request.opcode=XCB_RANDR_QUERY_OUTPUT_PROPERTY;
+    request.property=property;
+    note_property_request(c, cookie.sequence, output, request);
+    return cookie;
+}
+xcb_randr_query_output_property_cookie_t xcb_randr_query_output_property_unchecked(xcb_connection_t* c, xcb_randr_output_t output, xcb_atom_t property)
+{
+    const auto cookie=_xcb_randr_query_output_property_unchecked(c, xid_unsplit(output), property);
+    PropertyRequest request;
+    request.opcode=XCB_RANDR_QUERY_OUTPUT_PROPERTY;
+    request.property=property;
+    note_property_request(c, cookie.sequence, output, request);
+    return cookie;
+}
+xcb_randr_query_output_property_reply_t* xcb_randr_query_output_property_reply(xcb_connection_t* c, xcb_randr_query_output_property_cookie_t cookie,
+                                                                               xcb_generic_error_t** e)
+{
+    return property_reply(c, cookie, e, _xcb_randr_query_output_property_reply);
+}
+static xcb_randr_get_output_property_cookie_t get_output_property(xcb_connection_t* c, xcb_randr_output_t output, xcb_atom_t property, xcb_atom_t type,
+                                                                  uint32_t long_offset, uint32_t long_length, uint8_t _delete, uint8_t pending,
+                                                                  bool checked)
+{
+    const auto cookie = checked ? _xcb_randr_get_output_property(c, xid_unsplit(output), property, type, long_offset, long_length, _delete, pending)
+                                : _xcb_randr_get_output_property_unchecked(c, xid_unsplit(output), property, type, long_offset, long_length, _delete, pending);
+    // Deleting reads change the property
+    if(_delete)
+    {
+        ++property_serial;
+        return cookie;
+    }
+    PropertyRequest request;
+    request.opcode=XCB_RANDR_GET_OUTPUT_PROPERTY;
+    request.property=property;
+    request.type=type;
+    request.offset=long_offset;
+    request.length=long_length;
+    request.pending=pending;
+    note_property_request(c, cookie.sequence, output, request);
+    return cookie;
+}
+xcb_randr_get_output_property_cookie_t xcb_randr_get_output_property(xcb_connection_t* c, xcb_randr_output_t output, xcb_atom_t property, xcb_atom_t type,
+                                                                     uint32_t long_offset, uint32_t long_length, uint8_t _delete, uint8_t pending)
+{
+    return get_output_property(c, output, property, type, long_offset, long_length, _delete, pending, true);
+}
+xcb_randr_get_output_property_cookie_t xcb_randr_get_output_property_unchecked(xcb_connection_t* c, xcb_randr_output_t output, xcb_atom_t property,
+                                                                               xcb_atom_t type, uint32_t long_offset, uint32_t long_length,
+                                                                               uint8_t _delete, uint8_t pending)
+{
+    return get_output_property(c, output, property, type, long_offset, long_length, _delete, pending, false);
+}
+xcb_randr_get_output_property_reply_t* xcb_randr_get_output_property_reply(xcb_connection_t* c, xcb_randr_get_output_property_cookie_t cookie,
+                                                                           xcb_generic_error_t** e)
+{
+    return property_reply(c, cookie, e, _xcb_randr_get_output_property_reply);
+}
+xcb_void_cookie_t xcb_randr_change_output_property(xcb_connection_t* c, xcb_randr_output_t output, xcb_atom_t property, xcb_atom_t type,
+                                                   uint8_t format, uint8_t mode, uint32_t num_units, const void* data)
+{
+    ++property_serial;
+    return _xcb_randr_change_output_property(c, xid_unsplit(output), property, type, format, mode, num_units, data);
+}
+xcb_void_cookie_t xcb_randr_change_output_property_checked(xcb_connection_t* c, xcb_randr_output_t output, xcb_atom_t property, xcb_atom_t type,
+                                                           uint8_t format, uint8_t mode, uint32_t num_units, const void* data)
+{
+    ++property_serial;
+    return _xcb_randr_change_output_property_checked(c, xid_unsplit(output), property, type, format, mode, num_units, data);
+}
+xcb_void_cookie_t xcb_randr_delete_output_property(xcb_connection_t* c, xcb_randr_output_t output, xcb_atom_t property)
+{
+    ++property_serial;
+    return _xcb_randr_delete_output_property(c, xid_unsplit(output), property);
+}
+xcb_void_cookie_t xcb_randr_delete_output_property_checked(xcb_connection_t* c, xcb_randr_output_t output, xcb_atom_t property)
+{
+    ++property_serial;
+    return _xcb_randr_delete_output_property_checked(c, xid_unsplit(output), property);
+}
+xcb_void_cookie_t xcb_randr_configure_output_property(xcb_connection_t* c, xcb_randr_output_t output, xcb_atom_t property, uint8_t pending,
+                                                      uint8_t range, uint32_t values_len, const int32_t* values)
+{
+    ++property_serial;
+    return _xcb_randr_configure_output_property(c, xid_unsplit(output), property, pending, range, values_len, values);
+}
+xcb_void_cookie_t xcb_randr_configure_output_property_checked(xcb_connection_t* c, xcb_randr_output_t output, xcb_atom_t property, uint8_t pending,
+                                                              uint8_t range, uint32_t values_len, const int32_t* values)
+{
+    ++property_serial;
+    return _xcb_randr_configure_output_property_checked(c, xid_unsplit(output), property, pending, range, values_len, values);
+}
+
+// --------------------- Gamma ---------------------------
+xcb_randr_get_crtc_gamma_size_cookie_t xcb_randr_get_crtc_gamma_size(xcb_connection_t* c, xcb_randr_crtc_t crtc)
+{
+    const auto cookie = _xcb_randr_get_crtc_gamma_size(c, xid_unsplit(crtc));
+    pthread_mutex_lock(&gamma_mutex);
+    gamma_size_cookies.insert(ConnectionCookie{c, cookie.sequence}, crtc);
+    pthread_mutex_unlock(&gamma_mutex);
+    return cookie;
+}
+xcb_randr_get_crtc_gamma_size_cookie_t xcb_randr_get_crtc_gamma_size_unchecked(xcb_connection_t* c, xcb_randr_crtc_t crtc)
+{
+    const auto cookie = _xcb_randr_get_crtc_gamma_size_unchecked(c, xid_unsplit(crtc));
+    pthread_mutex_lock(&gamma_mutex);
+    gamma_size_cookies.insert(ConnectionCookie{c, cookie.sequence}, crtc);
+    pthread_mutex_unlock(&gamma_mutex);
+    return cookie;
+}
+xcb_randr_get_crtc_gamma_size_reply_t* xcb_randr_get_crtc_gamma_size_reply(xcb_connection_t* c, xcb_randr_get_crtc_gamma_size_cookie_t cookie,
+                                                                           xcb_generic_error_t** e)
+{
+    xcb_randr_crtc_t crtc;
+    if(!take_gamma_cookie(gamma_size_cookies, c, cookie.sequence, crtc))
+        return _xcb_randr_get_crtc_gamma_size_reply(c, cookie, e);
+
+    pthread_mutex_lock(&gamma_mutex);
+    auto*const cache=find_gamma_cache(c, xid_unsplit(crtc));
+    const uint16_t size=cache->size && sibling_pass_join(&cache->size_pass, crtc) ? cache->size : 0;
+    pthread_mutex_unlock(&gamma_mutex);
+    if(size)
     {
-        if(output->xid!=outputId) continue;
-        return output->makeReturnValue();
+        xcb_discard_reply(c, cookie.sequence);
+        if(e)
+            *e=nullptr;
+        const auto p=static_cast<xcb_randr_get_crtc_gamma_size_reply_t*>(calloc(1, sizeof(xcb_randr_get_crtc_gamma_size_reply_t)));
+        p->response_type=1; // X_Reply
+        p->sequence=cookie.sequence;
+        p->size=size;
+        return p;
     }
-    return nullptr;
+
+    const auto reply=_xcb_randr_get_crtc_gamma_size_reply(c, cookie, e);
+    if(reply)
+    {
+        pthread_mutex_lock(&gamma_mutex);
+        cache->size=reply->size;
+        sibling_pass_start(&cache->size_pass, crtc);
+        pthread_mutex_unlock(&gamma_mutex);
+    }
+    return reply;
+}
+xcb_randr_get_crtc_gamma_cookie_t xcb_randr_get_crtc_gamma(xcb_connection_t* c, xcb_randr_crtc_t crtc)
+{
+    const auto cookie = _xcb_randr_get_crtc_gamma(c, xid_unsplit(crtc));
+    // The ramps are only cached for splits, see set_crtc_gamma()
+    if(!xid_is_split(crtc))
+        return cookie;
+    pthread_mutex_lock(&gamma_mutex);
+    gamma_cookies.insert(ConnectionCookie{c, cookie.sequence}, crtc);
+    pthread_mutex_unlock(&gamma_mutex);
+    return cookie;
+}
+xcb_randr_get_crtc_gamma_cookie_t xcb_randr_get_crtc_gamma_unchecked(xcb_connection_t* c, xcb_randr_crtc_t crtc)
+{
+    const auto cookie = _xcb_randr_get_crtc_gamma_unchecked(c, xid_unsplit(crtc));
+    if(!xid_is_split(crtc))
+        return cookie;
+    pthread_mutex_lock(&gamma_mutex);
+    gamma_cookies.insert(ConnectionCookie{c, cookie.sequence}, crtc);
+    pthread_mutex_unlock(&gamma_mutex);
+    return cookie;
+}
+xcb_randr_get_crtc_gamma_reply_t* xcb_randr_get_crtc_gamma_reply(xcb_connection_t* c, xcb_randr_get_crtc_gamma_cookie_t cookie, xcb_generic_error_t** e)
+{
+    xcb_randr_crtc_t crtc;
+    if(!take_gamma_cookie(gamma_cookies, c, cookie.sequence, crtc))
+        return _xcb_randr_get_crtc_gamma_reply(c, cookie, e);
+
+    xcb_randr_get_crtc_gamma_reply_t* copy=nullptr;
+    pthread_mutex_lock(&gamma_mutex);
+    auto*const cache=find_gamma_cache(c, xid_unsplit(crtc));
+    if(cache->ramps && sibling_pass_join(&cache->ramps_pass, crtc))
+    {
+        copy=static_cast<xcb_randr_get_crtc_gamma_reply_t*>(malloc(gamma_reply_size(cache->ramps)));
+        memcpy(copy, cache->ramps, gamma_reply_size(cache->ramps));
+    }
+    pthread_mutex_unlock(&gamma_mutex);
+    if(copy)
+    {
+        xcb_discard_reply(c, cookie.sequence);
+        if(e)
+            *e=nullptr;
+        copy->sequence=cookie.sequence;
+        return copy;
+    }
+
+    const auto reply=_xcb_randr_get_crtc_gamma_reply(c, cookie, e);
+    if(reply)
+    {
+        const auto ramps=static_cast<xcb_randr_get_crtc_gamma_reply_t*>(malloc(gamma_reply_size(reply)));
+        memcpy(ramps, reply, gamma_reply_size(reply));
+        pthread_mutex_lock(&gamma_mutex);
+        store_gamma(cache, crtc, ramps, xcb_void_cookie_t{0});
+        pthread_mutex_unlock(&gamma_mutex);
+    }
+    return reply;
+}
+static xcb_void_cookie_t set_crtc_gamma(xcb_connection_t* c, xcb_randr_crtc_t crtc, uint16_t size,
+                                        const uint16_t* red, const uint16_t* green, const uint16_t* blue, bool checked)
+{
+    // Without siblings there is no write to skip, so only drop what we knew
+    if(!xid_is_split(crtc))
+    {
+        pthread_mutex_lock(&gamma_mutex);
+        forget_gamma(c, crtc);
+        pthread_mutex_unlock(&gamma_mutex);
+        return checked ? _xcb_randr_set_crtc_gamma_checked(c, crtc, size, red, green, blue)
+                       : _xcb_randr_set_crtc_gamma(c, crtc, size, red, green, blue);
+    }
+
+    const auto ramps=make_gamma_reply(size, red, green, blue);
+    pthread_mutex_lock(&gamma_mutex);
+    auto*const cache=find_gamma_cache(c, xid_unsplit(crtc));
+    // The ramps of a skipped write are those a previous write of ours set
+    if(cache->ramps && cache->set_cookie.sequence && gamma_reply_size(cache->ramps)==gamma_reply_size(ramps) &&
+       memcmp(cache->ramps+1, ramps+1, gamma_reply_size(ramps)-sizeof(*ramps))==0 && cache->ramps->size==size &&
+       sibling_pass_join(&cache->ramps_pass, crtc))
+    {
+        pthread_mutex_unlock(&gamma_mutex);
+        free(ramps);
+        // The caller needs a cookie of its own, which a request without a
+        // reply gives at the least cost. A checked one can be checked.
+        return checked ? xcb_no_operation_checked(c) : xcb_no_operation(c);
+    }
+    pthread_mutex_unlock(&gamma_mutex);
+
+    const auto cookie = checked ? _xcb_randr_set_crtc_gamma_checked(c, xid_unsplit(crtc), size, red, green, blue)
+                                : _xcb_randr_set_crtc_gamma(c, xid_unsplit(crtc), size, red, green, blue);
+    pthread_mutex_lock(&gamma_mutex);
+    store_gamma(cache, crtc, ramps, cookie);
+    pthread_mutex_unlock(&gamma_mutex);
+    return cookie;
+}
+xcb_void_cookie_t xcb_randr_set_crtc_gamma_checked(xcb_connection_t* c, xcb_randr_crtc_t crtc, uint16_t size,
+                                                   const uint16_t* red, const uint16_t* green, const uint16_t* blue)
+{
+    return set_crtc_gamma(c, crtc, size, red, green, blue, true);
+}
+xcb_void_cookie_t xcb_randr_set_crtc_gamma(xcb_connection_t* c, xcb_randr_crtc_t crtc, uint16_t size,
+                                           const uint16_t* red, const uint16_t* green, const uint16_t* blue)
+{
+    return set_crtc_gamma(c, crtc, size, red, green, blue, false);
+}
+
+#ifdef XCB_RANDR_GET_MONITORS
+xcb_randr_get_monitors_reply_t* xcb_randr_get_monitors_reply(xcb_connection_t* c, xcb_randr_get_monitors_cookie_t cookie, xcb_generic_error_t** e)
+{
+    const auto reply=_xcb_randr_get_monitors_reply(c, cookie, e);
+    if(!reply)
+        return reply;
+    return augment_monitors_reply(c, reply);
+}
+#endif
+
+/*
+    Interface for our libxcb-xinerama
+
+    Replaces those of the given Xinerama screens which were split by their
+    splits. Returns the new number of screens, with a malloc()ed array of them
+    in *result, or -1 if no screen is split.
+*/
+int _fakexrandr_xinerama_screens(xcb_connection_t* c, FakeScreenRect const* screens, int num_screens, FakeScreenRect** result)
+{
+    if(num_screens <= 0)
+        return -1;
+    const auto layout=acquire_current_layout(c, screens, num_screens);
+    if(!layout || !layout->fake_crtcs)
+    {
+        release(layout);
+        return -1;
+    }
+
+    const auto out=static_cast<FakeScreenRect*>(malloc((num_screens+list_length(layout->fake_crtcs))*sizeof(FakeScreenRect)));
+    int num_out=0;
+    for(int i=0; i<num_screens; ++i)
+    {
+        bool replaced=false;
+        for_each_split_parent(layout, [&](FakeScreenRect const& parent, FakeCrtcInfo* first, FakeCrtcInfo* end)
+        {
+            if(replaced || !same_rect(parent, screens[i]))
+                return;
+            for(auto* crtc=first; crtc!=end; crtc=crtc->nextInList)
+                out[num_out++]=split_rect(crtc);
+            replaced=true;
+        });
+        if(!replaced)
+            out[num_out++]=screens[i];
+    }
+    release(layout);
+
+    *result=out;
+    return num_out;
+}
+
+// Whether any output is split, for xcb_xinerama_is_active
+int _fakexrandr_xinerama_active(xcb_connection_t* c)
+{
+    const auto layout=acquire_current_layout(c, nullptr, 0);
+    const bool active=layout && layout->fake_crtcs;
+    release(layout);
+    return active;
+}
+
+/*
+    Public layout API, see fakexrandr-layout.h
+
+    Both answer from the current layout. The generation is the serial of
+    that layout, so it changes whenever the layout is rebuilt.
+*/
+int fakexrandr_xcb_get_layout(xcb_connection_t* c, FakexrandrMonitor** monitors, int* count)
+{
+    *monitors=nullptr;
+    *count=0;
+    const auto layout=acquire_current_layout(c, nullptr, 0);
+    if(!layout)
+        return 1;
+
+    const int n=list_length(layout->fake_outputs);
+    size_t size=n*sizeof(FakexrandrMonitor);
+    for(auto* output=layout->fake_outputs; output; output=output->nextInList)
+        size+=output->orig_output_info.name_len+1;
+    const auto result=static_cast<FakexrandrMonitor*>(n ? malloc(size) : nullptr);
+    if(n && !result)
+    {
+        release(layout);
+        return 1;
+    }
+    auto* name=reinterpret_cast<char*>(result+n);
+    // The fake output and CRTC of a split are created together, so the lists run in parallel
+    auto* crtc=layout->fake_crtcs;
+    int i=0;
+    for(auto* output=layout->fake_outputs; output; output=output->nextInList, crtc=crtc->nextInList, ++i)
+    {
+        const auto& info=crtc->orig_crtc_info;
+        result[i]=FakexrandrMonitor{name, output->xid, output->parent_xid, info.x, info.y, info.width, info.height,
+                                    output->orig_output_info.mm_width, output->orig_output_info.mm_height};
+        memcpy(name, output->name, output->orig_output_info.name_len+1);
+        name+=output->orig_output_info.name_len+1;
+    }
+    release(layout);
+
+    *monitors=result;
+    *count=n;
+    return 0;
+}
+
+unsigned int fakexrandr_xcb_layout_generation(xcb_connection_t* c)
+{
+    const auto layout=acquire_current_layout(c, nullptr, 0);
+    if(!layout)
+        return 0;
+    const unsigned result=layout->serial;
+    release(layout);
+    return result;
 }
 
-xcb_extension_t xcb_randr_id;
+// Like the real library's. libxcb assigns the id on first use.
+xcb_extension_t xcb_randr_id = { "RANDR", 0 };
 } // extern "C"
@@ -0,0 +1,113 @@
+/*
+    FakeXRandR
+
+    This is a replacement library for libxcb-xinerama.so. It reports outputs
+    which are split by libxcb-randr.so as multiple Xinerama screens.
+*/
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <xcb/xcbext.h>
+#include <xcb/xinerama.h>
+#include <xcb/xcb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <algorithm>
+
+#include "fakexrandr.h"
+
+extern "C"
+{
+static void* real_symbol(const char* name)
+{
+    static void* xinerama_lib;
+    return real_library_symbol(&xinerama_lib, REAL_XCB_XINERAMA_LIB, name);
+}
+
+/*
+    The skeleton file is created by ./make_skeleton.py
+
+    It contains wrappers around all XCB Xinerama functions which are not
+    explicitly defined in this C file.
+*/
+#include "skeleton-xcb-xinerama.h"
+}
+
+namespace
+{
+
+static_assert(sizeof(FakeScreenRect)==sizeof(xcb_xinerama_screen_info_t), "FakeScreenRect must match the wire format");
+
+/*
+    The layout itself is owned by our libxcb-randr.so, which exports these
+    functions. If the libxcb-randr.so.0 in the search path is the real one,
+    we simply pass everything through.
+*/
+int (*_fakexrandr_xinerama_screens)(xcb_connection_t* c, FakeScreenRect const* screens, int num_screens, FakeScreenRect** result);
+int (*_fakexrandr_xinerama_active)(xcb_connection_t* c);
+
+// Looked up on first use, like the real library's functions
+pthread_once_t fake_randr_once = PTHREAD_ONCE_INIT;
+void find_fake_randr()
+{
+    static void* fake_randr_lib;
+    _fakexrandr_xinerama_screens = (decltype(_fakexrandr_xinerama_screens))real_library_symbol(&fake_randr_lib, "libxcb-randr.so.0", "_fakexrandr_xinerama_screens");
+    _fakexrandr_xinerama_active = (decltype(_fakexrandr_xinerama_active))real_library_symbol(&fake_randr_lib, "libxcb-randr.so.0", "_fakexrandr_xinerama_active");
+}
+void load_fake_randr()
+{
+    pthread_once(&fake_randr_once, find_fake_randr);
+}
+
+} // namespace
+
+/*
+    Overridden library functions to add the fake screens
+*/
+
+extern "C"
+{
+xcb_xinerama_query_screens_reply_t* xcb_xinerama_query_screens_reply(xcb_connection_t* c,
+                                                                     xcb_xinerama_query_screens_cookie_t cookie,
+                                                                     xcb_generic_error_t** e)
+{
+    const auto reply=_xcb_xinerama_query_screens_reply(c, cookie, e);
+    load_fake_randr();
+    if(!reply || !_fakexrandr_xinerama_screens)
+        return reply;
+
+    FakeScreenRect* screens;
+    const auto origScreens=reinterpret_cast<FakeScreenRect const*>(_xcb_xinerama_query_screens_screen_info(reply));
+    const int num_screens=_fakexrandr_xinerama_screens(c, origScreens, reply->number, &screens);
+    if(num_screens < 0)
+        return reply;
+
+    const auto p=static_cast<xcb_xinerama_query_screens_reply_t*>(malloc(sizeof(*reply)+num_screens*sizeof(xcb_xinerama_screen_info_t)));
+    // Copy fixed-size part
+    *p=*reply;
+    // Now fill in the variable-length data
+    p->number=num_screens;
+    p->length=num_screens*sizeof(xcb_xinerama_screen_info_t)/4;
+    std::copy_n(screens, num_screens, reinterpret_cast<FakeScreenRect*>(_xcb_xinerama_query_screens_screen_info(p)));
+
+    free(screens);
+    free(reply);
+    return p;
+}
+
+xcb_xinerama_is_active_reply_t* xcb_xinerama_is_active_reply(xcb_connection_t* c, xcb_xinerama_is_active_cookie_t cookie, xcb_generic_error_t** e)
+{
+    const auto reply=_xcb_xinerama_is_active_reply(c, cookie, e);
+    load_fake_randr();
+    if(reply && !reply->state && _fakexrandr_xinerama_active && _fakexrandr_xinerama_active(c))
+        reply->state=1;
+    return reply;
+}
+
+// Like the real library's. libxcb assigns the id on first use.
+xcb_extension_t xcb_xinerama_id = { "XINERAMA", 0 };
+} // extern "C"
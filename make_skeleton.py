@@ -26,34 +26,103 @@ ccode = open(source_file).read()
 print("""
 /* This file was automatically generated by ./make_skeleton.py */
 #include <%s>
+
+#ifdef __cplusplus
+#    define CAST_DLSYM_TO_TYPE_OF(x) (decltype(x))
+#else
+#    define CAST_DLSYM_TO_TYPE_OF(x)
+#endif
 """ % extfile)
 
+# Each _fn_pointer starts out at a stub which looks up the real function with
+# real_symbol(), defined by the including file, on its first call. Threads may
+# call the stub concurrently, so the pointer is only accessed atomically, and
+# _fn reads it.
+def print_pointer(rettype, name, par_def, par_call):
+    returnv = "return " if rettype.lower() != "void" else ""
+    print(("static {ret} _lazy_{fn}({par_def});\n"
+           "static {ret} (*_{fn}_pointer)({par_def}) = _lazy_{fn};\n"
+           "#define _{fn} (__atomic_load_n(&_{fn}_pointer, __ATOMIC_ACQUIRE))\n"
+           "static {ret} _lazy_{fn}({par_def}) {{\n"
+           "__atomic_store_n(&_{fn}_pointer, CAST_DLSYM_TO_TYPE_OF(_{fn}_pointer)real_symbol(\"{fn}\"), __ATOMIC_RELEASE);\n"
+           "{returnv}_{fn}({par_call});\n"
+           "}}\n").format(
+               ret=rettype,
+               fn=name,
+               returnv=returnv,
+               par_def=par_def,
+               par_call=par_call
+           ))
+
 functions = re.findall(r"(?m)^(\w+(?:\s*\*+)?)\s*(%s\w+)\s*\(([^)]+)\);" % prefix,
                        output)
 
+# In C++ sources, the wrappers hand their arguments to forward() from
+# fakexrandr.h, marking those which are XIDs or arrays of XIDs of the prefixed
+# types. These are typedefs of integers, so only their declaration tells them
+# apart. Arrays need a length parameter, named <array>_len or num_<array>;
+# arrays without one are marked such that the build fails.
+cplusplus = source_file.endswith(".cpp")
+
+def parse_parameter(x):
+    x = x.split()
+    name = x[-1].replace("*", "")
+    pointer = "*" in " ".join(x)
+    base = [t.replace("*", "") for t in x[:-1] if t != "const"]
+    base = " ".join(t for t in base if t)
+    return name, pointer, base
+
+seen = set()
 for function in functions:
     rettype, name, parameters = function
+    if name in seen:
+        continue
+    seen.add(name)
     parameter_array = re.split("\s*,\s*", parameters)
+    if parameter_array == ["void"]:
+        parameter_array = []
+    parsed = [parse_parameter(x) for x in parameter_array]
+    names = [p[0] for p in parsed]
     call = []
+    marked = []
     actions = []
     warning = ""
 
-    for x in parameter_array:
-        x = x.split()
-        param = x[-1].replace("*", "")
+    for param, pointer, base in parsed:
         call.append(param)
-        if param != x[-1]:
-            if x[0] in prefixed_types:
-                warning = ("\033[31mWarning\033[0m: In {name}: parameter "
-                    "{param} unhandled").format( name=name, param=" ".join(x))
+        if base not in prefixed_types:
+            marked.append(param)
             continue
-        if x[0] in prefixed_types:
+        if not pointer:
+            marked.append("SplitXid{{{param}}}".format(param=param))
             actions.append(
-                " {param} = {param} & ~XID_SPLIT_MASK;".format(param=param))
+                " {param} = xid_unsplit({param});".format(param=param))
+            continue
+        length = [n for n in ("%s_len" % param, "num_%s" % param) if n in names]
+        if length:
+            marked.append("SplitXids<{base}>{{{param}, {length}}}".format(
+                base=base, param=param, length=length[0]))
+        else:
+            marked.append("UnhandledXids<{base}>{{{param}}}".format(
+                base=base, param=param))
+        warning = ("\033[31mWarning\033[0m: In {name}: parameter "
+            "{param} unhandled").format(name=name, param=" ".join(
+                parameter_array[names.index(param)].split()))
 
+    par_def = ", ".join(parameter_array) or "void"
+    print_pointer(rettype, name, par_def, ", ".join(call))
     if re.search("(?<!_){}\\b".format(name), ccode):
-        print(("static {ret} (*_{fn})({par_def});\n".format(
-            ret=rettype, par_def=", ".join(parameter_array), fn=name)))
+        continue
+
+    if cplusplus:
+        print(("{ret} {fn}({par_def}) {{\n"
+              "return forward(_{fn}{args});\n"
+              "}}\n\n").format(
+                  ret=rettype,
+                  fn=name,
+                  par_def=par_def,
+                  args="".join(", " + m for m in marked)
+              ))
         continue
 
     if warning:
@@ -62,8 +131,7 @@ for function in functions:
     if actions:
         actions.append("")
     returnv = "return " if rettype.lower() != "void" else ""
-    print(("static {ret} (*_{fn})({par_def});\n"
-          "{ret} {fn}({par_def}) {{\n"
+    print(("{ret} {fn}({par_def}) {{\n"
           "{actions}"
           "{returnv}_{fn}({par_call});\n"
           "}}\n\n").format(
@@ -71,17 +139,6 @@ for function in functions:
               fn=name,
               returnv=returnv,
               actions="\n".join(actions),
-              par_def=", ".join(parameter_array),
+              par_def=par_def,
               par_call=", ".join(call)
           ))
-
-defns = []
-print("#ifdef __cplusplus\n"
-      "#    define CAST_DLSYM_TO_TYPE_OF(x) (decltype(x))\n"
-      "#else\n"
-      "#    define CAST_DLSYM_TO_TYPE_OF(x)\n"
-      "#endif\n")
-for function in functions:
-    defns.append("_{fn} = CAST_DLSYM_TO_TYPE_OF(_{fn})dlsym(xrandr_lib, \"{fn}\")".format(fn=function[1]))
-print("#define FUNCTION_POINTER_INITIALIZATIONS {defns}".format(
-    defns="; ".join(defns)))